@@ -0,0 +1,137 @@
+// Multi-threaded microbenchmark for the key-value index.
+// Compares the old std::unordered_map guarded by one shared_mutex (with the key copied into
+// every call, as isKeyPresent/writeNewKey used to do) against ShardedKeyIndex.
+//
+// Usage: kv_index_bench [num_keys] [ops_per_thread] [max_threads] [insert_percentage]
+
+#include <iostream>
+#include <iomanip>
+#include <string>
+#include <vector>
+#include <thread>
+#include <random>
+#include <chrono>
+#include <memory>
+#include <shared_mutex>
+#include <unordered_map>
+#include <functional>
+
+#include "../utils/sharded_key_index.h"
+
+struct Value {
+    std::string _key;
+    std::string value;
+    Value(const std::string &key, const std::string &value) : _key(key), value(value) {}
+
+    absl::string_view key() const {
+        return _key;
+    }
+};
+
+// The index as it was before ShardedKeyIndex
+class GlobalLockIndex {
+private:
+    std::unordered_map<std::string, std::unique_ptr<Value>> _map;
+    std::shared_mutex _mutex;
+
+public:
+    Value* find(std::string key) {
+        std::shared_lock<std::shared_mutex> lock(_mutex);
+        auto it = _map.find(key);
+        return it == _map.end() ? nullptr : it->second.get();
+    }
+
+    Value* findOrInsert(std::string key, std::string value) {
+        Value *found = find(key);
+        if (found != nullptr) {
+            return found;
+        }
+        std::unique_lock<std::shared_mutex> lock(_mutex);
+        auto& slot = _map[key];
+        if (!slot) {
+            slot = std::make_unique<Value>(key, value);
+        }
+        return slot.get();
+    }
+};
+
+class ShardedIndex {
+private:
+    ShardedKeyIndex<Value> _index;
+
+public:
+    Value* find(const std::string &key) {
+        return _index.find(key, _index.hash(key));
+    }
+
+    Value* findOrInsert(const std::string &key, const std::string &value) {
+        return _index.findOrInsert(key, _index.hash(key), [&] {return std::make_unique<Value>(key, value);}).first;
+    }
+};
+
+template <typename Index>
+double run(Index &index, const std::vector<std::string> &keys, uint64_t ops_per_thread,
+        int num_threads, int insert_percentage) {
+    std::vector<std::thread> threads;
+    auto start = std::chrono::steady_clock::now();
+    for (int t = 0; t < num_threads; t++) {
+        threads.emplace_back([&, t] {
+            std::mt19937_64 rng(t);
+            std::uniform_int_distribution<size_t> key_dist(0, keys.size() - 1);
+            std::uniform_int_distribution<int> op_dist(0, 99);
+            uint64_t found = 0;
+            for (uint64_t i = 0; i < ops_per_thread; i++) {
+                auto& key = keys[key_dist(rng)];
+                if (op_dist(rng) < insert_percentage) {
+                    found += index.findOrInsert(key, key) != nullptr;
+                }
+                else {
+                    found += index.find(key) != nullptr;
+                }
+            }
+            // Keep the loop from being optimized away
+            if (found == ops_per_thread + 1) {
+                std::cout << "";
+            }
+        });
+    }
+    for (auto& thread: threads) {
+        thread.join();
+    }
+    auto end = std::chrono::steady_clock::now();
+    double secs = std::chrono::duration<double>(end - start).count();
+    return (ops_per_thread * num_threads) / secs / 1e6;
+}
+
+int main(int argc, char** argv) {
+    size_t num_keys = argc > 1 ? std::stoul(argv[1]) : 100000;
+    uint64_t ops_per_thread = argc > 2 ? std::stoull(argv[2]) : 1000000;
+    int max_threads = argc > 3 ? std::stoi(argv[3]) : std::max(1u, std::thread::hardware_concurrency());
+    int insert_percentage = argc > 4 ? std::stoi(argv[4]) : 5;
+
+    std::vector<std::string> keys;
+    for (size_t i = 0; i < num_keys; i++) {
+        keys.push_back("K" + std::to_string(i));
+    }
+
+    std::cout << "keys=" << num_keys << " ops/thread=" << ops_per_thread
+              << " insert%=" << insert_percentage << " (Mops/s)\n";
+    std::cout << std::setw(8) << "threads" << std::setw(14) << "global_lock" << std::setw(14) << "sharded" << "\n";
+    for (int threads = 1; threads <= max_threads; threads *= 2) {
+        GlobalLockIndex global_index;
+        ShardedIndex sharded_index;
+        // Half the keys exist up front, the rest are inserted by the benchmark
+        for (size_t i = 0; i < num_keys; i += 2) {
+            global_index.findOrInsert(keys[i], keys[i]);
+            sharded_index.findOrInsert(keys[i], keys[i]);
+        }
+        double global = run(global_index, keys, ops_per_thread, threads, insert_percentage);
+        double sharded = run(sharded_index, keys, ops_per_thread, threads, insert_percentage);
+        std::cout << std::setw(8) << threads << std::setw(14) << std::fixed << std::setprecision(2) << global
+                  << std::setw(14) << sharded << "\n";
+        if (threads < max_threads && threads * 2 > max_threads) {
+            threads = max_threads / 2;
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,149 @@
+// Cost of server logging on the request path, in requests/s of a loop that only logs what a
+// coordinator logs for one write (7 messages at info before this change, plus a few at debug).
+//  - sync: the old setup, a file sink written and flushed on every message by the request
+//    thread, the thread id formatted per message and the ack counts concatenated
+//  - async: the same messages queued for a background thread (--async_logging)
+//  - filtered: the per-request messages at debug with the level at info, i.e. the default
+//  - off: the per-request messages compiled out (log_bench_nolog, built with
+//    SPDLOG_ACTIVE_LEVEL=SPDLOG_LEVEL_OFF)
+//
+// Usage: log_bench [dir] [threads] [seconds]
+
+#include <atomic>
+#include <chrono>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "spdlog/include/spdlog/spdlog.h"
+#include "spdlog/include/spdlog/async.h"
+#include "spdlog/include/spdlog/sinks/basic_file_sink.h"
+
+std::string formatTid() {
+    std::stringstream ss;
+    ss << std::this_thread::get_id();
+    return ss.str();
+}
+
+const std::string& cachedTid() {
+    thread_local const std::string tid = formatTid();
+    return tid;
+}
+
+const uint32_t acks_received = 2;
+
+// Messages of one write before this change
+void oldWrite(spdlog::logger *logger, const std::string &key, const std::string &value) {
+    SPDLOG_LOGGER_INFO(logger, "[{}]::Received Write Request!", formatTid());
+    SPDLOG_LOGGER_DEBUG(logger, "[{}]::key: {}, value: {}", formatTid(), key, value);
+    SPDLOG_LOGGER_INFO(logger, "[{}]::Broadcasting INVALIDATE RPCs for key {}", formatTid(), key);
+    SPDLOG_LOGGER_TRACE(logger, "[{}]::Sending invalidate to {}", formatTid(), "localhost:50051");
+    SPDLOG_LOGGER_TRACE(logger, "[{}]::Sending invalidate to {}", formatTid(), "localhost:50052");
+    SPDLOG_LOGGER_INFO(logger, "[{}]::Broadcasted Invalidate RPCs", formatTid());
+    SPDLOG_LOGGER_INFO(logger, "[{}]::Received " + std::to_string(acks_received) + " acks", formatTid());
+    SPDLOG_LOGGER_INFO(logger, "[{}]::Received " + std::to_string(acks_received) + " acceptances", formatTid());
+    SPDLOG_LOGGER_INFO(logger, "[{}]::Broadcasting VALIDATE RPCs", formatTid());
+    SPDLOG_LOGGER_INFO(logger, "[{}]::Broadcasted validate RPCs", formatTid());
+}
+
+// The same messages with the cached thread id and format arguments, at `level`
+#define LOG_WRITE(level)                                                                              \
+    SPDLOG_LOGGER_##level(logger, "[{}]::Received Write Request!", cachedTid());                      \
+    SPDLOG_LOGGER_DEBUG(logger, "[{}]::key: {}, value: {}", cachedTid(), key, value);                 \
+    SPDLOG_LOGGER_##level(logger, "[{}]::Broadcasting INVALIDATE RPCs for key {}", cachedTid(), key); \
+    SPDLOG_LOGGER_TRACE(logger, "[{}]::Sending invalidate to {}", cachedTid(), "localhost:50051");    \
+    SPDLOG_LOGGER_TRACE(logger, "[{}]::Sending invalidate to {}", cachedTid(), "localhost:50052");    \
+    SPDLOG_LOGGER_##level(logger, "[{}]::Broadcasted Invalidate RPCs", cachedTid());                  \
+    SPDLOG_LOGGER_##level(logger, "[{}]::Received {} acks", cachedTid(), acks_received);              \
+    SPDLOG_LOGGER_##level(logger, "[{}]::Received {} acceptances", cachedTid(), acks_received);       \
+    SPDLOG_LOGGER_##level(logger, "[{}]::Broadcasting VALIDATE RPCs", cachedTid());                   \
+    SPDLOG_LOGGER_##level(logger, "[{}]::Broadcasted validate RPCs", cachedTid());
+
+void newWrite(spdlog::logger *logger, const std::string &key, const std::string &value) {
+    LOG_WRITE(INFO)
+}
+
+void filteredWrite(spdlog::logger *logger, const std::string &key, const std::string &value) {
+    LOG_WRITE(DEBUG)
+}
+
+double fileMb(const std::string &path) {
+    struct stat st;
+    return ::stat(path.c_str(), &st) == 0 ? st.st_size / 1e6 : 0;
+}
+
+void run(const std::string &mode, std::shared_ptr<spdlog::logger> logger,
+        void (*write)(spdlog::logger*, const std::string&, const std::string&),
+        const std::string &path, uint32_t num_threads, double seconds) {
+    std::atomic<bool> stop {false};
+    std::atomic<uint64_t> requests {0};
+    std::vector<std::thread> threads;
+    auto start = std::chrono::steady_clock::now();
+    for (uint32_t t = 0; t < num_threads; t++) {
+        threads.emplace_back([&, t] {
+            std::string value(100, 'v');
+            uint64_t n = 0;
+            while (!stop.load(std::memory_order_relaxed)) {
+                write(logger.get(), "key" + std::to_string(t * 1000000 + n % 1000000), value);
+                n++;
+            }
+            requests += n;
+        });
+    }
+    std::this_thread::sleep_for(std::chrono::duration<double>(seconds));
+    stop = true;
+    for (auto &thread: threads) {
+        thread.join();
+    }
+    double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    // Let the async logger drain its queue
+    logger->flush();
+    std::this_thread::sleep_for(std::chrono::milliseconds(200));
+    std::cout << std::left << std::setw(10) << mode << std::right << std::setw(8) << num_threads
+              << std::fixed << std::setprecision(0) << std::setw(14) << requests / elapsed
+              << std::setprecision(1) << std::setw(10) << fileMb(path) << "\n";
+    spdlog::drop(logger->name());
+    ::unlink(path.c_str());
+}
+
+int main(int argc, char **argv) {
+    std::string dir = argc > 1 ? argv[1] : "/tmp";
+    uint32_t num_threads = argc > 2 ? std::stoul(argv[2]) : 8;
+    double seconds = argc > 3 ? std::stod(argv[3]) : 3;
+
+    std::cout << std::left << std::setw(10) << "mode" << std::right << std::setw(8) << "threads"
+              << std::setw(14) << "requests/s" << std::setw(10) << "log MB" << "\n";
+#if SPDLOG_ACTIVE_LEVEL == SPDLOG_LEVEL_OFF
+    std::string path = dir + "/log_bench_off.log";
+    auto logger = spdlog::basic_logger_mt("off", path, true);
+    logger->set_level(spdlog::level::info);
+    run("off", logger, filteredWrite, path, num_threads, seconds);
+#else
+    std::string path = dir + "/log_bench_sync.log";
+    auto logger = spdlog::basic_logger_mt("sync", path, true);
+    logger->set_level(spdlog::level::info);
+    logger->flush_on(spdlog::level::info);
+    run("sync", logger, oldWrite, path, num_threads, seconds);
+
+    // Same queue and overflow policy as the server with --async_logging
+    path = dir + "/log_bench_async.log";
+    spdlog::init_thread_pool(8192, 1);
+    logger = spdlog::create_async_nb<spdlog::sinks::basic_file_sink_mt>("async", path, true);
+    logger->set_level(spdlog::level::info);
+    logger->flush_on(spdlog::level::warn);
+    run("async", logger, newWrite, path, num_threads, seconds);
+    std::cout << "async messages dropped: " << spdlog::thread_pool()->overrun_counter() << "\n";
+
+    path = dir + "/log_bench_filtered.log";
+    logger = spdlog::basic_logger_mt("filtered", path, true);
+    logger->set_level(spdlog::level::info);
+    run("filtered", logger, filteredWrite, path, num_threads, seconds);
+#endif
+    return 0;
+}
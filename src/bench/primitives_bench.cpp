@@ -0,0 +1,300 @@
+// Thread scaling of the hot primitives of the server, to catch contention regressions before a
+// cluster run:
+//  - value.*: the HermesValue transitions and wait paths, with every thread on its own key
+//    (private) or all threads on one key (shared)
+//  - value.wakeup: pairs of threads handing a key back and forth through the wait path, i.e.
+//    the latency of a VALIDATE waking up a stalled request
+//  - set.* and map.*: ThreadSafeUnorderedSet and ThreadSafeUnorderedMap
+//  - membership.read: the replica set snapshot every invalidation round takes, while another
+//    thread publishes a new view every millisecond
+//  - lookup.read: the Read path, hash + ShardedKeyIndex::find + read_if_valid, on uniformly
+//    random keys (private) or on one hot key (shared)
+//
+// Usage: primitives_bench [max_threads] [ms_per_run] [filter]
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "../server/membership.h"
+#include "../server/state.h"
+#include "../utils/sharded_key_index.h"
+#include "../utils/threadsafe_unordered_map.h"
+#include "../utils/threadsafe_unordered_set.h"
+
+namespace {
+
+uint32_t ms_per_run = 300;
+
+// Runs op(i) in batches till `stop` is set, returns the number of ops
+template <typename Op>
+uint64_t loop(const std::atomic<bool> &stop, Op &&op) {
+    uint64_t n = 0;
+    while (!stop.load(std::memory_order_relaxed)) {
+        for (uint64_t i = 0; i < 64; i++) {
+            op(n + i);
+        }
+        n += 64;
+    }
+    return n;
+}
+
+// Runs body(thread, stop) on `threads` threads for ms_per_run and prints the throughput.
+// body returns the number of ops it did
+template <typename Body>
+void run(const std::string &name, const std::string &keys, uint32_t threads, Body &&body) {
+    std::atomic<bool> stop {false};
+    std::atomic<uint32_t> ready {0};
+    std::atomic<uint64_t> ops {0};
+    std::vector<std::thread> workers;
+    for (uint32_t t = 0; t < threads; t++) {
+        workers.emplace_back([&, t] {
+            ready++;
+            while (ready.load() < threads) {}
+            ops += body(t, stop);
+        });
+    }
+    while (ready.load() < threads) {}
+    auto start = std::chrono::steady_clock::now();
+    std::this_thread::sleep_for(std::chrono::milliseconds(ms_per_run));
+    stop = true;
+    double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    for (auto& worker: workers) {
+        worker.join();
+    }
+    double total = ops.load();
+    std::cout << std::left << std::setw(22) << name << std::setw(9) << keys << std::right
+              << std::setw(8) << threads << std::fixed << std::setprecision(2)
+              << std::setw(12) << total / elapsed / 1e6 << std::setprecision(1)
+              << std::setw(12) << (total > 0 ? threads * elapsed * 1e9 / total : 0) << "\n";
+}
+
+std::vector<HermesValue::Ptr> makeValues(uint32_t count, const std::string &value) {
+    std::vector<HermesValue::Ptr> values;
+    for (uint32_t i = 0; i < count; i++) {
+        values.push_back(HermesValue::create("key" + std::to_string(i), value, 1));
+    }
+    return values;
+}
+
+// Runs `name` with private keys and with one shared key. op(value, thread, i)
+template <typename Op>
+void runValueCase(const std::string &name, uint32_t threads, Op &&op) {
+    std::string value(32, 'v');
+    for (bool shared: {false, true}) {
+        auto values = makeValues(shared ? 1 : threads, value);
+        run(name, shared ? "shared" : "private", threads, [&](uint32_t t, const std::atomic<bool> &stop) {
+            HermesValue *hermes_val = values[shared ? 0 : t].get();
+            return loop(stop, [&](uint64_t i) {op(hermes_val, t, i);});
+        });
+    }
+}
+
+void valueCases(uint32_t threads, const std::string &filter) {
+    std::string value(32, 'v');
+    auto matches = [&](const std::string &name) {return name.find(filter) != std::string::npos;};
+
+    if (matches("value.read_if_valid")) {
+        runValueCase("value.read_if_valid", threads, [](HermesValue *hermes_val, uint32_t t, uint64_t i) {
+            thread_local std::string out;
+            hermes_val->read_if_valid(out);
+        });
+    }
+    if (matches("value.write")) {
+        // A coordinator write without the invalidation round
+        runValueCase("value.write", threads, [&](HermesValue *hermes_val, uint32_t t, uint64_t i) {
+            TimestampChange change;
+            if (hermes_val->coord_valid_to_write_transition(value, t, &change)) {
+                hermes_val->coord_write_to_valid_transition();
+            }
+        });
+    }
+    if (matches("value.invalidate")) {
+        // A follower applying an INV and its VAL
+        runValueCase("value.invalidate", threads, [&](HermesValue *hermes_val, uint32_t t, uint64_t i) {
+            HermesTimestamp ts;
+            ts.set_local_ts(i + 1);
+            ts.set_node_id(t);
+            hermes_val->fol_invalidate(value, ts);
+            hermes_val->fol_invalid_to_valid_transition();
+        });
+    }
+    if (matches("value.is_lower")) {
+        runValueCase("value.is_lower", threads, [](HermesValue *hermes_val, uint32_t t, uint64_t i) {
+            HermesTimestamp ts;
+            ts.set_local_ts(i);
+            ts.set_node_id(t);
+            volatile bool lower = hermes_val->is_lower(ts);
+            (void)lower;
+        });
+    }
+    if (matches("value.wait_valid")) {
+        // What a stalled request pays when the key is already VALID
+        runValueCase("value.wait_valid", threads, [](HermesValue *hermes_val, uint32_t t, uint64_t i) {
+            hermes_val->wait_till_valid_or_timeout(std::chrono::seconds(1));
+        });
+    }
+    if (matches("value.wakeup") && threads >= 2 && threads % 2 == 0) {
+        // Threads 2k and 2k+1 share keys a and b. Each waits for its key to become VALID, takes it
+        // out of VALID and validates the other key, which wakes up the other thread
+        auto values = makeValues(threads, value);
+        TimestampChange change;
+        for (uint32_t t = 1; t < threads; t += 2) {
+            values[t]->coord_valid_to_write_transition(value, t, &change);
+        }
+        run("value.wakeup", "pairs", threads, [&](uint32_t t, const std::atomic<bool> &stop) {
+            HermesValue *mine = values[t].get();
+            HermesValue *other = values[t ^ 1].get();
+            uint64_t n = 0;
+            while (!stop.load(std::memory_order_relaxed)) {
+                if (!mine->wait_till_valid_or_timeout(std::chrono::seconds(1))) {
+                    continue;
+                }
+                TimestampChange change;
+                if (!mine->coord_valid_to_write_transition(value, t, &change)) {
+                    continue;
+                }
+                other->coord_write_to_valid_transition();
+                n++;
+            }
+            // Let the other thread of the pair finish its last wait
+            other->coord_write_to_valid_transition();
+            return n;
+        });
+    }
+}
+
+void containerCases(uint32_t threads, const std::string &filter) {
+    auto matches = [&](const std::string &name) {return name.find(filter) != std::string::npos;};
+
+    if (matches("set.contains")) {
+        ThreadSafeUnorderedSet<uint32_t> set;
+        for (uint32_t i = 0; i < 5; i++) {
+            set.insert(50050 + i);
+        }
+        run("set.contains", "shared", threads, [&](uint32_t t, const std::atomic<bool> &stop) {
+            return loop(stop, [&](uint64_t i) {
+                volatile bool found = set.contains(50050 + i % 8);
+                (void)found;
+            });
+        });
+    }
+    if (matches("set.copy")) {
+        ThreadSafeUnorderedSet<uint32_t> set;
+        for (uint32_t i = 0; i < 5; i++) {
+            set.insert(50050 + i);
+        }
+        run("set.copy", "shared", threads, [&](uint32_t t, const std::atomic<bool> &stop) {
+            return loop(stop, [&](uint64_t i) {
+                volatile size_t size = set.copy().size();
+                (void)size;
+            });
+        });
+    }
+    if (matches("map.get_update")) {
+        // 90% get, 10% insertOrUpdate over 10000 keys
+        ThreadSafeUnorderedMap<std::string, uint64_t> map;
+        std::vector<std::string> keys;
+        for (uint32_t i = 0; i < 10000; i++) {
+            keys.push_back("key" + std::to_string(i));
+            map.insertOrUpdate(keys.back(), i);
+        }
+        run("map.get_update", "shared", threads, [&](uint32_t t, const std::atomic<bool> &stop) {
+            std::mt19937_64 rng(t);
+            return loop(stop, [&](uint64_t i) {
+                const std::string &key = keys[rng() % keys.size()];
+                if (i % 10 == 0) {
+                    map.insertOrUpdate(key, i);
+                } else {
+                    volatile bool found = map.get(key).has_value();
+                    (void)found;
+                }
+            });
+        });
+    }
+}
+
+void membershipCases(uint32_t threads, const std::string &filter) {
+    if (std::string("membership.read").find(filter) == std::string::npos) {
+        return;
+    }
+    MembershipView initial;
+    initial.servers = {50051, 50052, 50053, 50054};
+    Membership membership(initial);
+    std::atomic<bool> stop_publisher {false};
+    std::thread publisher([&] {
+        while (!stop_publisher.load()) {
+            membership.update([](const MembershipView &current) {
+                auto next = std::make_unique<MembershipView>(current);
+                next->epoch++;
+                return next;
+            });
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+    });
+    run("membership.read", "shared", threads, [&](uint32_t t, const std::atomic<bool> &stop) {
+        return loop(stop, [&](uint64_t i) {
+            const MembershipView *view = membership.current();
+            volatile uint32_t sum = view->epoch;
+            for (auto server: view->servers) {
+                sum += server;
+            }
+        });
+    });
+    stop_publisher = true;
+    publisher.join();
+}
+
+void lookupCases(uint32_t threads, const std::string &filter,
+        ShardedKeyIndex<HermesValue, HermesValue::Deleter> &index, const std::vector<std::string> &keys) {
+    if (std::string("lookup.read").find(filter) == std::string::npos) {
+        return;
+    }
+    for (bool shared: {false, true}) {
+        run("lookup.read", shared ? "hot" : "uniform", threads, [&](uint32_t t, const std::atomic<bool> &stop) {
+            std::mt19937_64 rng(t);
+            std::string out;
+            return loop(stop, [&](uint64_t i) {
+                const std::string &key = keys[shared ? 0 : rng() % keys.size()];
+                HermesValue *hermes_val = index.find(key, index.hash(key));
+                hermes_val->read_if_valid(out);
+            });
+        });
+    }
+}
+
+} // namespace
+
+int main(int argc, char **argv) {
+    uint32_t max_threads = argc > 1 ? std::stoul(argv[1]) : 2 * std::max(1u, std::thread::hardware_concurrency());
+    ms_per_run = argc > 2 ? std::stoul(argv[2]) : 300;
+    std::string filter = argc > 3 ? argv[3] : "";
+
+    // Key space for the lookup path
+    ShardedKeyIndex<HermesValue, HermesValue::Deleter> index;
+    std::vector<std::string> keys;
+    if (std::string("lookup.read").find(filter) != std::string::npos) {
+        std::string value(100, 'v');
+        for (uint32_t i = 0; i < 1000000; i++) {
+            keys.push_back("key" + std::to_string(i));
+            index.findOrInsert(keys.back(), index.hash(keys.back()), [&] {return HermesValue::create(keys.back(), value, 1);});
+        }
+    }
+
+    std::cout << std::left << std::setw(22) << "case" << std::setw(9) << "keys" << std::right
+              << std::setw(8) << "threads" << std::setw(12) << "Mops/s" << std::setw(12) << "ns/op" << "\n";
+    for (uint32_t threads = 1; threads <= max_threads; threads *= 2) {
+        valueCases(threads, filter);
+        containerCases(threads, filter);
+        membershipCases(threads, filter);
+        lookupCases(threads, filter, index, keys);
+    }
+    return 0;
+}
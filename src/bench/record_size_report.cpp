@@ -0,0 +1,93 @@
+// Bytes-per-key report for the per-key records of the store.
+// Compares the compact HermesValue (packed meta word, ParkingLot waits, inline key and small
+// value, slab allocated, key stored once in ShardedKeyIndex) with the layout it replaced: a
+// record with its own mutex, condition variable, std::string key and value, Timestamp and atomic
+// state, in an std::unordered_map<std::string, std::unique_ptr<...>>.
+// Heap usage is measured with mallinfo2(), so it includes allocator overhead and the index.
+//
+// Usage: record_size_report [num_keys] [key_size] [value_size]
+
+#include <malloc.h>
+
+#include <condition_variable>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "../server/state.h"
+#include "../utils/sharded_key_index.h"
+
+// The per-key record before it was compacted
+struct LegacyHermesValue {
+    std::string key;
+    std::string value;
+    std::condition_variable stall_cv;
+    std::mutex stall_mutex;
+    Timestamp timestamp;
+    std::atomic<State> st;
+
+    LegacyHermesValue(const std::string &key, const std::string &value, uint32_t node_id)
+            : key(key), value(value) {
+        timestamp.node_id = node_id;
+        timestamp.logical_time = 0;
+        st.store(VALID);
+    }
+};
+
+size_t heapInUse() {
+    return mallinfo2().uordblks;
+}
+
+std::string makeKey(size_t i, size_t key_size) {
+    std::string key = std::to_string(i);
+    key.resize(std::max(key_size, key.size()), 'k');
+    return key;
+}
+
+void report(const std::string &layout, size_t record_size, size_t heap_bytes, size_t num_keys,
+        size_t payload) {
+    double per_key = static_cast<double>(heap_bytes) / num_keys;
+    std::cout << std::left << std::setw(10) << layout
+              << std::right << std::setw(14) << record_size
+              << std::setw(16) << std::fixed << std::setprecision(1) << per_key
+              << std::setw(16) << per_key - payload << "\n";
+}
+
+int main(int argc, char **argv) {
+    size_t num_keys = argc > 1 ? std::stoull(argv[1]) : 1000000;
+    size_t key_size = argc > 2 ? std::stoull(argv[2]) : 16;
+    size_t value_size = argc > 3 ? std::stoull(argv[3]) : 16;
+    std::string value(value_size, 'v');
+
+    std::cout << "keys: " << num_keys << ", key size: " << key_size << ", value size: " << value_size << "\n";
+    std::cout << std::left << std::setw(10) << "layout"
+              << std::right << std::setw(14) << "sizeof(rec)"
+              << std::setw(16) << "heap B/key" << std::setw(16) << "overhead B/key" << "\n";
+
+    {
+        size_t before = heapInUse();
+        auto map = std::make_unique<std::unordered_map<std::string, std::unique_ptr<LegacyHermesValue>>>();
+        for (size_t i = 0; i < num_keys; i++) {
+            std::string key = makeKey(i, key_size);
+            (*map)[key] = std::make_unique<LegacyHermesValue>(key, value, 0);
+        }
+        report("legacy", sizeof(LegacyHermesValue), heapInUse() - before, num_keys, key_size + value_size);
+    }
+
+    {
+        size_t before = heapInUse();
+        auto index = std::make_unique<ShardedKeyIndex<HermesValue, HermesValue::Deleter>>();
+        for (size_t i = 0; i < num_keys; i++) {
+            std::string key = makeKey(i, key_size);
+            index->findOrInsert(key, index->hash(key), [&] {return HermesValue::create(key, value, 0);});
+        }
+        report("compact", sizeof(HermesValue), heapInUse() - before, num_keys, key_size + value_size);
+        std::cout << "record slabs: " << record_allocator().stats().toString() << "\n";
+        std::cout << "value slabs: " << value_allocator().stats().toString() << "\n";
+    }
+    return 0;
+}
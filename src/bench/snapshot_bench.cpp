@@ -0,0 +1,102 @@
+// Restart time from a snapshot against dataset size.
+// For each size, writes a snapshot, evicts it from the page cache and then measures:
+//  - open: mmap + header check, after which the server can serve reads
+//  - first read: one lookup that pages in what it touches
+//  - 1000 reads: random lookups on the cold file
+//  - full load: reading every record into a hash map, i.e. what a deserializing restart costs
+//
+// Usage: snapshot_bench [dir] [max_keys] [value_size]
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <iomanip>
+#include <iostream>
+#include <random>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "../server/snapshot.h"
+
+double elapsedMs(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+void evictFromPageCache(const std::string &path) {
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd >= 0) {
+        ::fdatasync(fd);
+        ::posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+        ::close(fd);
+    }
+}
+
+int main(int argc, char **argv) {
+    std::string dir = argc > 1 ? argv[1] : "/tmp";
+    uint64_t max_keys = argc > 2 ? std::stoull(argv[2]) : 4000000;
+    size_t value_size = argc > 3 ? std::stoull(argv[3]) : 100;
+    std::string path = dir + "/snapshot_bench.snap";
+    std::string value(value_size, 'v');
+
+    std::cout << std::left << std::setw(10) << "keys"
+              << std::right << std::setw(12) << "file MB" << std::setw(12) << "open ms"
+              << std::setw(14) << "1st read ms" << std::setw(14) << "1000 reads ms"
+              << std::setw(14) << "full load ms" << "\n";
+    for (uint64_t num_keys = 1000; num_keys <= max_keys; num_keys *= 4) {
+        std::vector<std::string> keys(num_keys);
+        std::vector<SnapshotRecord> records(num_keys);
+        for (uint64_t i = 0; i < num_keys; i++) {
+            keys[i] = "key" + std::to_string(i);
+            records[i] = SnapshotRecord {keys[i], value, 1, 1, 0};
+        }
+        std::string error;
+        if (!Snapshot::write(path, records, &error)) {
+            std::cerr << error << std::endl;
+            return 1;
+        }
+
+        evictFromPageCache(path);
+        auto start = std::chrono::steady_clock::now();
+        auto snapshot = Snapshot::open(path, &error);
+        double open_ms = elapsedMs(start);
+        if (!snapshot) {
+            std::cerr << error << std::endl;
+            return 1;
+        }
+        SnapshotRecord record;
+        start = std::chrono::steady_clock::now();
+        snapshot->find(keys[num_keys / 2], &record);
+        double first_ms = elapsedMs(start);
+
+        std::mt19937_64 rng(num_keys);
+        std::uniform_int_distribution<uint64_t> dist(0, num_keys - 1);
+        start = std::chrono::steady_clock::now();
+        uint64_t found = 0;
+        for (int i = 0; i < 1000; i++) {
+            found += snapshot->find(keys[dist(rng)], &record);
+        }
+        double reads_ms = elapsedMs(start);
+        snapshot.reset();
+
+        evictFromPageCache(path);
+        start = std::chrono::steady_clock::now();
+        snapshot = Snapshot::open(path, &error);
+        std::unordered_map<std::string, std::string> map;
+        map.reserve(snapshot->size());
+        for (uint64_t i = 0; i < snapshot->size(); i++) {
+            SnapshotRecord r = snapshot->at(i);
+            map.emplace(std::string(r.key), std::string(r.value));
+        }
+        double full_ms = elapsedMs(start);
+
+        double file_mb = (sizeof(Snapshot::Header) + num_keys * (sizeof(Snapshot::Entry) + keys.back().size() + value_size)) / 1e6;
+        std::cout << std::left << std::setw(10) << num_keys << std::right << std::fixed << std::setprecision(1)
+                  << std::setw(12) << file_mb << std::setprecision(3) << std::setw(12) << open_ms
+                  << std::setw(14) << first_ms << std::setw(14) << reads_ms << std::setw(14) << full_ms
+                  << (found == 1000 ? "" : "  (lookup failed)") << "\n";
+    }
+    ::unlink(path.c_str());
+    return 0;
+}
@@ -0,0 +1,71 @@
+// Throughput of WriteAheadLog appends in each durability mode.
+// Every thread appends records and waits for each one to be durable, the way the coordinator
+// commit and the follower INV acks do. Shows how many appends the group commit folds into
+// one fsync as the number of concurrent writers grows.
+//
+// Usage: wal_bench [dir] [appends_per_thread] [max_threads] [value_size]
+
+#include <unistd.h>
+
+#include <chrono>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "../server/wal.h"
+
+struct Result {
+    double appends_per_sec;
+    uint64_t syncs;
+};
+
+Result run(const std::string &path, WalMode mode, uint64_t appends_per_thread, int num_threads,
+        const std::string &value, std::shared_ptr<spdlog::logger> logger) {
+    ::unlink(path.c_str());
+    uint64_t syncs;
+    auto start = std::chrono::steady_clock::now();
+    {
+        WriteAheadLog wal(path, mode, [](absl::string_view, absl::string_view, uint32_t, uint32_t) {}, logger);
+        std::vector<std::thread> threads;
+        for (int t = 0; t < num_threads; t++) {
+            threads.emplace_back([&, t] {
+                std::string key = "key" + std::to_string(t);
+                for (uint64_t i = 0; i < appends_per_thread; i++) {
+                    wal.waitDurable(wal.append(key, value, i, t));
+                }
+            });
+        }
+        for (auto& thread: threads) {
+            thread.join();
+        }
+        syncs = wal.numSyncs();
+    }
+    auto elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    ::unlink(path.c_str());
+    return Result {appends_per_thread * num_threads / elapsed, syncs};
+}
+
+int main(int argc, char **argv) {
+    std::string dir = argc > 1 ? argv[1] : "/tmp";
+    uint64_t appends_per_thread = argc > 2 ? std::stoull(argv[2]) : 2000;
+    int max_threads = argc > 3 ? std::stoi(argv[3]) : 64;
+    size_t value_size = argc > 4 ? std::stoull(argv[4]) : 100;
+    std::string value(value_size, 'v');
+    std::string path = dir + "/wal_bench.log";
+    auto logger = std::make_shared<spdlog::logger>("wal_bench");
+
+    std::cout << std::left << std::setw(10) << "threads"
+              << std::right << std::setw(18) << "async appends/s" << std::setw(18) << "group appends/s"
+              << std::setw(18) << "appends/fsync" << "\n";
+    for (int threads = 1; threads <= max_threads; threads *= 4) {
+        Result async = run(path, WalMode::ASYNC, appends_per_thread, threads, value, logger);
+        Result group = run(path, WalMode::GROUP, appends_per_thread, threads, value, logger);
+        std::cout << std::left << std::setw(10) << threads << std::right << std::fixed << std::setprecision(0)
+                  << std::setw(18) << async.appends_per_sec << std::setw(18) << group.appends_per_sec
+                  << std::setw(18) << std::setprecision(1)
+                  << static_cast<double>(appends_per_thread * threads) / std::max<uint64_t>(group.syncs, 1) << "\n";
+    }
+    return 0;
+}
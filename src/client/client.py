@@ -84,6 +84,51 @@ class HermesClient(Hermes):
     def put(self, key, value, num_retries=None, retry_timeout=None):
         self.access_service("put", key, value, num_retries, retry_timeout)
 
+    def multi_get(self, keys, timeout=None):
+        # Returns a dict with the keys that were found
+        server = random.choice(self._server_list)
+        response = self._stubs[server].MultiRead(MultiReadRequest(keys=keys), timeout=timeout or self.RETRY_TIMEOUT)
+        return {kv.key: kv.value for kv in response.values if kv.found}
+
+    def multi_put(self, kvs, timeout=None):
+        # Returns the keys whose write failed
+        server = random.choice(self._server_list)
+        writes = [WriteRequest(key=key, value=value) for key, value in kvs.items()]
+        response = self._stubs[server].MultiWrite(MultiWriteRequest(writes=writes), timeout=timeout or self.RETRY_TIMEOUT)
+        return [status.key for status in response.statuses if not status.ok]
+
+    def scan(self, start, end=None, limit=0, timeout=None):
+        # Returns the (key, value) pairs of [start, end) in order, and the start of the next page
+        # if the scan stopped at the limit (None otherwise)
+        server = random.choice(self._server_list)
+        request = ScanRequest(start=start, limit=limit)
+        if end is not None:
+            request.end = end
+        items = []
+        next_start = None
+        for response in self._stubs[server].Scan(request, timeout=timeout or self.RETRY_TIMEOUT):
+            items.extend((kv.key, kv.value) for kv in response.values)
+            if response.HasField('next_start'):
+                next_start = response.next_start
+        return items, next_start
+
+    def compare_and_swap(self, key, expected, value, timeout=None):
+        # Returns (swapped, value before the operation). A missing key reads as ""
+        server = random.choice(self._server_list)
+        response = self._stubs[server].CompareAndSwap(CompareAndSwapRequest(key=key, expected=expected, value=value),
+                                                      timeout=timeout or self.RETRY_TIMEOUT)
+        return response.swapped, response.value
+
+    def fetch_add(self, key, delta, timeout=None):
+        # Returns the value before the add
+        server = random.choice(self._server_list)
+        response = self._stubs[server].FetchAdd(FetchAddRequest(key=key, delta=delta), timeout=timeout or self.RETRY_TIMEOUT)
+        return response.value
+
+    def append(self, key, suffix, timeout=None):
+        server = random.choice(self._server_list)
+        self._stubs[server].Append(AppendRequest(key=key, suffix=suffix), timeout=timeout or self.RETRY_TIMEOUT)
+
     def terminate(self, server_id, graceful=True, timeout=10):
         info(f"[{self._id}]: terminating server: {self._server_list[server_id]}")
         try:
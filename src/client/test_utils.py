@@ -0,0 +1,18 @@
+# Helpers shared by the scripts in test/
+
+import random
+import string
+
+
+def parseConfigFile(path_to_file):
+    # One port per line, servers run on localhost
+    server_list = []
+    with open(path_to_file, 'r') as file:
+        for line in file:
+            port_no = line.strip()
+            if port_no:
+                server_list.append('localhost:' + port_no)
+    return server_list
+
+def gen_random_value(length=10):
+    return ''.join(random.choice(string.ascii_uppercase + string.digits) for _ in range(length))
@@ -0,0 +1,118 @@
+#pragma once
+
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <random>
+#include <string>
+
+// Zipfian distribution over [0, n), rank 0 being the most popular. Uses the method of Gray et
+// al., "Quickly Generating Billion-Record Synthetic Databases" (as in YCSB): zeta(n) is
+// computed once in O(n), after which every sample is O(1).
+class ZipfianGenerator {
+private:
+    uint64_t _n;
+    double _theta;
+    double _alpha;
+    double _zetan;
+    double _eta;
+
+    static double zeta(uint64_t n, double theta) {
+        double sum = 0;
+        for (uint64_t i = 1; i <= n; i++) {
+            sum += 1 / std::pow(static_cast<double>(i), theta);
+        }
+        return sum;
+    }
+
+public:
+    ZipfianGenerator(uint64_t n, double theta) :
+        _n(n),
+        _theta(theta),
+        _alpha(1 / (1 - theta)),
+        _zetan(zeta(n, theta)),
+        _eta((1 - std::pow(2.0 / n, 1 - theta)) / (1 - zeta(2, theta) / _zetan))
+        {}
+
+    template <typename Rng>
+    uint64_t next(Rng &rng) const {
+        double u = std::uniform_real_distribution<double>(0, 1)(rng);
+        double uz = u * _zetan;
+        if (uz < 1) {
+            return 0;
+        }
+        if (uz < 1 + std::pow(0.5, _theta)) {
+            return 1;
+        }
+        uint64_t rank = static_cast<uint64_t>(_n * std::pow(_eta * u - _eta + 1, _alpha));
+        return rank < _n ? rank : _n - 1;
+    }
+};
+
+enum class KeyDistribution {
+    UNIFORM,
+    // Key i has popularity rank i
+    ZIPFIAN,
+    // Writes insert new keys, and reads favour the most recently inserted ones with zipfian
+    // popularity (YCSB workload D)
+    LATEST
+};
+
+inline bool parseKeyDistribution(const std::string &name, KeyDistribution *distribution) {
+    if (name == "uniform") {
+        *distribution = KeyDistribution::UNIFORM;
+    } else if (name == "zipfian") {
+        *distribution = KeyDistribution::ZIPFIAN;
+    } else if (name == "latest") {
+        *distribution = KeyDistribution::LATEST;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+// Picks the key of the next operation. Shared by all the threads of the load generator, each
+// passing its own random engine
+class KeyGenerator {
+private:
+    KeyDistribution _distribution;
+    uint64_t _num_keys;
+    ZipfianGenerator _zipfian;
+    // Keys [0, _inserted) exist. Only grows with the LATEST distribution
+    std::atomic<uint64_t> _inserted;
+
+public:
+    KeyGenerator(KeyDistribution distribution, uint64_t num_keys, double theta) :
+        _distribution(distribution),
+        _num_keys(num_keys),
+        _zipfian(distribution == KeyDistribution::UNIFORM ? 2 : num_keys, theta),
+        _inserted(num_keys)
+        {}
+
+    static std::string key(uint64_t index) {
+        return "K" + std::to_string(index);
+    }
+
+    template <typename Rng>
+    uint64_t nextRead(Rng &rng) const {
+        switch (_distribution) {
+        case KeyDistribution::ZIPFIAN:
+            return _zipfian.next(rng);
+        case KeyDistribution::LATEST: {
+            uint64_t latest = _inserted.load(std::memory_order_relaxed) - 1;
+            uint64_t rank = _zipfian.next(rng);
+            return rank <= latest ? latest - rank : 0;
+        }
+        default:
+            return std::uniform_int_distribution<uint64_t>(0, _num_keys - 1)(rng);
+        }
+    }
+
+    template <typename Rng>
+    uint64_t nextWrite(Rng &rng) {
+        if (_distribution == KeyDistribution::LATEST) {
+            return _inserted.fetch_add(1, std::memory_order_relaxed);
+        }
+        return nextRead(rng);
+    }
+};
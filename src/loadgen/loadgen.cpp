@@ -0,0 +1,420 @@
+// Load generator for a Hermes cluster. Keeps many async Read and Write RPCs in flight against
+// the servers of a config file and reports latency percentiles and throughput.
+//
+// With --rate, requests are issued open loop on a fixed schedule, and latency is measured from
+// the time a request was scheduled rather than sent. A request delayed by a stalled server or
+// by --concurrency requests already being in flight counts the delay, so the percentiles are
+// corrected for coordinated omission. The uncorrected service times are reported as well.
+// Without --rate, every thread keeps its share of --concurrency requests in flight (closed loop).
+//
+// Results are written to --stats_file in the format of test/stats.json.
+//
+// Usage: loadgen --config_file=../test_config.txt [--rate=20000] [--duration_s=30]
+//        [--distribution=zipfian] [--write_percentage=10] [--stats_file=stats.json]
+
+#include "hermes.grpc.pb.h"
+#include "key_generator.h"
+#include "../utils/config.h"
+#include "../utils/histogram.h"
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <grpcpp/grpcpp.h>
+
+#include "absl/flags/flag.h"
+#include "absl/flags/parse.h"
+
+ABSL_FLAG(std::string, config_file, "../test_config.txt", "Config file with the ports of the servers");
+ABSL_FLAG(double, rate, 0, "Requests per second, issued open loop. 0 runs closed loop");
+ABSL_FLAG(uint32_t, concurrency, 64, "Maximum requests in flight");
+ABSL_FLAG(uint32_t, threads, 2, "Threads issuing requests, each with its own completion queue");
+ABSL_FLAG(uint32_t, channels_per_server, 2, "Channels (HTTP/2 connections) to every server");
+ABSL_FLAG(uint32_t, duration_s, 30, "Length of the run");
+ABSL_FLAG(uint64_t, num_keys, 100000, "Number of keys");
+ABSL_FLAG(std::string, distribution, "uniform", "Key distribution: uniform, zipfian or latest");
+ABSL_FLAG(double, zipf_theta, 0.99, "Skew of the zipfian and latest distributions");
+ABSL_FLAG(uint32_t, write_percentage, 10, "Percentage of writes");
+ABSL_FLAG(uint32_t, value_size, 100, "Size of written values in bytes");
+ABSL_FLAG(bool, populate, false, "Write every key once before the run");
+ABSL_FLAG(uint32_t, timeout_ms, 5000, "Deadline of every request");
+ABSL_FLAG(uint32_t, interval_s, 3, "Width of the buckets of the throughput time series");
+ABSL_FLAG(std::string, stats_file, "", "JSON file to write the results to");
+ABSL_FLAG(uint64_t, seed, 1, "Random seed");
+
+using Clock = std::chrono::steady_clock;
+
+namespace {
+
+// A Read or Write in flight. Used as the completion queue tag
+struct Call {
+    bool write;
+    Clock::time_point intended;
+    Clock::time_point sent;
+    grpc::ClientContext ctx;
+    grpc::Status status;
+    ReadRequest read_req;
+    ReadResponse read_resp;
+    WriteRequest write_req;
+    Empty write_resp;
+    std::unique_ptr<grpc::ClientAsyncResponseReader<ReadResponse>> read_reader;
+    std::unique_ptr<grpc::ClientAsyncResponseReader<Empty>> write_reader;
+};
+
+struct OpStats {
+    // Latency from the scheduled start, and from the actual send
+    Histogram latency_ns;
+    Histogram service_ns;
+    std::atomic<uint64_t> ok {0};
+    std::atomic<uint64_t> failed {0};
+};
+
+struct Options {
+    double rate;
+    uint32_t concurrency;
+    uint32_t threads;
+    uint32_t duration_s;
+    uint64_t num_keys;
+    uint32_t write_percentage;
+    uint32_t value_size;
+    uint32_t timeout_ms;
+    uint64_t seed;
+};
+
+class LoadGenerator {
+private:
+    // One per issuing thread, with a poller thread draining its completion queue
+    struct Worker {
+        grpc::CompletionQueue cq;
+        std::mutex mutex;
+        std::condition_variable cv;
+        uint32_t in_flight = 0;
+        uint32_t max_in_flight = 0;
+    };
+
+    Options _options;
+    KeyGenerator &_keys;
+    std::vector<std::unique_ptr<Hermes::Stub>> _stubs;
+    std::vector<std::unique_ptr<Worker>> _workers;
+
+    // Set during the measured run, not while populating
+    std::atomic<bool> _measure {false};
+    Clock::time_point _start;
+    std::vector<std::atomic<uint64_t>> _completed_per_s;
+
+    void issue(Worker &worker, uint32_t stub_idx, Call *call) {
+        call->ctx.set_deadline(std::chrono::system_clock::now() + std::chrono::milliseconds(_options.timeout_ms));
+        call->sent = Clock::now();
+        if (call->write) {
+            call->write_reader = _stubs[stub_idx]->AsyncWrite(&call->ctx, call->write_req, &worker.cq);
+            call->write_reader->Finish(&call->write_resp, &call->status, call);
+        } else {
+            call->read_reader = _stubs[stub_idx]->AsyncRead(&call->ctx, call->read_req, &worker.cq);
+            call->read_reader->Finish(&call->read_resp, &call->status, call);
+        }
+    }
+
+    void acquireSlot(Worker &worker) {
+        std::unique_lock<std::mutex> lock(worker.mutex);
+        worker.cv.wait(lock, [&] {return worker.in_flight < worker.max_in_flight;});
+        worker.in_flight++;
+    }
+
+    void poll(Worker &worker) {
+        void *tag;
+        bool ok;
+        while (worker.cq.Next(&tag, &ok)) {
+            std::unique_ptr<Call> call(static_cast<Call*>(tag));
+            auto now = Clock::now();
+            if (_measure) {
+                OpStats &stats = call->write ? writes : reads;
+                if (ok && call->status.ok()) {
+                    stats.latency_ns.record(std::chrono::duration_cast<std::chrono::nanoseconds>(now - call->intended).count());
+                    stats.service_ns.record(std::chrono::duration_cast<std::chrono::nanoseconds>(now - call->sent).count());
+                    stats.ok++;
+                    uint64_t second = std::chrono::duration_cast<std::chrono::seconds>(call->intended - _start).count();
+                    if (second < _completed_per_s.size()) {
+                        _completed_per_s[second]++;
+                    }
+                } else {
+                    stats.failed++;
+                }
+            }
+            {
+                std::unique_lock<std::mutex> lock(worker.mutex);
+                worker.in_flight--;
+            }
+            worker.cv.notify_one();
+        }
+    }
+
+    // Issues requests till `deadline`, or `count` requests if it is non-zero
+    void run(uint32_t thread_idx, Clock::time_point deadline, uint64_t count, bool populate) {
+        Worker &worker = *_workers[thread_idx];
+        std::mt19937_64 rng(_options.seed * 1000003 + thread_idx);
+        std::uniform_int_distribution<uint32_t> percent(0, 99);
+        std::uniform_int_distribution<uint32_t> stub_of(0, _stubs.size() - 1);
+        // Values are slices of a random buffer
+        std::string buffer(2 * _options.value_size + 1, 'v');
+        for (auto& c: buffer) {
+            c = 'a' + rng() % 26;
+        }
+        std::uniform_int_distribution<uint32_t> offset(0, _options.value_size);
+
+        double thread_rate = populate ? 0 : _options.rate / _options.threads;
+        auto interval = std::chrono::duration<double>(thread_rate > 0 ? 1 / thread_rate : 0);
+        auto first = Clock::now();
+        for (uint64_t i = 0; count == 0 || i < count; i++) {
+            auto intended = first + std::chrono::duration_cast<Clock::duration>(interval * i);
+            if (thread_rate > 0) {
+                if (intended >= deadline) {
+                    break;
+                }
+                std::this_thread::sleep_until(intended);
+            }
+            acquireSlot(worker);
+            auto now = Clock::now();
+            if (thread_rate == 0) {
+                if (count == 0 && now >= deadline) {
+                    std::unique_lock<std::mutex> lock(worker.mutex);
+                    worker.in_flight--;
+                    break;
+                }
+                intended = now;
+            }
+
+            auto call = new Call();
+            call->intended = intended;
+            uint64_t key;
+            if (populate) {
+                call->write = true;
+                key = i * _options.threads + thread_idx;
+            } else {
+                call->write = percent(rng) < _options.write_percentage;
+                key = call->write ? _keys.nextWrite(rng) : _keys.nextRead(rng);
+            }
+            if (call->write) {
+                call->write_req.set_key(KeyGenerator::key(key));
+                call->write_req.set_value(buffer.data() + offset(rng), _options.value_size);
+            } else {
+                call->read_req.set_key(KeyGenerator::key(key));
+            }
+            issue(worker, stub_of(rng), call);
+        }
+        // Wait for the requests in flight
+        std::unique_lock<std::mutex> lock(worker.mutex);
+        worker.cv.wait(lock, [&] {return worker.in_flight == 0;});
+    }
+
+    void runThreads(Clock::time_point deadline, bool populate) {
+        std::vector<std::thread> threads;
+        for (uint32_t t = 0; t < _options.threads; t++) {
+            uint64_t count = 0;
+            if (populate) {
+                // Keys t, t + threads, t + 2 * threads, ...
+                count = (_options.num_keys + _options.threads - 1 - t) / _options.threads;
+            }
+            threads.emplace_back([this, t, deadline, count, populate] {run(t, deadline, count, populate);});
+        }
+        for (auto& thread: threads) {
+            thread.join();
+        }
+    }
+
+public:
+    OpStats reads;
+    OpStats writes;
+
+    LoadGenerator(const Options &options, KeyGenerator &keys, const std::vector<std::string> &servers,
+            uint32_t channels_per_server) :
+        _options(options), _keys(keys), _completed_per_s(options.duration_s + 1) {
+        for (auto& server: servers) {
+            for (uint32_t c = 0; c < channels_per_server; c++) {
+                // Distinct args so that the channels don't share a connection
+                grpc::ChannelArguments args;
+                args.SetInt(GRPC_ARG_USE_LOCAL_SUBCHANNEL_POOL, 1);
+                args.SetInt("hermes.channel_idx", c);
+                _stubs.push_back(Hermes::NewStub(grpc::CreateCustomChannel(server, grpc::InsecureChannelCredentials(), args)));
+            }
+        }
+        for (uint32_t t = 0; t < options.threads; t++) {
+            _workers.push_back(std::make_unique<Worker>());
+            // Split the concurrency, rounding up
+            _workers.back()->max_in_flight = std::max<uint32_t>(1, (options.concurrency + options.threads - 1 - t) / options.threads);
+        }
+    }
+
+    // Returns the length of the measured run in seconds
+    double start(bool populate) {
+        std::vector<std::thread> pollers;
+        for (auto& worker: _workers) {
+            pollers.emplace_back([this, &worker] {poll(*worker);});
+        }
+        if (populate) {
+            auto start = Clock::now();
+            runThreads(Clock::time_point::max(), true);
+            std::cout << "Populated " << _options.num_keys << " keys in "
+                      << std::chrono::duration<double>(Clock::now() - start).count() << " s" << std::endl;
+        }
+        _measure = true;
+        _start = Clock::now();
+        runThreads(_start + std::chrono::seconds(_options.duration_s), false);
+        double elapsed = std::chrono::duration<double>(Clock::now() - _start).count();
+        _measure = false;
+
+        for (auto& worker: _workers) {
+            worker->cq.Shutdown();
+        }
+        for (auto& poller: pollers) {
+            poller.join();
+        }
+        return elapsed;
+    }
+
+    // Successful requests by scheduled start, per `interval_s` bucket, as requests/s
+    std::vector<double> throughputSeries(uint32_t interval_s) const {
+        std::vector<double> series;
+        for (uint32_t s = 0; s < _options.duration_s; s += interval_s) {
+            uint64_t sum = 0;
+            for (uint32_t i = s; i < std::min(s + interval_s, _options.duration_s); i++) {
+                sum += _completed_per_s[i].load();
+            }
+            series.push_back(static_cast<double>(sum) / interval_s);
+        }
+        return series;
+    }
+};
+
+const double PERCENTILES[] = {50, 70, 90, 99, 99.9};
+
+std::string percentileName(double p) {
+    std::ostringstream out;
+    out << p;
+    return out.str();
+}
+
+// {"<p>": [latency_us, 1 / latency], ...}, as in test/stats.json
+void writePercentiles(std::ostream &out, const Histogram::Snapshot &snapshot) {
+    out << "{";
+    bool first = true;
+    for (double p: PERCENTILES) {
+        if (snapshot.count == 0) {
+            break;
+        }
+        uint64_t latency_us = snapshot.percentile(p / 100) / 1000;
+        double throughput = latency_us > 0 ? 1e6 / latency_us : 0;
+        out << (first ? "" : ", ") << "\"" << percentileName(p) << "\": [" << latency_us << ", "
+            << std::fixed << std::setprecision(2) << throughput << "]";
+        first = false;
+    }
+    out << "}";
+}
+
+void writeOpStats(std::ostream &out, const OpStats &stats) {
+    auto latency = stats.latency_ns.snapshot();
+    auto service = stats.service_ns.snapshot();
+    out << "{\n"
+        << "        \"total_ops\": " << stats.ok.load() + stats.failed.load() << ",\n"
+        << "        \"num_failures\": " << stats.failed.load() << ",\n"
+        << "        \"avg_latency\": " << static_cast<uint64_t>(latency.mean() / 1000) << ",\n"
+        << "        \"percentile_stats\": ";
+    writePercentiles(out, latency);
+    out << ",\n        \"avg_service_time\": " << static_cast<uint64_t>(service.mean() / 1000) << ",\n"
+        << "        \"service_percentile_stats\": ";
+    writePercentiles(out, service);
+    out << "\n    }";
+}
+
+void printOpStats(const std::string &name, const OpStats &stats) {
+    for (auto [kind, histogram]: {std::make_pair("latency", &stats.latency_ns), std::make_pair("service", &stats.service_ns)}) {
+        auto snapshot = histogram->snapshot();
+        std::cout << std::left << std::setw(8) << name << std::setw(9) << kind << std::right
+                  << std::setw(10) << stats.ok.load() + stats.failed.load() << std::setw(8) << stats.failed.load()
+                  << std::fixed << std::setprecision(0) << std::setw(10) << snapshot.mean() / 1000;
+        for (double p: PERCENTILES) {
+            std::cout << std::setw(10) << snapshot.percentile(p / 100) / 1000;
+        }
+        std::cout << std::setw(10) << snapshot.max / 1000 << "\n";
+    }
+}
+
+} // namespace
+
+int main(int argc, char **argv) {
+    absl::ParseCommandLine(argc, argv);
+
+    Options options;
+    options.rate = absl::GetFlag(FLAGS_rate);
+    options.concurrency = absl::GetFlag(FLAGS_concurrency);
+    options.threads = std::max<uint32_t>(1, absl::GetFlag(FLAGS_threads));
+    options.duration_s = absl::GetFlag(FLAGS_duration_s);
+    options.num_keys = std::max<uint64_t>(2, absl::GetFlag(FLAGS_num_keys));
+    options.write_percentage = absl::GetFlag(FLAGS_write_percentage);
+    options.value_size = absl::GetFlag(FLAGS_value_size);
+    options.timeout_ms = absl::GetFlag(FLAGS_timeout_ms);
+    options.seed = absl::GetFlag(FLAGS_seed);
+
+    KeyDistribution distribution;
+    if (!parseKeyDistribution(absl::GetFlag(FLAGS_distribution), &distribution)) {
+        std::cerr << "Invalid --distribution " << absl::GetFlag(FLAGS_distribution) << std::endl;
+        return 1;
+    }
+    auto servers = parseConfigFile(absl::GetFlag(FLAGS_config_file));
+    KeyGenerator keys(distribution, options.num_keys, absl::GetFlag(FLAGS_zipf_theta));
+    LoadGenerator loadgen(options, keys, servers, absl::GetFlag(FLAGS_channels_per_server));
+
+    double elapsed = loadgen.start(absl::GetFlag(FLAGS_populate));
+    uint64_t total = loadgen.reads.ok + loadgen.reads.failed + loadgen.writes.ok + loadgen.writes.failed;
+    double throughput = total / elapsed;
+
+    std::cout << std::left << std::setw(17) << "op (us)" << std::right << std::setw(10) << "ops"
+              << std::setw(8) << "failed" << std::setw(10) << "mean";
+    for (double p: PERCENTILES) {
+        std::cout << std::setw(10) << ("p" + percentileName(p));
+    }
+    std::cout << std::setw(10) << "max" << "\n";
+    printOpStats("read", loadgen.reads);
+    printOpStats("write", loadgen.writes);
+    std::cout << "Throughput: " << std::fixed << std::setprecision(1) << throughput << " requests/s ("
+              << (options.rate > 0 ? "open loop, target " + std::to_string(static_cast<uint64_t>(options.rate)) : "closed loop")
+              << ")" << std::endl;
+
+    std::string stats_file = absl::GetFlag(FLAGS_stats_file);
+    if (stats_file.empty()) {
+        return 0;
+    }
+    uint32_t interval_s = std::max<uint32_t>(1, absl::GetFlag(FLAGS_interval_s));
+    std::ofstream out(stats_file);
+    out << "{\n    \"read\": ";
+    writeOpStats(out, loadgen.reads);
+    out << ",\n    \"write\": ";
+    writeOpStats(out, loadgen.writes);
+    out << ",\n    \"write_percentage\": " << options.write_percentage
+        << ",\n    \"throughput\": " << std::fixed << std::setprecision(2) << throughput
+        << ",\n    \"mode\": \"" << (options.rate > 0 ? "open" : "closed") << "\""
+        << ",\n    \"target_rate\": " << options.rate
+        << ",\n    \"distribution\": \"" << absl::GetFlag(FLAGS_distribution) << "\""
+        << ",\n    \"time_v_throughput\": {\n        \"time\": [";
+    auto series = loadgen.throughputSeries(interval_s);
+    for (size_t i = 0; i < series.size(); i++) {
+        out << (i ? ", " : "") << i * interval_s;
+    }
+    out << "],\n        \"throughput\": [";
+    for (size_t i = 0; i < series.size(); i++) {
+        out << (i ? ", " : "") << series[i];
+    }
+    out << "]\n    }\n}\n";
+    std::cout << "Wrote " << stats_file << std::endl;
+    return 0;
+}
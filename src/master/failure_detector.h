@@ -0,0 +1,121 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <deque>
+#include <unordered_map>
+#include <vector>
+
+// Phi accrual failure detector (Hayashibara et al., "The phi Accrual Failure Detector").
+// Instead of a fixed heartbeat timeout, the inter-arrival times of the heartbeats of every node
+// are tracked, and phi = -log10(P(the next heartbeat is still to come)) grows with the time
+// since the last one. A node whose heartbeats are usually regular is suspected soon after
+// they stop, while one with jittery heartbeats gets more slack. The normal CDF is approximated
+// with a logistic function, as in Akka.
+//
+// Not thread-safe.
+class PhiAccrualDetector {
+public:
+    using Clock = std::chrono::steady_clock;
+
+    struct Options {
+        // Expected interval between heartbeats, which seeds the window of a new node
+        std::chrono::milliseconds interval {100};
+        // Floor of the standard deviation, so that very regular heartbeats don't make phi
+        // shoot up on the first late one
+        std::chrono::milliseconds min_std_dev {20};
+        // Added to the mean interval, for GC pauses and the like
+        std::chrono::milliseconds acceptable_pause {0};
+        // Inter-arrival times kept per node
+        size_t window = 100;
+    };
+
+private:
+    struct History {
+        Clock::time_point last;
+        std::deque<double> intervals_ms;
+        double sum = 0;
+        double sum_squares = 0;
+    };
+
+    Options _options;
+    std::unordered_map<uint32_t, History> _nodes;
+
+    void addInterval(History &history, double interval_ms) {
+        history.intervals_ms.push_back(interval_ms);
+        history.sum += interval_ms;
+        history.sum_squares += interval_ms * interval_ms;
+        if (history.intervals_ms.size() > _options.window) {
+            double oldest = history.intervals_ms.front();
+            history.intervals_ms.pop_front();
+            history.sum -= oldest;
+            history.sum_squares -= oldest * oldest;
+        }
+    }
+
+public:
+    explicit PhiAccrualDetector(const Options &options) : _options(options) {}
+
+    // Starts tracking a node as if it had just sent a heartbeat
+    void add(uint32_t node, Clock::time_point now) {
+        History &history = _nodes[node];
+        history = History();
+        history.last = now;
+        // Seed with the expected interval, +-std/4, so phi is defined from the start
+        double interval = _options.interval.count();
+        addInterval(history, interval - interval / 4);
+        addInterval(history, interval + interval / 4);
+    }
+
+    void remove(uint32_t node) {
+        _nodes.erase(node);
+    }
+
+    void heartbeat(uint32_t node, Clock::time_point now) {
+        auto it = _nodes.find(node);
+        if (it == _nodes.end()) {
+            return;
+        }
+        History &history = it->second;
+        if (now > history.last) {
+            addInterval(history, std::chrono::duration<double, std::milli>(now - history.last).count());
+            history.last = now;
+        }
+    }
+
+    // Suspicion level of the node. 1 means about a 10% chance that suspecting it now is a
+    // mistake, 2 a 1% chance and so on
+    double phi(uint32_t node, Clock::time_point now) const {
+        auto it = _nodes.find(node);
+        if (it == _nodes.end()) {
+            return 0;
+        }
+        const History &history = it->second;
+        double n = history.intervals_ms.size();
+        double mean = history.sum / n;
+        double variance = std::max(0.0, history.sum_squares / n - mean * mean);
+        double std_dev = std::max<double>(std::sqrt(variance), _options.min_std_dev.count());
+        mean += _options.acceptable_pause.count();
+
+        double elapsed = std::chrono::duration<double, std::milli>(now - history.last).count();
+        double y = (elapsed - mean) / std_dev;
+        double e = std::exp(-y * (1.5976 + 0.070566 * y * y));
+        if (elapsed > mean) {
+            return -std::log10(e / (1 + e));
+        }
+        return -std::log10(1 - 1 / (1 + e));
+    }
+
+    // Nodes whose phi is above the threshold
+    std::vector<uint32_t> suspects(double threshold, Clock::time_point now) const {
+        std::vector<uint32_t> suspects;
+        for (auto& [node, history]: _nodes) {
+            if (phi(node, now) > threshold) {
+                suspects.push_back(node);
+            }
+        }
+        return suspects;
+    }
+};
@@ -1,5 +1,6 @@
 #include <iostream>
 #include <atomic>
+#include <algorithm>
 #include <csignal>
 #include "master.h"
 #include "../utils/config.h"
@@ -9,6 +10,11 @@ ABSL_FLAG(uint32_t, port, 50050, "Port");
 ABSL_FLAG(std::string, log_dir, "", "log directory");
 ABSL_FLAG(std::string, config_file, "", "Config file");
 ABSL_FLAG(std::string, db_dir, "", "directory to store the database");
+ABSL_FLAG(uint32_t, heartbeat_interval_ms, 100, "Interval between heartbeat rounds");
+ABSL_FLAG(double, phi_threshold, 8, "Phi of the heartbeats of a server above which it is declared failed");
+ABSL_FLAG(uint32_t, phi_min_std_dev_ms, 20, "Lower bound of the standard deviation of the heartbeat intervals");
+ABSL_FLAG(uint32_t, acceptable_heartbeat_pause_ms, 0, "Pause of the heartbeats that is tolerated on top of their usual interval");
+ABSL_FLAG(uint32_t, reconfigure_timeout_ms, 1000, "How long a join waits for the replicas to add the joining node");
 
 std::atomic<bool> terminate_flag(false);
 
@@ -30,14 +36,22 @@ int main(int argc, char** argv) {
     // Register signal handler
     //std::signal(SIGTERM, handle_sigterm);
 
-    Master master(id, log_dir, server_list);
+    MasterOptions options;
+    options.heartbeat_interval_ms = std::max<uint32_t>(absl::GetFlag(FLAGS_heartbeat_interval_ms), 1);
+    options.phi_threshold = absl::GetFlag(FLAGS_phi_threshold);
+    options.phi_min_std_dev_ms = absl::GetFlag(FLAGS_phi_min_std_dev_ms);
+    options.acceptable_heartbeat_pause_ms = absl::GetFlag(FLAGS_acceptable_heartbeat_pause_ms);
+    options.reconfigure_timeout_ms = absl::GetFlag(FLAGS_reconfigure_timeout_ms);
+
+    Master master(id, log_dir, server_list, options);
+
+    // Joining servers call in here, the heartbeats run on the main thread
+    grpc::ServerBuilder builder;
+    builder.AddListeningPort(server_address, grpc::InsecureServerCredentials());
+    builder.RegisterService(&master);
+    std::unique_ptr<grpc::Server> server(builder.BuildAndStart());
+    std::cout << "Master listening on " << server_address << std::endl;
+
     std::this_thread::sleep_for(std::chrono::milliseconds(3000));
     master.start();
-
-    //grpc::ServerBuilder builder;
-    //builder.AddListeningPort(server_address, grpc::InsecureServerCredentials());
-    //builder.RegisterService(&service);
-    //std::unique_ptr<grpc::Server> server(builder.BuildAndStart());
-    //std::cout << "Server listening on " << server_address << std::endl;
-    //server->Wait();
 }
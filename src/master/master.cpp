@@ -1,3 +1,4 @@
+#include <algorithm>
 #include <csignal>
 #include <cstdlib>
 #include <string>
@@ -10,10 +11,30 @@ std::unique_ptr<Hermes::Stub> create_stub(const std::string &addr) {
     return std::make_unique<Hermes::Stub>(channel_ptr);
 }
 
+namespace {
+
+struct HeartbeatCall {
+    uint32_t server;
+    grpc::ClientContext ctx;
+    grpc::Status status;
+    Empty response;
+};
+
+PhiAccrualDetector::Options detectorOptions(const MasterOptions &options) {
+    PhiAccrualDetector::Options detector_options;
+    detector_options.interval = std::chrono::milliseconds(options.heartbeat_interval_ms);
+    detector_options.min_std_dev = std::chrono::milliseconds(options.phi_min_std_dev_ms);
+    detector_options.acceptable_pause = std::chrono::milliseconds(options.acceptable_heartbeat_pause_ms);
+    return detector_options;
+}
+
+} // namespace
+
 Master::Master(uint32_t id, std::string &log_dir, 
-        const std::vector<std::string> &server_list
+        const std::vector<std::string> &server_list,
+        const MasterOptions &options
         )
-        : server_id(id), stop(false), epoch(0) {
+        : options(options), detector(detectorOptions(options)), server_id(id), stop(false), epoch(0) {
     // Logger initialization
     std::string log_file_name = log_dir + "/spdlog_master_" + std::to_string(id) + ".log";
 
@@ -30,13 +51,28 @@ Master::Master(uint32_t id, std::string &log_dir,
         uint32_t other_id = addrToID(server);
         SPDLOG_LOGGER_INFO(logger, "Adding {} to active list", other_id);
         _active_servers.insert(other_id);
+        _addrs[other_id] = server;
         _stubs[other_id] = create_stub(server);
     }
+    publishView();
 }
 
 void Master::start() {
+    {
+        std::unique_lock<std::mutex> lock(detector_mutex);
+        auto now = PhiAccrualDetector::Clock::now();
+        for (auto server: _active_servers.copy()) {
+            detector.add(server, now);
+        }
+    }
+    heartbeat_receiver = std::thread(&Master::receiveHeartbeats, this);
+    auto interval = std::chrono::milliseconds(options.heartbeat_interval_ms);
+    auto next_round = std::chrono::steady_clock::now();
     while (true) {
-        std::this_thread::sleep_for(std::chrono::milliseconds(500));
+        // Rounds start at a fixed rate, however long the previous one took
+        next_round += interval;
+        std::this_thread::sleep_until(next_round);
+        next_round = std::max(next_round, std::chrono::steady_clock::now() - interval);
         sendHeartbeats();
     }
 }
@@ -66,30 +102,35 @@ uint32_t Master::addrToID(std::string& addr) {
 }
 
 void Master::sendHeartbeats() {
+    std::unique_lock<std::mutex> lock(membership_mutex);
     std::unordered_set<uint32_t> active_servers = _active_servers.copy();
-    std::unordered_set<uint32_t> failed_servers;
 
-    // Send heartbeats and detect failed servers
+    // Send this round's heartbeats without waiting for the previous ones. A server that is
+    // slow to answer shows up in its phi
     for (auto server: active_servers) {
-        auto& stub = _stubs[server];
-        auto deadline = std::chrono::system_clock::now() + std::chrono::milliseconds(150);
-        grpc::ClientContext ctx;
-        ctx.set_deadline(deadline);
+        auto call = new HeartbeatCall;
+        call->server = server;
+        call->ctx.set_deadline(std::chrono::system_clock::now() + 10 * std::chrono::milliseconds(options.heartbeat_interval_ms));
         Empty req;
-        Empty resp;
         SPDLOG_LOGGER_TRACE(logger, "sending heartbeat to node_id {}", server);
-        grpc::Status status = stub->Heartbeat(&ctx, req, &resp);
-        if (status.ok()) {
-            SPDLOG_LOGGER_TRACE(logger, "node_id {} is running", server);
-        }
-        else {
-            std::stringstream ss;
-            ss << "Code " << status.error_code() << " Message " << status.error_message();
-            SPDLOG_LOGGER_TRACE(logger, "node_id {} has failed. {}", server, ss.str());
-            failed_servers.insert(server);
-            _active_servers.erase(server);
+        auto reader = _stubs[server]->AsyncHeartbeat(&call->ctx, req, &heartbeat_cq);
+        reader->Finish(&call->response, &call->status, call);
+    }
+
+    // Detect failed servers
+    std::vector<uint32_t> failed_servers;
+    {
+        std::unique_lock<std::mutex> detector_lock(detector_mutex);
+        auto now = PhiAccrualDetector::Clock::now();
+        for (auto server: detector.suspects(options.phi_threshold, now)) {
+            SPDLOG_LOGGER_INFO(logger, "node_id {} has failed, phi {:.1f}", server, detector.phi(server, now));
+            detector.remove(server);
+            failed_servers.push_back(server);
         }
     }
+    for (auto server: failed_servers) {
+        _active_servers.erase(server);
+    }
 
     for (auto server: failed_servers) {
         epoch++;
@@ -97,25 +138,156 @@ void Master::sendHeartbeats() {
     }
 }
 
+void Master::receiveHeartbeats() {
+    void *tag;
+    bool ok;
+    while (heartbeat_cq.Next(&tag, &ok)) {
+        std::unique_ptr<HeartbeatCall> call(static_cast<HeartbeatCall*>(tag));
+        if (ok && call->status.ok()) {
+            SPDLOG_LOGGER_TRACE(logger, "node_id {} is running", call->server);
+            std::unique_lock<std::mutex> lock(detector_mutex);
+            detector.heartbeat(call->server, PhiAccrualDetector::Clock::now());
+        }
+        else {
+            SPDLOG_LOGGER_TRACE(logger, "heartbeat to node_id {} failed. Code {} Message {}", call->server,
+                static_cast<int>(call->status.error_code()), call->status.error_message());
+        }
+    }
+}
+
 void Master::reconfigure(uint32_t server, bool fail) {
-    // Reconfigure the hermes cluster due to membership change
-    std::unordered_set<uint32_t> active_servers = _active_servers.copy();
+    // Reconfigure the hermes cluster due to membership change. The new view reaches every
+    // server at once on its WatchMembership stream, so the time to the new epoch doesn't grow
+    // with the size of the cluster
+    if (!fail) {
+        _active_servers.insert(server);
+    }
+    publishView();
+}
 
-    if (fail) {
-        for (auto active: active_servers) {
-            SPDLOG_LOGGER_TRACE(logger, "sending mayday to {}", active);
-            auto& stub = _stubs[active];
-            grpc::ClientContext ctx;
-            MaydayRequest req;
-            req.set_node_id(server);
-            req.set_epoch_id(epoch);
-            Empty resp;
-            grpc::Status status = stub->Mayday(&ctx, req, &resp);
-            //assert(status.ok());
+void Master::awaitJoin(uint32_t server, uint32_t join_epoch, const std::vector<uint32_t> &targets) {
+    // Every replica starts invalidating its writes on the new server, which then copies
+    // the older writes from one of them. So the join only goes ahead once they all have
+    auto start = std::chrono::steady_clock::now();
+    auto pending = waitForAcks(targets, join_epoch, start + std::chrono::milliseconds(options.reconfigure_timeout_ms));
+    for (auto active: pending) {
+        // The heartbeats take it out of the cluster if it has failed
+        SPDLOG_LOGGER_WARN(logger, "{} did not add {} in epoch {} in time", active, server, join_epoch);
+    }
+    std::unique_lock<std::mutex> lock(detector_mutex);
+    detector.add(server, PhiAccrualDetector::Clock::now());
+}
+
+void Master::publishView() {
+    MembershipUpdate update;
+    update.set_epoch_id(epoch);
+    for (auto server: _active_servers.copy()) {
+        ReplicaAddr *replica = update.add_servers();
+        replica->set_node_id(server);
+        replica->set_addr(_addrs[server]);
+    }
+    SPDLOG_LOGGER_INFO(logger, "publishing epoch {} with {} servers", epoch, update.servers_size());
+    {
+        std::unique_lock<std::mutex> lock(view_mutex);
+        view = std::move(update);
+        view_published = std::chrono::steady_clock::now();
+        view_applied = false;
+    }
+    view_cv.notify_all();
+}
+
+std::vector<uint32_t> Master::waitForAcks(const std::vector<uint32_t> &servers, uint32_t epoch,
+        std::chrono::steady_clock::time_point deadline) {
+    std::unique_lock<std::mutex> lock(view_mutex);
+    auto pending = [&] {
+        std::vector<uint32_t> pending;
+        for (auto server: servers) {
+            auto it = applied_epochs.find(server);
+            if (it == applied_epochs.end() || it->second < epoch) {
+                pending.push_back(server);
+            }
+        }
+        return pending;
+    };
+    view_cv.wait_until(lock, deadline, [&] {return pending().empty();});
+    return pending();
+}
+
+grpc::Status Master::WatchMembership(grpc::ServerContext *ctx, const WatchMembershipRequest *req,
+        grpc::ServerWriter<MembershipUpdate> *writer) {
+    SPDLOG_LOGGER_INFO(logger, "node_id {} is watching the membership", req->node_id());
+    std::unique_lock<std::mutex> lock(view_mutex);
+    int64_t sent_epoch = -1;
+    while (!ctx->IsCancelled()) {
+        if (view.epoch_id() != sent_epoch) {
+            MembershipUpdate update = view;
+            sent_epoch = update.epoch_id();
+            lock.unlock();
+            if (!writer->Write(update)) {
+                break;
+            }
+            lock.lock();
+            continue;
         }
+        // Wake up now and then to notice a cancelled stream
+        view_cv.wait_for(lock, std::chrono::seconds(1));
     }
-    else {
-        // TODO: addition of new server
-        assert(0);
+    SPDLOG_LOGGER_INFO(logger, "node_id {} stopped watching the membership", req->node_id());
+    return grpc::Status::OK;
+}
+
+grpc::Status Master::AckMembership(grpc::ServerContext *ctx, const AckMembershipRequest *req, Empty *resp) {
+    {
+        std::unique_lock<std::mutex> lock(view_mutex);
+        uint32_t &applied = applied_epochs[req->node_id()];
+        applied = std::max<uint32_t>(applied, req->epoch_id());
+        if (!view_applied && applied >= view.epoch_id()) {
+            view_applied = true;
+            for (auto& replica: view.servers()) {
+                auto it = applied_epochs.find(replica.node_id());
+                if (it == applied_epochs.end() || it->second < view.epoch_id()) {
+                    view_applied = false;
+                    break;
+                }
+            }
+            if (view_applied) {
+                auto duration = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - view_published).count();
+                SPDLOG_LOGGER_INFO(logger, "epoch {} applied by all {} servers in {} us", view.epoch_id(), view.servers_size(), duration);
+            }
+        }
+    }
+    view_cv.notify_all();
+    return grpc::Status::OK;
+}
+
+grpc::Status Master::Join(grpc::ServerContext *ctx, const JoinRequest *req, JoinResponse *resp) {
+    uint32_t server = req->node_id();
+    uint32_t join_epoch;
+    std::vector<uint32_t> targets;
+    {
+        std::unique_lock<std::mutex> lock(membership_mutex);
+        SPDLOG_LOGGER_INFO(logger, "node_id {} at {} is joining", server, req->addr());
+        _addrs[server] = req->addr();
+        _stubs[server] = create_stub(req->addr());
+
+        std::unordered_set<uint32_t> active_servers = _active_servers.copy();
+        active_servers.erase(server);
+        epoch++;
+        join_epoch = epoch;
+        reconfigure(server, false);
+
+        resp->set_epoch_id(join_epoch);
+        for (auto active: active_servers) {
+            targets.push_back(active);
+            resp->add_servers(_addrs[active]);
+            if (!resp->has_donor()) {
+                resp->set_donor(_addrs[active]);
+            }
+        }
     }
+    // Without membership_mutex, which the heartbeats need. A replica that is slow to ack would
+    // otherwise hold them up long enough for every server to be suspected
+    awaitJoin(server, join_epoch, targets);
+    SPDLOG_LOGGER_INFO(logger, "node_id {} joined in epoch {}", server, join_epoch);
+    return grpc::Status::OK;
 }
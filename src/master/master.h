@@ -1,5 +1,8 @@
 #pragma once
+// Lowest level compiled in. Set with -DHERMES_LOG_LEVEL=... in cmake
+#ifndef SPDLOG_ACTIVE_LEVEL
 #define SPDLOG_ACTIVE_LEVEL SPDLOG_LEVEL_TRACE
+#endif
 
 #include "hermes.grpc.pb.h"
 
@@ -11,6 +14,9 @@
 #include <cstdint>
 #include <unordered_map>
 #include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
 #include <grpcpp/grpcpp.h>
 #include <absl/flags/flag.h>
 #include <absl/flags/parse.h>
@@ -19,15 +25,53 @@
 #include "spdlog/include/spdlog/sinks/basic_file_sink.h"
 
 #include "../utils/threadsafe_unordered_set.h"
+#include "failure_detector.h"
 
-class Master {
+struct MasterOptions {
+    // Heartbeats are sent to all servers at once every interval
+    uint32_t heartbeat_interval_ms = 100;
+
+    // A server is declared failed once the phi of its heartbeats exceeds the threshold, e.g.
+    // 8 for a 1e-8 chance of a false suspicion under the observed heartbeat jitter
+    double phi_threshold = 8;
+    uint32_t phi_min_std_dev_ms = 20;
+    uint32_t acceptable_heartbeat_pause_ms = 0;
+
+    // How long a Join waits for the replicas to apply the view that adds the joining node
+    uint32_t reconfigure_timeout_ms = 1000;
+};
+
+class Master: public HermesMaster::Service {
 private:
+    MasterOptions options;
+
     std::unordered_map<uint32_t, std::unique_ptr<Hermes::Stub>> _stubs;
 
+    std::unordered_map<uint32_t, std::string> _addrs;
+
+    // Serializes the heartbeat rounds (and the failures they detect) with joins
+    std::mutex membership_mutex;
+
     ThreadSafeUnorderedSet<uint32_t> _active_servers;
     
     ThreadSafeUnorderedSet<uint32_t> pending_acks;
 
+    // Heartbeat responses come back on heartbeat_cq, and are recorded in the detector by the
+    // receiver thread
+    PhiAccrualDetector detector;
+    std::mutex detector_mutex;
+    grpc::CompletionQueue heartbeat_cq;
+    std::thread heartbeat_receiver;
+
+    // Current view, pushed to the servers on their WatchMembership streams, and the latest
+    // epoch each server has acked. view_cv is signalled on a new view and on every ack
+    MembershipUpdate view;
+    std::unordered_map<uint32_t, uint32_t> applied_epochs;
+    std::chrono::steady_clock::time_point view_published;
+    bool view_applied = false;
+    std::mutex view_mutex;
+    std::condition_variable view_cv;
+
     std::string self_addr;
     
     uint32_t server_id;
@@ -39,12 +83,35 @@ private:
     std::shared_ptr<spdlog::logger> logger;
 
     void sendHeartbeats();
+    void receiveHeartbeats();
     void reconfigure(uint32_t server, bool fail=true);
+
+    // Waits till the replicas `targets` have added the joining server in `join_epoch`, then
+    // starts watching its heartbeats. Called without membership_mutex
+    void awaitJoin(uint32_t server, uint32_t join_epoch, const std::vector<uint32_t> &targets);
+
+    // Publishes the active servers as the view of the current epoch. Called with
+    // membership_mutex held
+    void publishView();
+
+    // Waits till every server of `servers` has acked `epoch`, or the deadline. Returns the
+    // ones that haven't
+    std::vector<uint32_t> waitForAcks(const std::vector<uint32_t> &servers, uint32_t epoch,
+        std::chrono::steady_clock::time_point deadline);
     inline uint32_t portToID(uint32_t port);
     uint32_t addrToID(std::string& addr);
 
 public:
-    Master(uint32_t id, std::string &log_dir, const std::vector<std::string> &server_list);
+    Master(uint32_t id, std::string &log_dir, const std::vector<std::string> &server_list,
+        const MasterOptions &options);
 
     void start();
+
+    // Adds a new (or restarted) server to the cluster in a new epoch
+    grpc::Status Join(grpc::ServerContext *ctx, const JoinRequest *req, JoinResponse *resp) override;
+
+    grpc::Status WatchMembership(grpc::ServerContext *ctx, const WatchMembershipRequest *req,
+        grpc::ServerWriter<MembershipUpdate> *writer) override;
+
+    grpc::Status AckMembership(grpc::ServerContext *ctx, const AckMembershipRequest *req, Empty *resp) override;
 };
\ No newline at end of file
@@ -0,0 +1,42 @@
+#pragma once
+
+#include <cstddef>
+#include <google/protobuf/arena.h>
+#include <grpcpp/support/message_allocator.h>
+
+// Allocates the request and response of a callback unary RPC on a protobuf arena, instead of
+// the heap. The first block of the arena is part of the holder, so parsing a small request
+// (its key, value and timestamp) and filling in the response take no allocation of their own,
+// and the whole RPC is freed at once when it finishes. Requests larger than the block spill
+// into heap blocks of the arena, which are freed with it.
+template <typename Request, typename Response, size_t BlockSize = 1024>
+class ArenaMessageAllocator : public grpc::MessageAllocator<Request, Response> {
+private:
+    class Holder : public grpc::MessageHolder<Request, Response> {
+    private:
+        alignas(8) char _block[BlockSize];
+        google::protobuf::Arena _arena;
+
+        static google::protobuf::ArenaOptions options(char *block) {
+            google::protobuf::ArenaOptions options;
+            options.initial_block = block;
+            options.initial_block_size = BlockSize;
+            return options;
+        }
+
+    public:
+        Holder() : _arena(options(_block)) {
+            this->set_request(google::protobuf::Arena::CreateMessage<Request>(&_arena));
+            this->set_response(google::protobuf::Arena::CreateMessage<Response>(&_arena));
+        }
+
+        void Release() override {
+            delete this;
+        }
+    };
+
+public:
+    grpc::MessageHolder<Request, Response>* AllocateMessages() override {
+        return new Holder();
+    }
+};
@@ -0,0 +1,504 @@
+#include <deque>
+
+#include "async_server.h"
+
+// Follower side of a replication stream in the async server
+class ReplicateReactor : public grpc::ServerBidiReactor<ReplicationMessage, ReplicationMessage> {
+private:
+    HermesServiceImpl &impl;
+    ReplicationMessage request;
+    std::deque<ReplicationMessage> pending_writes; // Only the front is being written
+    std::mutex mutex;
+    bool writing = false;
+    bool reads_done = false;
+    bool finished = false;
+    // Acks waiting for their write to be durable. The reactor outlives them
+    uint32_t pending_acks = 0;
+    bool done = false;
+
+    void finish(grpc::Status status) {
+        if (!finished) {
+            finished = true;
+            Finish(status);
+        }
+    }
+
+    // Called with the lock held
+    void finishIfIdle() {
+        if (reads_done && !writing && pending_acks == 0) {
+            finish(grpc::Status::OK);
+        }
+    }
+
+    // Runs on the WAL flusher thread, or inline if the write wasn't logged
+    void ackDurable(ReplicationMessage &&msg) {
+        std::unique_lock<std::mutex> lock(mutex);
+        pending_acks--;
+        if (done) {
+            if (pending_acks == 0) {
+                lock.unlock();
+                delete this;
+            }
+            return;
+        }
+        if (!finished) {
+            pending_writes.push_back(std::move(msg));
+            if (!writing) {
+                writing = true;
+                StartWrite(&pending_writes.front());
+            }
+        }
+        finishIfIdle();
+    }
+
+public:
+    explicit ReplicateReactor(HermesServiceImpl &impl) : impl(impl) {
+        StartRead(&request);
+    }
+
+    void OnReadDone(bool ok) override {
+        if (!ok) {
+            std::unique_lock<std::mutex> lock(mutex);
+            reads_done = true;
+            finishIfIdle();
+            return;
+        }
+        if (request.has_inv()) {
+            uint64_t lsn;
+            auto reply = std::make_shared<ReplicationMessage>(impl.handle_replicated_invalidate(request.inv(), &lsn));
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                pending_acks++;
+            }
+            // The next read doesn't wait for the ack, so the INVs of a burst share a WAL sync
+            impl.whenDurable(lsn, [this, reply] {ackDurable(std::move(*reply));});
+        }
+        else if (request.has_val()) {
+            impl.handle_validate(&request.val());
+        }
+        StartRead(&request);
+    }
+
+    void OnWriteDone(bool ok) override {
+        std::unique_lock<std::mutex> lock(mutex);
+        pending_writes.pop_front();
+        if (!ok) {
+            writing = false;
+            finish(grpc::Status(grpc::StatusCode::UNAVAILABLE, "replication stream write failed"));
+            return;
+        }
+        if (!pending_writes.empty() && !finished) {
+            StartWrite(&pending_writes.front());
+            return;
+        }
+        writing = false;
+        finishIfIdle();
+    }
+
+    void OnDone() override {
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            done = true;
+            if (pending_acks > 0) {
+                // Deleted by the last ack
+                return;
+            }
+        }
+        delete this;
+    }
+};
+
+// Server streaming RPC of the async server whose handler blocks, e.g. the donor side of a state
+// transfer, which waits on the rate limiter and on every chunk write for as long as the
+// transfer lasts. It runs on `pool`, a small pool of its own, instead of a gRPC thread or a
+// worker, so that long streams don't hold up write rounds. Streams beyond the size of the pool
+// queue up. `handler` is called with a blocking write function, and returns the status to
+// finish with
+template <typename Response>
+class BlockingWriteReactor : public grpc::ServerWriteReactor<Response> {
+private:
+    std::mutex mutex;
+    std::condition_variable write_cv;
+    bool write_pending = false;
+    bool write_ok = true;
+
+    bool write(const Response &resp) {
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            write_pending = true;
+        }
+        this->StartWrite(&resp);
+        std::unique_lock<std::mutex> lock(mutex);
+        write_cv.wait(lock, [this] {return !write_pending;});
+        return write_ok;
+    }
+
+public:
+    using WriteFn = std::function<bool(const Response&)>;
+
+    BlockingWriteReactor(Threadpool &pool, std::function<grpc::Status(const WriteFn&)> handler) {
+        // Finish() is the last use of the reactor (and of the request), OnDone() may delete it right after
+        pool.addTask([this, handler = std::move(handler)] {
+            this->Finish(handler([this](const Response &resp) {return write(resp);}));
+        });
+    }
+
+    void OnWriteDone(bool ok) override {
+        std::unique_lock<std::mutex> lock(mutex);
+        write_ok = ok;
+        write_pending = false;
+        write_cv.notify_one();
+    }
+
+    void OnDone() override {
+        delete this;
+    }
+};
+
+HermesAsyncServiceImpl::HermesAsyncServiceImpl(HermesServiceImpl &impl, uint32_t num_workers, uint32_t num_stream_workers)
+        : impl(impl), workers(num_workers), stream_workers(num_stream_workers), stop_timers(false) {
+    SetMessageAllocatorFor_Read(&read_allocator);
+    SetMessageAllocatorFor_Write(&write_allocator);
+    SetMessageAllocatorFor_Invalidate(&invalidate_allocator);
+    SetMessageAllocatorFor_Validate(&validate_allocator);
+    workers.start();
+    stream_workers.start();
+    timer_thread = std::thread(&HermesAsyncServiceImpl::timerLoop, this);
+}
+
+HermesAsyncServiceImpl::~HermesAsyncServiceImpl() {
+    {
+        std::unique_lock<std::mutex> lock(timer_mutex);
+        stop_timers = true;
+    }
+    timer_cv.notify_all();
+    timer_thread.join();
+    workers.stop();
+    // Blocked streams were cancelled by the server shutdown, so their handlers return
+    stream_workers.stop();
+}
+
+void HermesAsyncServiceImpl::timerLoop() {
+    std::unique_lock<std::mutex> lock(timer_mutex);
+    while (!stop_timers) {
+        if (timers.empty()) {
+            timer_cv.wait(lock);
+            continue;
+        }
+        auto deadline = timers.top().deadline;
+        if (std::chrono::steady_clock::now() < deadline) {
+            timer_cv.wait_until(lock, deadline);
+            continue;
+        }
+        auto op = timers.top().op.lock();
+        uint64_t generation = timers.top().generation;
+        timers.pop();
+        // The op may have been resumed by a VALIDATE in the meantime, and parked again with a
+        // timer of its own
+        if (op && op->parked.compare_exchange_strong(generation, 0)) {
+            workers.addTask([this, op] {onReplayTimeout(op);});
+        }
+    }
+}
+
+void HermesAsyncServiceImpl::resume(std::shared_ptr<ParkedOp> op) {
+    if (op->hermes_val->is_valid()) {
+        complete(op);
+        return;
+    }
+    park(op);
+}
+
+void HermesAsyncServiceImpl::park(std::shared_ptr<ParkedOp> op) {
+    // Only one park of an op is in progress at a time, so the generation needs no atomics
+    uint64_t generation = ++op->generation;
+    op->parked.store(generation);
+    bool parked = op->hermes_val->park_till_valid([this, op, generation] {
+        uint64_t expected = generation;
+        if (op->parked.compare_exchange_strong(expected, 0)) {
+            complete(op);
+        }
+    });
+    if (!parked) {
+        // Key became VALID before we could park
+        uint64_t expected = generation;
+        if (op->parked.compare_exchange_strong(expected, 0)) {
+            complete(op);
+        }
+        return;
+    }
+    {
+        std::unique_lock<std::mutex> lock(timer_mutex);
+        timers.push(Timer {std::chrono::steady_clock::now() + impl.rtt.replayTimeout(), op, generation});
+    }
+    timer_cv.notify_one();
+}
+
+// Runs on a worker thread. Same as the timeout handling in the sync Read and Write handlers
+void HermesAsyncServiceImpl::onReplayTimeout(std::shared_ptr<ParkedOp> op) {
+    auto hermes_val = op->hermes_val;
+    if (hermes_val->is_valid()) {
+        complete(op);
+        return;
+    }
+    SPDLOG_LOGGER_DEBUG (impl.logger, "[{}]::replay timeout expired for parked request", impl.get_tid());
+    if (!impl.isCoordinator(hermes_val)) {
+        // replay timeout expired. Start write replay
+        hermes_val->fol_invalid_to_replay_transition();
+        impl.performWriteReplay(hermes_val);
+        complete(op);
+    }
+    else {
+        SPDLOG_LOGGER_DEBUG (impl.logger, "[{}]::current node is the coordinator so cannot start write replay", impl.get_tid());
+        park(op);
+    }
+}
+
+void HermesAsyncServiceImpl::complete(std::shared_ptr<ParkedOp> op) {
+    if (op->write_req == nullptr) {
+        // Reads are only parked if the key wasn't VALID, so all of their wait is a stall
+        impl.metrics.read_stall_ns.record(nanosSince(op->start));
+        // perform the read corresponding to the current request
+        op->hermes_val->read_value(*op->read_resp->mutable_value());
+        impl.metrics.read_ns.record(nanosSince(op->start));
+        op->reactor->Finish(grpc::Status::OK);
+        return;
+    }
+    // The invalidation round blocks till the acks arrive, so it runs on a worker
+    workers.addTask([this, op] {
+        // Every op parked on the key is resumed when it becomes VALID, and only the first one
+        // to take it out of VALID writes now. The others park again
+        if (!impl.writeValid(op->hermes_val, op->write_req->value())) {
+            park(op);
+            return;
+        }
+        impl.metrics.write_ns.record(nanosSince(op->start));
+        op->reactor->Finish(grpc::Status::OK);
+    });
+}
+
+grpc::ServerUnaryReactor* HermesAsyncServiceImpl::Read(grpc::CallbackServerContext *ctx,
+        const ReadRequest *req, ReadResponse *resp) {
+    auto reactor = ctx->DefaultReactor();
+    if (impl.joining.load()) {
+        reactor->Finish(grpc::Status(grpc::StatusCode::UNAVAILABLE, "server is joining the cluster"));
+        return reactor;
+    }
+    if (impl.dead.load()) {
+        reactor->Finish(grpc::Status(grpc::StatusCode::UNAVAILABLE, "server is down"));
+        return reactor;
+    }
+    SPDLOG_LOGGER_DEBUG(impl.logger, "[{}]::Received async Read Request!", impl.get_tid());
+    auto start = std::chrono::steady_clock::now();
+    HermesValue *hermes_val = impl.getValueFromDB(req->key(), impl.key_value_map.hash(req->key()));
+    if (hermes_val == nullptr) {
+        SPDLOG_LOGGER_DEBUG (impl.logger, "[{}]::Read::Key not found!", impl.get_tid());
+        resp->set_value("Key not found");
+        impl.metrics.read_ns.record(nanosSince(start));
+        reactor->Finish(grpc::Status::OK);
+        return reactor;
+    }
+    if (hermes_val->read_if_valid(*resp->mutable_value())) {
+        impl.metrics.read_ns.record(nanosSince(start));
+        reactor->Finish(grpc::Status::OK);
+        return reactor;
+    }
+    auto op = std::make_shared<ParkedOp>();
+    op->start = start;
+    op->reactor = reactor;
+    op->hermes_val = hermes_val;
+    op->write_req = nullptr;
+    op->read_resp = resp;
+    resume(op);
+    return reactor;
+}
+
+grpc::ServerUnaryReactor* HermesAsyncServiceImpl::Write(grpc::CallbackServerContext *ctx,
+        const WriteRequest *req, Empty *resp) {
+    auto reactor = ctx->DefaultReactor();
+    if (impl.joining.load()) {
+        reactor->Finish(grpc::Status(grpc::StatusCode::UNAVAILABLE, "server is joining the cluster"));
+        return reactor;
+    }
+    if (impl.dead.load()) {
+        reactor->Finish(grpc::Status(grpc::StatusCode::UNAVAILABLE, "server is down"));
+        return reactor;
+    }
+    SPDLOG_LOGGER_DEBUG(impl.logger, "[{}]::Received async Write Request!", impl.get_tid());
+    auto start = std::chrono::steady_clock::now();
+    HermesValue *hermes_val = impl.writeNewKey(req->key(), impl.key_value_map.hash(req->key()), req->value()).first;
+    if (impl.write_combiner && !impl.write_combiner->join(hermes_val, req->value(), [this, reactor, start] {
+            impl.metrics.write_ns.record(nanosSince(start));
+            reactor->Finish(grpc::Status::OK);
+        })) {
+        // Finished by the op leading the batch of the key, once its round committed
+        return reactor;
+    }
+    auto op = std::make_shared<ParkedOp>();
+    op->start = start;
+    op->reactor = reactor;
+    op->hermes_val = hermes_val;
+    op->write_req = req;
+    op->read_resp = nullptr;
+    resume(op);
+    return reactor;
+}
+
+// Batched requests may stall on several keys, they run on the worker pool so that they don't
+// hold a gRPC thread
+
+grpc::ServerUnaryReactor* HermesAsyncServiceImpl::MultiRead(grpc::CallbackServerContext *ctx,
+        const MultiReadRequest *req, MultiReadResponse *resp) {
+    auto reactor = ctx->DefaultReactor();
+    workers.addTask([this, reactor, req, resp] {
+        reactor->Finish(impl.MultiRead(nullptr, req, resp));
+    });
+    return reactor;
+}
+
+grpc::ServerUnaryReactor* HermesAsyncServiceImpl::MultiWrite(grpc::CallbackServerContext *ctx,
+        const MultiWriteRequest *req, MultiWriteResponse *resp) {
+    auto reactor = ctx->DefaultReactor();
+    workers.addTask([this, reactor, req, resp] {
+        reactor->Finish(impl.MultiWrite(nullptr, req, resp));
+    });
+    return reactor;
+}
+
+// RMWs stall and retry on the worker pool too
+
+grpc::ServerUnaryReactor* HermesAsyncServiceImpl::CompareAndSwap(grpc::CallbackServerContext *ctx,
+        const CompareAndSwapRequest *req, CompareAndSwapResponse *resp) {
+    auto reactor = ctx->DefaultReactor();
+    workers.addTask([this, reactor, req, resp] {
+        reactor->Finish(impl.CompareAndSwap(nullptr, req, resp));
+    });
+    return reactor;
+}
+
+grpc::ServerUnaryReactor* HermesAsyncServiceImpl::FetchAdd(grpc::CallbackServerContext *ctx,
+        const FetchAddRequest *req, FetchAddResponse *resp) {
+    auto reactor = ctx->DefaultReactor();
+    workers.addTask([this, reactor, req, resp] {
+        reactor->Finish(impl.FetchAdd(nullptr, req, resp));
+    });
+    return reactor;
+}
+
+grpc::ServerUnaryReactor* HermesAsyncServiceImpl::Append(grpc::CallbackServerContext *ctx,
+        const AppendRequest *req, Empty *resp) {
+    auto reactor = ctx->DefaultReactor();
+    workers.addTask([this, reactor, req, resp] {
+        reactor->Finish(impl.Append(nullptr, req, resp));
+    });
+    return reactor;
+}
+
+// The internal RPCs don't block, so they are served inline by the sync implementation, except
+// for the INVs, whose acks wait for the WAL without holding a callback thread.
+// None of the sync handlers use their ServerContext.
+
+grpc::ServerUnaryReactor* HermesAsyncServiceImpl::Terminate(grpc::CallbackServerContext *ctx,
+        const TerminateRequest *req, Empty *resp) {
+    auto reactor = ctx->DefaultReactor();
+    reactor->Finish(impl.Terminate(nullptr, req, resp));
+    return reactor;
+}
+
+grpc::ServerUnaryReactor* HermesAsyncServiceImpl::Invalidate(grpc::CallbackServerContext *ctx,
+        const InvalidateRequest *req, InvalidateResponse *resp) {
+    auto reactor = ctx->DefaultReactor();
+    impl.whenDurable(impl.handle_invalidate(req, resp), [reactor] {reactor->Finish(grpc::Status::OK);});
+    return reactor;
+}
+
+grpc::ServerUnaryReactor* HermesAsyncServiceImpl::BatchInvalidate(grpc::CallbackServerContext *ctx,
+        const BatchInvalidateRequest *req, BatchInvalidateResponse *resp) {
+    auto reactor = ctx->DefaultReactor();
+    impl.whenDurable(impl.handle_batch_invalidate(req, resp), [reactor] {reactor->Finish(grpc::Status::OK);});
+    return reactor;
+}
+
+grpc::ServerUnaryReactor* HermesAsyncServiceImpl::Validate(grpc::CallbackServerContext *ctx,
+        const ValidateRequest *req, Empty *resp) {
+    auto reactor = ctx->DefaultReactor();
+    reactor->Finish(impl.Validate(nullptr, req, resp));
+    return reactor;
+}
+
+grpc::ServerBidiReactor<ReplicationMessage, ReplicationMessage>* HermesAsyncServiceImpl::Replicate(
+        grpc::CallbackServerContext *ctx) {
+    return new ReplicateReactor(impl);
+}
+
+grpc::ServerUnaryReactor* HermesAsyncServiceImpl::Mayday(grpc::CallbackServerContext *ctx,
+        const MaydayRequest *req, Empty *resp) {
+    auto reactor = ctx->DefaultReactor();
+    reactor->Finish(impl.Mayday(nullptr, req, resp));
+    return reactor;
+}
+
+grpc::ServerWriteReactor<Data>* HermesAsyncServiceImpl::TransferState(grpc::CallbackServerContext *ctx,
+        const TransferRequest *req) {
+    SPDLOG_LOGGER_INFO(impl.logger, "[{}]::Streaming the key space to node_id {}", impl.get_tid(), req->node_id());
+    return new BlockingWriteReactor<Data>(stream_workers, [this, req](const BlockingWriteReactor<Data>::WriteFn &write) {
+        if (impl.joining.load()) {
+            return grpc::Status(grpc::StatusCode::FAILED_PRECONDITION, "server is joining the cluster");
+        }
+        if (!impl.streamState(*req, write)) {
+            return grpc::Status(grpc::StatusCode::UNAVAILABLE, "state transfer aborted");
+        }
+        return grpc::Status::OK;
+    });
+}
+
+// A scan stalls on the keys that aren't VALID and blocks on every page write
+grpc::ServerWriteReactor<ScanResponse>* HermesAsyncServiceImpl::Scan(grpc::CallbackServerContext *ctx,
+        const ScanRequest *req) {
+    return new BlockingWriteReactor<ScanResponse>(stream_workers, [this, req](const BlockingWriteReactor<ScanResponse>::WriteFn &write) {
+        if (impl.joining.load()) {
+            return grpc::Status(grpc::StatusCode::UNAVAILABLE, "server is joining the cluster");
+        }
+        if (impl.dead.load()) {
+            return grpc::Status(grpc::StatusCode::UNAVAILABLE, "server is down");
+        }
+        return impl.scanKeys(*req, write);
+    });
+}
+
+grpc::ServerUnaryReactor* HermesAsyncServiceImpl::MerkleNodes(grpc::CallbackServerContext *ctx,
+        const MerkleNodesRequest *req, MerkleNodesResponse *resp) {
+    auto reactor = ctx->DefaultReactor();
+    reactor->Finish(impl.MerkleNodes(nullptr, req, resp));
+    return reactor;
+}
+
+// Copies the keys of whole leaves, so it runs on a worker
+grpc::ServerUnaryReactor* HermesAsyncServiceImpl::MerkleLeaves(grpc::CallbackServerContext *ctx,
+        const MerkleLeavesRequest *req, MerkleLeavesResponse *resp) {
+    auto reactor = ctx->DefaultReactor();
+    workers.addTask([this, reactor, req, resp] {
+        reactor->Finish(impl.MerkleLeaves(nullptr, req, resp));
+    });
+    return reactor;
+}
+
+grpc::ServerUnaryReactor* HermesAsyncServiceImpl::Heartbeat(grpc::CallbackServerContext *ctx,
+        const Empty *req, Empty *resp) {
+    auto reactor = ctx->DefaultReactor();
+    reactor->Finish(grpc::Status::OK);
+    return reactor;
+}
+
+grpc::ServerUnaryReactor* HermesAsyncServiceImpl::GetStats(grpc::CallbackServerContext *ctx,
+        const GetStatsRequest *req, GetStatsResponse *resp) {
+    auto reactor = ctx->DefaultReactor();
+    impl.fillStats(resp);
+    addPoolStats("async_workers", workers.stats(), resp);
+    addPoolStats("async_stream_workers", stream_workers.stats(), resp);
+    if (req->text()) {
+        resp->set_text(statsText(*resp));
+    }
+    reactor->Finish(grpc::Status::OK);
+    return reactor;
+}
@@ -0,0 +1,123 @@
+#pragma once
+
+#include "server.h"
+#include "arena_allocator.h"
+#include "../thread/threadpool.h"
+
+#include <memory>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <queue>
+#include <chrono>
+#include <condition_variable>
+
+// Callback (async) front end for HermesServiceImpl. Reads and writes for a key that isn't
+// VALID are parked on the key and resumed when it is validated (or the replay timeout
+// expires) instead of blocking a gRPC thread. Invalidation rounds and write replays,
+// which still block for a round trip, run on a separate pool of worker threads. Streaming
+// RPCs that block for as long as they last get a small pool of their own.
+class HermesAsyncServiceImpl: public Hermes::CallbackService {
+private:
+    // A Read or Write RPC waiting for its key to become VALID
+    struct ParkedOp {
+        grpc::ServerUnaryReactor *reactor;
+        HermesValue *hermes_val;
+        const WriteRequest *write_req; // nullptr for reads
+        ReadResponse *read_resp;
+        // An op is parked again when its write loses the key to another one. Each park has
+        // its own generation, and `parked` holds the current one until the op is resumed
+        uint64_t generation = 0;
+        std::atomic<uint64_t> parked {0};
+        // Arrival of the request, for the latency histograms
+        std::chrono::steady_clock::time_point start;
+    };
+
+    // Replay timeout of a parked op. A single timer thread serves all of them
+    struct Timer {
+        std::chrono::steady_clock::time_point deadline;
+        std::weak_ptr<ParkedOp> op;
+        uint64_t generation;
+
+        bool operator >(const Timer &other) const {
+            return deadline > other.deadline;
+        }
+    };
+
+    HermesServiceImpl &impl;
+
+    // Requests and responses of the RPCs on the hot path live on per-RPC arenas
+    ArenaMessageAllocator<ReadRequest, ReadResponse> read_allocator;
+    ArenaMessageAllocator<WriteRequest, Empty> write_allocator;
+    ArenaMessageAllocator<InvalidateRequest, InvalidateResponse> invalidate_allocator;
+    ArenaMessageAllocator<ValidateRequest, Empty> validate_allocator;
+
+    Threadpool workers;
+
+    // Runs the handlers of streaming RPCs that block, i.e. TransferState and Scan
+    Threadpool stream_workers;
+
+    std::priority_queue<Timer, std::vector<Timer>, std::greater<Timer>> timers;
+
+    std::mutex timer_mutex;
+
+    std::condition_variable timer_cv;
+
+    bool stop_timers;
+
+    std::thread timer_thread;
+
+    void timerLoop();
+
+    void resume(std::shared_ptr<ParkedOp> op);
+
+    void park(std::shared_ptr<ParkedOp> op);
+
+    void onReplayTimeout(std::shared_ptr<ParkedOp> op);
+
+    void complete(std::shared_ptr<ParkedOp> op);
+
+public:
+    HermesAsyncServiceImpl(HermesServiceImpl &impl, uint32_t num_workers, uint32_t num_stream_workers);
+
+    ~HermesAsyncServiceImpl();
+
+    grpc::ServerUnaryReactor* Read(grpc::CallbackServerContext *ctx, const ReadRequest *req, ReadResponse *resp) override;
+
+    grpc::ServerUnaryReactor* Write(grpc::CallbackServerContext *ctx, const WriteRequest *req, Empty *resp) override;
+
+    grpc::ServerUnaryReactor* MultiRead(grpc::CallbackServerContext *ctx, const MultiReadRequest *req, MultiReadResponse *resp) override;
+
+    grpc::ServerUnaryReactor* MultiWrite(grpc::CallbackServerContext *ctx, const MultiWriteRequest *req, MultiWriteResponse *resp) override;
+
+    grpc::ServerUnaryReactor* CompareAndSwap(grpc::CallbackServerContext *ctx, const CompareAndSwapRequest *req, CompareAndSwapResponse *resp) override;
+
+    grpc::ServerUnaryReactor* FetchAdd(grpc::CallbackServerContext *ctx, const FetchAddRequest *req, FetchAddResponse *resp) override;
+
+    grpc::ServerUnaryReactor* Append(grpc::CallbackServerContext *ctx, const AppendRequest *req, Empty *resp) override;
+
+    grpc::ServerUnaryReactor* Terminate(grpc::CallbackServerContext *ctx, const TerminateRequest *req, Empty *resp) override;
+
+    grpc::ServerUnaryReactor* Invalidate(grpc::CallbackServerContext *ctx, const InvalidateRequest *req, InvalidateResponse *resp) override;
+
+    grpc::ServerUnaryReactor* BatchInvalidate(grpc::CallbackServerContext *ctx, const BatchInvalidateRequest *req, BatchInvalidateResponse *resp) override;
+
+    grpc::ServerUnaryReactor* Validate(grpc::CallbackServerContext *ctx, const ValidateRequest *req, Empty *resp) override;
+
+    grpc::ServerBidiReactor<ReplicationMessage, ReplicationMessage>* Replicate(grpc::CallbackServerContext *ctx) override;
+
+    grpc::ServerUnaryReactor* Mayday(grpc::CallbackServerContext *ctx, const MaydayRequest *req, Empty *resp) override;
+
+
+    grpc::ServerWriteReactor<Data>* TransferState(grpc::CallbackServerContext *ctx, const TransferRequest *req) override;
+
+    grpc::ServerWriteReactor<ScanResponse>* Scan(grpc::CallbackServerContext *ctx, const ScanRequest *req) override;
+
+    grpc::ServerUnaryReactor* MerkleNodes(grpc::CallbackServerContext *ctx, const MerkleNodesRequest *req, MerkleNodesResponse *resp) override;
+
+    grpc::ServerUnaryReactor* MerkleLeaves(grpc::CallbackServerContext *ctx, const MerkleLeavesRequest *req, MerkleLeavesResponse *resp) override;
+
+    grpc::ServerUnaryReactor* Heartbeat(grpc::CallbackServerContext *ctx, const Empty *req, Empty *resp) override;
+
+    grpc::ServerUnaryReactor* GetStats(grpc::CallbackServerContext *ctx, const GetStatsRequest *req, GetStatsResponse *resp) override;
+};
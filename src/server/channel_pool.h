@@ -0,0 +1,146 @@
+#pragma once
+
+#include "hermes.grpc.pb.h"
+
+#include <vector>
+#include <algorithm>
+#include <string>
+#include <memory>
+#include <atomic>
+#include <cstdint>
+#include <shared_mutex>
+#include <unordered_map>
+#include <grpcpp/grpcpp.h>
+
+using StubPtr = std::shared_ptr<Hermes::Stub>;
+using ChannelPtr = std::shared_ptr<grpc::Channel>;
+
+// Long lived pool of gRPC channels to the other replicas in the cluster.
+// Each peer gets `channels_per_peer` channels, each on its own HTTP/2 connection, and
+// callers are handed out stubs round robin. Stubs are shared_ptrs so that an in-flight
+// write keeps its stubs alive even if the peer is dropped from the pool by a Mayday.
+// channels_per_peer == 0 disables pooling and creates a fresh channel on every call
+// (the old behaviour, kept around so that the two can be compared).
+class PeerChannelPool {
+private:
+    struct Peer {
+        std::string addr;
+        std::vector<std::shared_ptr<grpc::Channel>> channels;
+        std::vector<StubPtr> stubs;
+        std::atomic<uint64_t> next {0};
+    };
+
+    std::unordered_map<uint32_t, std::unique_ptr<Peer>> _peers;
+
+    uint32_t _channels_per_peer;
+
+    mutable std::shared_mutex _mutex;
+
+    std::shared_ptr<grpc::Channel> createChannel(const std::string &addr, uint32_t channel_idx) {
+        grpc::ChannelArguments args;
+        // Channels with identical arguments share a subchannel (and hence a TCP connection).
+        // Use a local subchannel pool and a distinct arg per channel to force separate connections.
+        args.SetInt(GRPC_ARG_USE_LOCAL_SUBCHANNEL_POOL, 1);
+        args.SetInt("hermes.channel_idx", channel_idx);
+        return grpc::CreateCustomChannel(addr, grpc::InsecureChannelCredentials(), args);
+    }
+
+    StubPtr createStub(const std::string &addr, uint32_t channel_idx) {
+        return std::make_shared<Hermes::Stub>(createChannel(addr, channel_idx));
+    }
+
+    std::unique_ptr<Peer> createPeer(const std::string &addr) {
+        auto peer = std::make_unique<Peer>();
+        peer->addr = addr;
+        for (uint32_t i = 0; i < _channels_per_peer; i++) {
+            peer->channels.push_back(createChannel(addr, i));
+            peer->stubs.push_back(std::make_shared<Hermes::Stub>(peer->channels.back()));
+        }
+        return peer;
+    }
+
+    StubPtr pick(Peer &peer) {
+        if (peer.stubs.empty()) {
+            return createStub(peer.addr, 0);
+        }
+        uint64_t idx = peer.next.fetch_add(1, std::memory_order_relaxed);
+        return peer.stubs[idx % peer.stubs.size()];
+    }
+
+    ChannelPtr pickChannel(Peer &peer) {
+        if (peer.channels.empty()) {
+            return createChannel(peer.addr, 0);
+        }
+        uint64_t idx = peer.next.fetch_add(1, std::memory_order_relaxed);
+        return peer.channels[idx % peer.channels.size()];
+    }
+
+public:
+    explicit PeerChannelPool(uint32_t channels_per_peer) : _channels_per_peer(channels_per_peer) {}
+
+    ~PeerChannelPool() = default;
+
+    void addPeer(uint32_t id, const std::string &addr) {
+        auto peer = createPeer(addr);
+        std::unique_lock<std::shared_mutex> lock(_mutex);
+        _peers[id] = std::move(peer);
+    }
+
+    void removePeer(uint32_t id) {
+        std::unique_lock<std::shared_mutex> lock(_mutex);
+        _peers.erase(id);
+    }
+
+    // Called on a membership (epoch) change. Drops the peers that are no longer active
+    // and reconnects channels which have gone into TRANSIENT_FAILURE or SHUTDOWN.
+    void refresh(const std::vector<uint32_t> &active_servers) {
+        std::unique_lock<std::shared_mutex> lock(_mutex);
+        for (auto it = _peers.begin(); it != _peers.end();) {
+            bool active = std::find(active_servers.begin(), active_servers.end(), it->first) != active_servers.end();
+            if (!active) {
+                it = _peers.erase(it);
+                continue;
+            }
+            auto &peer = *it->second;
+            for (uint32_t i = 0; i < peer.channels.size(); i++) {
+                auto state = peer.channels[i]->GetState(false);
+                if (state == GRPC_CHANNEL_TRANSIENT_FAILURE || state == GRPC_CHANNEL_SHUTDOWN) {
+                    peer.channels[i] = createChannel(peer.addr, i);
+                    peer.stubs[i] = std::make_shared<Hermes::Stub>(peer.channels[i]);
+                }
+            }
+            it++;
+        }
+    }
+
+    StubPtr get(uint32_t id) {
+        std::shared_lock<std::shared_mutex> lock(_mutex);
+        auto it = _peers.find(id);
+        if (it == _peers.end()) {
+            return nullptr;
+        }
+        return pick(*it->second);
+    }
+
+    // Returns one channel per server, in the same order as `servers`. Used with generic calls,
+    // which send requests that are serialized once for all the servers
+    std::vector<ChannelPtr> getChannels(const std::vector<uint32_t> &servers) {
+        std::vector<ChannelPtr> channels;
+        channels.reserve(servers.size());
+        std::shared_lock<std::shared_mutex> lock(_mutex);
+        for (auto server: servers) {
+            auto it = _peers.find(server);
+            if (it == _peers.end()) {
+                channels.push_back(createChannel("localhost:" + std::to_string(server), 0));
+            }
+            else {
+                channels.push_back(pickChannel(*it->second));
+            }
+        }
+        return channels;
+    }
+
+    uint32_t channelsPerPeer() const {
+        return _channels_per_peer;
+    }
+};
@@ -0,0 +1,106 @@
+#include "invalidate_batcher.h"
+
+InvalidateBatcher::InvalidateBatcher(PeerChannelPool &pool, std::chrono::microseconds window, uint32_t max_batch,
+        std::chrono::milliseconds rpc_timeout, std::shared_ptr<spdlog::logger> logger)
+        : _pool(pool), _window(window), _max_batch(max_batch), _rpc_timeout(rpc_timeout),
+          _logger(logger), _num_pending(0), _stop(false), _batches_sent(0), _invalidates_sent(0) {
+    _flusher = std::thread(&InvalidateBatcher::flushLoop, this);
+    _receiver = std::thread(&InvalidateBatcher::receiveLoop, this);
+}
+
+InvalidateBatcher::~InvalidateBatcher() {
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+        _stop = true;
+    }
+    _cv.notify_all();
+    _flusher.join();
+    _cq.Shutdown();
+    _receiver.join();
+}
+
+std::shared_ptr<InvalidateRound> InvalidateBatcher::submit(const InvalidateRequest &req,
+        const std::vector<uint32_t> &servers) {
+    auto round = std::make_shared<InvalidateRound>(servers);
+    auto shared_req = std::make_shared<const InvalidateRequest>(req);
+    bool notify;
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+        notify = (_num_pending == 0);
+        for (auto server: servers) {
+            _queues[server].push_back(Pending {shared_req, round});
+        }
+        _num_pending++;
+        notify = notify || (_num_pending >= _max_batch);
+    }
+    if (notify) {
+        _cv.notify_one();
+    }
+    return round;
+}
+
+void InvalidateBatcher::flushLoop() {
+    while (true) {
+        std::unordered_map<uint32_t, std::vector<Pending>> queues;
+        {
+            std::unique_lock<std::mutex> lock(_mutex);
+            _cv.wait(lock, [this] {return _stop || _num_pending > 0;});
+            if (_stop) {
+                break;
+            }
+            // Gather more writes till the window closes or the batch is full
+            auto deadline = std::chrono::steady_clock::now() + _window;
+            _cv.wait_until(lock, deadline, [this] {return _stop || _num_pending >= _max_batch;});
+            queues.swap(_queues);
+            _num_pending = 0;
+        }
+        for (auto& [peer, batch]: queues) {
+            if (!batch.empty()) {
+                sendBatch(peer, batch);
+            }
+        }
+    }
+}
+
+void InvalidateBatcher::sendBatch(uint32_t peer, std::vector<Pending> &batch) {
+    auto stub = _pool.get(peer);
+    if (stub == nullptr) {
+        // Peer was removed from the cluster. The rounds time out and the writes are retried
+        SPDLOG_LOGGER_DEBUG(_logger, "Dropping batch of {} invalidates for removed node_id {}", batch.size(), peer);
+        return;
+    }
+    BatchInvalidateRequest req;
+    BatchCall* call = new BatchCall();
+    call->peer = peer;
+    call->ctx.set_deadline(std::chrono::system_clock::now() + _rpc_timeout);
+    for (auto& pending: batch) {
+        *req.add_invalidates() = *pending.req;
+        call->rounds.push_back(std::move(pending.round));
+    }
+    auto receiver = stub->AsyncBatchInvalidate(&call->ctx, req, &_cq);
+    receiver->Finish(&call->response, &call->status, (void*)call);
+
+    _batches_sent++;
+    _invalidates_sent += batch.size();
+    if (_batches_sent % 10000 == 0) {
+        SPDLOG_LOGGER_INFO(_logger, "Sent {} invalidate batches, average batch size {}",
+            _batches_sent, (double)_invalidates_sent / _batches_sent);
+    }
+}
+
+void InvalidateBatcher::receiveLoop() {
+    void* next_tag;
+    bool ok;
+    while (_cq.Next(&next_tag, &ok)) {
+        BatchCall* call = static_cast<BatchCall*>(next_tag);
+        if (ok && call->status.ok() && call->response.acks_size() == (int)call->rounds.size()) {
+            for (int i = 0; i < call->response.acks_size(); i++) {
+                call->rounds[i]->ack(call->peer, call->response.acks(i).accept());
+            }
+        }
+        else {
+            SPDLOG_LOGGER_DEBUG(_logger, "BatchInvalidate to node_id {} failed: {}", call->peer, call->status.error_message());
+        }
+        delete call;
+    }
+}
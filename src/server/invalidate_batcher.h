@@ -0,0 +1,86 @@
+#pragma once
+
+#include "hermes.grpc.pb.h"
+#include "channel_pool.h"
+#include "invalidate_round.h"
+
+#include <vector>
+#include <string>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <cstdint>
+#include <unordered_map>
+#include <grpcpp/grpcpp.h>
+
+#include "spdlog/include/spdlog/spdlog.h"
+
+// Coordinator side batcher for INVALIDATE messages. Writes to different keys that are
+// issued within `window` of each other (or until `max_batch` writes are pending) are sent
+// to each peer as a single BatchInvalidate RPC. Every key still gets its own accept/reject
+// in the batched response.
+class InvalidateBatcher {
+private:
+    // The queues of all the peers share one copy of a write's invalidate
+    struct Pending {
+        std::shared_ptr<const InvalidateRequest> req;
+        std::shared_ptr<InvalidateRound> round;
+    };
+
+    struct BatchCall {
+        grpc::ClientContext ctx;
+        grpc::Status status;
+        BatchInvalidateResponse response;
+        std::vector<std::shared_ptr<InvalidateRound>> rounds;
+        uint32_t peer;
+    };
+
+    PeerChannelPool &_pool;
+
+    std::chrono::microseconds _window;
+
+    uint32_t _max_batch;
+
+    std::chrono::milliseconds _rpc_timeout;
+
+    std::shared_ptr<spdlog::logger> _logger;
+
+    // Pending invalidates per peer
+    std::unordered_map<uint32_t, std::vector<Pending>> _queues;
+
+    uint32_t _num_pending;
+
+    std::mutex _mutex;
+
+    std::condition_variable _cv;
+
+    bool _stop;
+
+    grpc::CompletionQueue _cq;
+
+    std::thread _flusher;
+
+    std::thread _receiver;
+
+    uint64_t _batches_sent;
+
+    uint64_t _invalidates_sent;
+
+    void flushLoop();
+
+    void receiveLoop();
+
+    void sendBatch(uint32_t peer, std::vector<Pending> &batch);
+
+public:
+    InvalidateBatcher(PeerChannelPool &pool, std::chrono::microseconds window, uint32_t max_batch,
+        std::chrono::milliseconds rpc_timeout, std::shared_ptr<spdlog::logger> logger);
+
+    ~InvalidateBatcher();
+
+    // Queue an invalidate for every server in `servers`. The returned round collects one ack
+    // per server.
+    std::shared_ptr<InvalidateRound> submit(const InvalidateRequest &req, const std::vector<uint32_t> &servers);
+};
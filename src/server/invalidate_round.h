@@ -0,0 +1,52 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <utility>
+#include <vector>
+
+// Acks for the invalidation round of a single write. Filled in as the acks come back
+// from the peers, either in batched responses or on the replication streams.
+// A retried round reuses the (key, ts) of the previous attempt, so late acks of that attempt
+// can arrive here too. Only the first ack of every peer counts, so that a peer acking twice
+// can't stand in for one that never accepted.
+class InvalidateRound {
+private:
+    std::mutex _mutex;
+    std::condition_variable _cv;
+    std::vector<uint32_t> _servers;
+    std::vector<bool> _acked;
+    int _acks;
+    int _acceptances;
+
+public:
+    explicit InvalidateRound(const std::vector<uint32_t> &servers)
+        : _servers(servers), _acked(servers.size(), false), _acks(0), _acceptances(0) {}
+
+    void ack(uint32_t node_id, bool accept) {
+        {
+            std::unique_lock<std::mutex> lock(_mutex);
+            auto it = std::find(_servers.begin(), _servers.end(), node_id);
+            if (it == _servers.end() || _acked[it - _servers.begin()]) {
+                return;
+            }
+            _acked[it - _servers.begin()] = true;
+            _acks++;
+            if (accept) {
+                _acceptances++;
+            }
+        }
+        _cv.notify_one();
+    }
+
+    // Waits till all the peers have acked or the deadline expires.
+    // Returns the number of (acks, acceptances) received.
+    std::pair<int, int> wait(std::chrono::steady_clock::time_point deadline) {
+        std::unique_lock<std::mutex> lock(_mutex);
+        _cv.wait_until(lock, deadline, [this] {return _acks >= (int)_servers.size();});
+        return std::make_pair(_acks, _acceptances);
+    }
+};
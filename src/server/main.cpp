@@ -2,6 +2,7 @@
 #include <atomic>
 #include <csignal>
 #include "server.h"
+#include "async_server.h"
 #include "../utils/config.h"
 
 ABSL_FLAG(uint32_t, id, 1, "Server id");
@@ -10,6 +11,28 @@ ABSL_FLAG(std::string, log_dir, "", "log directory");
 ABSL_FLAG(std::string, config_file, "", "Config file");
 ABSL_FLAG(std::string, db_dir, "", "db directory");
 ABSL_FLAG(uint16_t, master_port, -1, "port of master node");
+ABSL_FLAG(uint32_t, channels_per_peer, 1, "Number of pooled channels per peer (0 creates a channel per write)");
+ABSL_FLAG(uint32_t, inv_batch_window_us, 0, "Window for batching invalidates across keys in us (0 disables batching)");
+ABSL_FLAG(uint32_t, inv_batch_max, 64, "Maximum number of writes in an invalidate batch");
+ABSL_FLAG(bool, replication_streams, false, "Replicate over persistent bidi streams instead of unary RPCs");
+ABSL_FLAG(bool, async_server, false, "Serve requests with the callback API so that requests for invalid keys don't block threads");
+ABSL_FLAG(uint32_t, async_workers, 8, "Worker threads for write rounds and replays in the async server");
+ABSL_FLAG(uint32_t, async_stream_workers, 4, "Threads serving Scan and TransferState streams in the async server, more of them queue up");
+ABSL_FLAG(std::string, wal_mode, "none", "Durability of the write-ahead log in db_dir: none, async or group (fsync shared by concurrent writes)");
+ABSL_FLAG(uint32_t, snapshot_interval_s, 0, "Seconds between snapshots of the key-value map to db_dir (0 disables them)");
+ABSL_FLAG(uint32_t, multi_write_threads, 16, "Threads running the writes of MultiWrite requests concurrently");
+ABSL_FLAG(uint32_t, replication_threads, 4, "Threads sending the VALs of committed writes");
+ABSL_FLAG(uint32_t, mlt_min_us, 1000, "Lower bound of the message loss timeout, which is derived from the RTT of the peers");
+ABSL_FLAG(uint32_t, mlt_max_us, 1000000, "Upper bound of the message loss timeout, and its value till the RTT is measured");
+ABSL_FLAG(uint32_t, replay_timeout_min_us, 2000, "Lower bound of the time a request waits for a VAL before replaying the write");
+ABSL_FLAG(uint32_t, replay_timeout_max_us, 1000000, "Upper bound of the replay timeout, and its value till the RTT is measured");
+ABSL_FLAG(bool, ordered_index, false, "Keep the keys in order for the Scan RPC");
+ABSL_FLAG(bool, write_coalescing, false, "Combine the writes queued on a key that is being written into one round with the last value");
+ABSL_FLAG(bool, join, false, "Join a running cluster through the master instead of starting with the servers in the config");
+ABSL_FLAG(uint32_t, transfer_mb_per_s, 32, "Rate limit for streaming the key space to a joining node in MB/s (0 is unlimited)");
+ABSL_FLAG(std::string, log_level, "info", "Log level: trace, debug, info, warn, err or off. Per-request messages are logged at debug");
+ABSL_FLAG(bool, async_logging, false, "Write the log from a background thread, dropping the oldest messages when the queue is full");
+ABSL_FLAG(uint32_t, log_queue_size, 8192, "Messages queued for the background log thread with --async_logging");
 
 std::atomic<bool> terminate_flag(false);
 
@@ -27,16 +50,66 @@ int main(int argc, char** argv) {
     std::string server_address("localhost:" + std::to_string(port));
     std::string config_file = absl::GetFlag(FLAGS_config_file);
     auto server_list = parseConfigFile(config_file);
+
+    ServerOptions options;
+    options.channels_per_peer = absl::GetFlag(FLAGS_channels_per_peer);
+    options.inv_batch_window_us = absl::GetFlag(FLAGS_inv_batch_window_us);
+    options.inv_batch_max = absl::GetFlag(FLAGS_inv_batch_max);
+    options.replication_streams = absl::GetFlag(FLAGS_replication_streams);
+    options.multi_write_threads = absl::GetFlag(FLAGS_multi_write_threads);
+    options.replication_threads = absl::GetFlag(FLAGS_replication_threads);
+    options.mlt_min_us = absl::GetFlag(FLAGS_mlt_min_us);
+    options.mlt_max_us = absl::GetFlag(FLAGS_mlt_max_us);
+    options.replay_timeout_min_us = absl::GetFlag(FLAGS_replay_timeout_min_us);
+    options.replay_timeout_max_us = absl::GetFlag(FLAGS_replay_timeout_max_us);
+    options.ordered_index = absl::GetFlag(FLAGS_ordered_index);
+    options.write_coalescing = absl::GetFlag(FLAGS_write_coalescing);
+    options.db_dir = absl::GetFlag(FLAGS_db_dir);
+    options.snapshot_interval_s = absl::GetFlag(FLAGS_snapshot_interval_s);
+    options.join = absl::GetFlag(FLAGS_join);
+    if (absl::GetFlag(FLAGS_master_port) != static_cast<uint16_t>(-1)) {
+        options.master_addr = "localhost:" + std::to_string(absl::GetFlag(FLAGS_master_port));
+    }
+    options.transfer_mb_per_s = absl::GetFlag(FLAGS_transfer_mb_per_s);
+    options.log_level = absl::GetFlag(FLAGS_log_level);
+    options.async_logging = absl::GetFlag(FLAGS_async_logging);
+    options.log_queue_size = absl::GetFlag(FLAGS_log_queue_size);
+    if (!parseWalMode(absl::GetFlag(FLAGS_wal_mode), &options.wal_mode)) {
+        std::cerr << "Invalid --wal_mode " << absl::GetFlag(FLAGS_wal_mode) << std::endl;
+        return 1;
+    }
+    if (options.mlt_min_us > options.mlt_max_us || options.replay_timeout_min_us > options.replay_timeout_max_us) {
+        std::cerr << "Timeout lower bounds must not exceed the upper bounds" << std::endl;
+        return 1;
+    }
+    if (spdlog::level::from_str(options.log_level) == spdlog::level::off && options.log_level != "off") {
+        std::cerr << "Invalid --log_level " << options.log_level << std::endl;
+        return 1;
+    }
     
     // Register signal handler
     //std::signal(SIGTERM, handle_sigterm);
 
-    HermesServiceImpl service(id, log_dir, server_list, port, terminate_flag);
+    HermesServiceImpl service(id, log_dir, server_list, port, terminate_flag, options);
 
+    std::unique_ptr<HermesAsyncServiceImpl> async_service;
     grpc::ServerBuilder builder;
     builder.AddListeningPort(server_address, grpc::InsecureServerCredentials());
-    builder.RegisterService(&service);
+    if (absl::GetFlag(FLAGS_async_server)) {
+        async_service = std::make_unique<HermesAsyncServiceImpl>(service, absl::GetFlag(FLAGS_async_workers),
+            absl::GetFlag(FLAGS_async_stream_workers));
+        builder.RegisterService(async_service.get());
+    }
+    else {
+        builder.RegisterService(&service);
+    }
     std::unique_ptr<grpc::Server> server(builder.BuildAndStart());
     std::cout << "Server listening on " << server_address << std::endl;
+    // Replication requests of the new epoch are served while the key space is copied
+    if (options.join && !service.join("localhost:" + std::to_string(absl::GetFlag(FLAGS_master_port)))) {
+        std::cerr << "Failed to join the cluster" << std::endl;
+        server->Shutdown();
+        return 1;
+    }
     server->Wait();
 }
@@ -0,0 +1,64 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+// Replica set of an epoch, as seen by one server, i.e. without itself. Immutable once published
+struct MembershipView {
+    uint32_t epoch = 0;
+    std::vector<uint32_t> servers;
+
+    bool contains(uint32_t server) const {
+        for (auto s: servers) {
+            if (s == server) {
+                return true;
+            }
+        }
+        return false;
+    }
+};
+
+// Current MembershipView, published RCU style: readers (every write's invalidation round) get
+// the view with a single atomic load and no lock, and a membership change publishes a new view
+// instead of editing the current one. Old views are kept for the lifetime of the server, like
+// the retired blocks of a HermesValue, so a reader never has to announce that it is done with
+// one. Membership changes are rare and a view is a few words, so this never adds up to much.
+class Membership {
+private:
+    std::atomic<const MembershipView*> _current;
+
+    // Serializes publishers, and owns every view published so far
+    std::mutex _mutex;
+    std::vector<std::unique_ptr<const MembershipView>> _views;
+
+public:
+    Membership() : Membership(MembershipView()) {}
+
+    explicit Membership(MembershipView initial) {
+        _views.push_back(std::make_unique<const MembershipView>(std::move(initial)));
+        _current.store(_views.back().get(), std::memory_order_release);
+    }
+
+    // Valid for the lifetime of the Membership
+    const MembershipView* current() const {
+        return _current.load(std::memory_order_acquire);
+    }
+
+    // Publishes the view returned by update(current view), if any. Returns the published view,
+    // or nullptr if update didn't change anything. Publishers run one at a time, so update()
+    // may also change state that has to follow the membership, e.g. the peer channels
+    template <typename Update>
+    const MembershipView* update(Update &&update) {
+        std::unique_lock<std::mutex> lock(_mutex);
+        std::unique_ptr<const MembershipView> next = update(*current());
+        if (!next) {
+            return nullptr;
+        }
+        _views.push_back(std::move(next));
+        _current.store(_views.back().get(), std::memory_order_release);
+        return _views.back().get();
+    }
+};
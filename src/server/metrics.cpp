@@ -0,0 +1,95 @@
+#include "metrics.h"
+
+#include <iterator>
+#include <sstream>
+#include <vector>
+
+#include <absl/strings/match.h>
+
+namespace {
+
+struct HistogramInfo {
+    const char *name;
+    const Histogram *histogram;
+    // Multiplier from the recorded unit to the reported one
+    double scale;
+};
+
+const double QUANTILES[] = {0.5, 0.9, 0.99, 0.999};
+
+std::vector<HistogramInfo> histograms(const ServerMetrics &m) {
+    return {
+        {"read_seconds", &m.read_ns, 1e-9},
+        {"write_seconds", &m.write_ns, 1e-9},
+        {"rmw_seconds", &m.rmw_ns, 1e-9},
+        {"invalidate_seconds", &m.invalidate_ns, 1e-9},
+        {"validate_seconds", &m.validate_ns, 1e-9},
+        {"inv_round_seconds", &m.inv_round_ns, 1e-9},
+        {"ack_wait_seconds", &m.ack_wait_ns, 1e-9},
+        {"write_retries", &m.write_retries, 1},
+        {"read_stall_seconds", &m.read_stall_ns, 1e-9},
+        {"write_batch_size", &m.write_batch_size, 1},
+    };
+}
+
+} // namespace
+
+void ServerMetrics::fill(GetStatsResponse *resp) const {
+    for (auto& info: histograms(*this)) {
+        auto snapshot = info.histogram->snapshot();
+        HistogramStats *stats = resp->add_histograms();
+        stats->set_name(info.name);
+        stats->set_count(snapshot.count);
+        stats->set_sum(snapshot.sum * info.scale);
+        stats->set_mean(snapshot.mean() * info.scale);
+        stats->set_p50(snapshot.percentile(0.5) * info.scale);
+        stats->set_p90(snapshot.percentile(0.9) * info.scale);
+        stats->set_p99(snapshot.percentile(0.99) * info.scale);
+        stats->set_p999(snapshot.percentile(0.999) * info.scale);
+        stats->set_max(snapshot.max * info.scale);
+    }
+    CounterStats *counter = resp->add_counters();
+    counter->set_name("replays_total");
+    counter->set_value(replays.load(std::memory_order_relaxed));
+    counter = resp->add_counters();
+    counter->set_name("rmw_aborts_total");
+    counter->set_value(rmw_aborts.load(std::memory_order_relaxed));
+}
+
+void addPoolStats(const std::string &pool, const Threadpool::Stats &stats, GetStatsResponse *resp) {
+    std::pair<const char*, uint64_t> values[] = {
+        {"_threads", stats.threads},
+        {"_idle_threads", stats.idle},
+        {"_queued", stats.queued},
+        {"_tasks_total", stats.executed},
+        {"_steals_total", stats.steals},
+    };
+    for (auto& [suffix, value]: values) {
+        CounterStats *counter = resp->add_counters();
+        counter->set_name(pool + suffix);
+        counter->set_value(value);
+    }
+}
+
+std::string statsText(const GetStatsResponse &resp) {
+    std::ostringstream out;
+    for (auto& stats: resp.histograms()) {
+        std::string name = "hermes_" + stats.name();
+        double quantiles[] = {stats.p50(), stats.p90(), stats.p99(), stats.p999()};
+        out << "# TYPE " << name << " summary\n";
+        for (size_t i = 0; i < std::size(QUANTILES); i++) {
+            out << name << "{quantile=\"" << QUANTILES[i] << "\"} " << quantiles[i] << "\n";
+        }
+        out << name << "_sum " << stats.sum() << "\n";
+        out << name << "_count " << stats.count() << "\n";
+        out << "# TYPE " << name << "_max gauge\n";
+        out << name << "_max " << stats.max() << "\n";
+    }
+    for (auto& counter: resp.counters()) {
+        std::string name = "hermes_" + counter.name();
+        bool is_counter = absl::EndsWith(name, "_total");
+        out << "# TYPE " << name << (is_counter ? " counter\n" : " gauge\n");
+        out << name << " " << counter.value() << "\n";
+    }
+    return out.str();
+}
@@ -0,0 +1,78 @@
+#pragma once
+
+#include "hermes.pb.h"
+#include "../utils/histogram.h"
+#include "../thread/threadpool.h"
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <string>
+
+// Server-side latency and retry histograms, returned by the GetStats RPC. Recording is a few
+// relaxed atomic increments, so the metrics are always on. Times are recorded in nanoseconds
+// and reported in seconds.
+class ServerMetrics {
+public:
+    // Handling time of client requests, per key for MultiRead and MultiWrite
+    Histogram read_ns;
+    Histogram write_ns;
+
+    // Handling time of CompareAndSwap, FetchAdd and Append, retries included
+    Histogram rmw_ns;
+
+    // Handling time of INVALIDATEs and VALIDATEs on a follower, per key
+    Histogram invalidate_ns;
+    Histogram validate_ns;
+
+    // Coordinator side of an invalidation round: from sending the INVs to the last ACK or the
+    // MLT expiring, and the part of it spent blocked waiting for the ACKs
+    Histogram inv_round_ns;
+    Histogram ack_wait_ns;
+
+    // Rounds a write needed after the first, i.e. rounds that timed out or were rejected
+    Histogram write_retries;
+
+    // Time a read waited for its key to become VALID. Only recorded for reads that found the
+    // key in another state
+    Histogram read_stall_ns;
+
+    // Writes committed by each round of write coalescing, the leader's included
+    Histogram write_batch_size;
+
+    // Write replays started by this node
+    std::atomic<uint64_t> replays {0};
+
+    // RMW attempts aborted by a concurrent update with a higher timestamp
+    std::atomic<uint64_t> rmw_aborts {0};
+
+    void fill(GetStatsResponse *resp) const;
+};
+
+// Adds the queue depth, idle workers and task/steal counts of a thread pool, as counters
+// prefixed with `pool`
+void addPoolStats(const std::string &pool, const Threadpool::Stats &stats, GetStatsResponse *resp);
+
+// Prometheus text exposition format of a filled GetStatsResponse. Counters ending in _total are
+// exported as counters, the others as gauges
+std::string statsText(const GetStatsResponse &resp);
+
+// Records the time from construction to destruction
+class ScopedLatency {
+private:
+    Histogram &_histogram;
+    std::chrono::steady_clock::time_point _start;
+
+public:
+    explicit ScopedLatency(Histogram &histogram) :
+        _histogram(histogram), _start(std::chrono::steady_clock::now()) {}
+
+    ~ScopedLatency() {
+        _histogram.record(std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now() - _start).count());
+    }
+};
+
+inline uint64_t nanosSince(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+}
@@ -0,0 +1,158 @@
+#include "replication_streams.h"
+
+ReplicationStreams::ReplicationStreams(PeerChannelPool &pool, std::shared_ptr<spdlog::logger> logger)
+        : _pool(pool), _logger(logger) {}
+
+ReplicationStreams::~ReplicationStreams() {
+    reset();
+}
+
+std::string ReplicationStreams::roundID(const std::string &key, const HermesTimestamp &ts) {
+    return key + '\0' + std::to_string(ts.node_id()) + '.' + std::to_string(ts.local_ts());
+}
+
+std::shared_ptr<ReplicationStreams::PeerSlot> ReplicationStreams::getSlot(uint32_t peer) {
+    std::unique_lock<std::mutex> lock(_streams_mutex);
+    auto& slot = _streams[peer];
+    if (slot == nullptr) {
+        slot = std::make_shared<PeerSlot>();
+    }
+    return slot;
+}
+
+std::shared_ptr<ReplicationStreams::PeerStream> ReplicationStreams::getStream(uint32_t peer) {
+    while (true) {
+        auto slot = getSlot(peer);
+        std::shared_ptr<PeerStream> old;
+        std::shared_ptr<PeerStream> ps;
+        {
+            std::unique_lock<std::mutex> lock(slot->mutex);
+            if (slot->removed) {
+                // Raced with reset(), look the peer up again
+                continue;
+            }
+            if (slot->stream != nullptr && !slot->stream->broken.load()) {
+                return slot->stream;
+            }
+            if (slot->stream != nullptr) {
+                SPDLOG_LOGGER_DEBUG(_logger, "Replication stream to node_id {} is broken. Reconnecting", peer);
+                old = std::move(slot->stream);
+            }
+
+            auto stub = _pool.get(peer);
+            if (stub != nullptr) {
+                ps = std::make_shared<PeerStream>();
+                ps->peer = peer;
+                ps->stream = stub->Replicate(&ps->ctx);
+                ps->reader = std::thread(&ReplicationStreams::readLoop, this, ps.get());
+                slot->stream = ps;
+                SPDLOG_LOGGER_INFO(_logger, "Opened replication stream to node_id {}", peer);
+            }
+        }
+        // Joining the reader of the broken stream doesn't hold up the senders of the new one
+        if (old != nullptr) {
+            closeStream(old);
+        }
+        return ps;
+    }
+}
+
+void ReplicationStreams::closeStream(std::shared_ptr<PeerStream> &ps) {
+    // Cancelling the call unblocks the reader, which then finishes the stream
+    ps->broken.store(true);
+    ps->ctx.TryCancel();
+    if (ps->reader.joinable()) {
+        ps->reader.join();
+    }
+}
+
+void ReplicationStreams::readLoop(PeerStream *ps) {
+    ReplicationMessage msg;
+    while (ps->stream->Read(&msg)) {
+        if (!msg.has_ack()) {
+            continue;
+        }
+        auto& ack = msg.ack();
+        std::shared_ptr<InvalidateRound> round;
+        {
+            std::unique_lock<std::mutex> lock(_pending_mutex);
+            auto it = _pending.find(roundID(ack.key(), ack.ts()));
+            if (it != _pending.end()) {
+                round = it->second;
+            }
+        }
+        if (round) {
+            round->ack(ps->peer, ack.accept());
+        }
+    }
+    ps->broken.store(true);
+    grpc::Status status;
+    {
+        std::unique_lock<std::mutex> lock(ps->write_mutex);
+        status = ps->stream->Finish();
+    }
+    SPDLOG_LOGGER_INFO(_logger, "Replication stream to node_id {} closed: {}", ps->peer, status.error_message());
+}
+
+bool ReplicationStreams::send(uint32_t peer, const ReplicationMessage &msg) {
+    auto ps = getStream(peer);
+    if (ps == nullptr) {
+        return false;
+    }
+    std::unique_lock<std::mutex> lock(ps->write_mutex);
+    if (ps->broken.load() || !ps->stream->Write(msg)) {
+        ps->broken.store(true);
+        return false;
+    }
+    return true;
+}
+
+std::shared_ptr<InvalidateRound> ReplicationStreams::invalidate(const InvalidateRequest &req,
+        const std::vector<uint32_t> &servers) {
+    auto round = std::make_shared<InvalidateRound>(servers);
+    {
+        std::unique_lock<std::mutex> lock(_pending_mutex);
+        _pending[roundID(req.key(), req.ts())] = round;
+    }
+    ReplicationMessage msg;
+    *msg.mutable_inv() = req;
+    for (auto server: servers) {
+        // A failed send is not retried here. The round times out and the write is retried
+        if (!send(server, msg)) {
+            SPDLOG_LOGGER_DEBUG(_logger, "Failed to send INV for key {} to node_id {}", req.key(), server);
+        }
+    }
+    return round;
+}
+
+void ReplicationStreams::complete(const std::string &key, const HermesTimestamp &ts) {
+    std::unique_lock<std::mutex> lock(_pending_mutex);
+    _pending.erase(roundID(key, ts));
+}
+
+void ReplicationStreams::validate(const ValidateRequest &req, const std::vector<uint32_t> &servers) {
+    ReplicationMessage msg;
+    *msg.mutable_val() = req;
+    for (auto server: servers) {
+        send(server, msg);
+    }
+}
+
+void ReplicationStreams::reset() {
+    std::unordered_map<uint32_t, std::shared_ptr<PeerSlot>> streams;
+    {
+        std::unique_lock<std::mutex> lock(_streams_mutex);
+        streams.swap(_streams);
+    }
+    for (auto& [peer, slot]: streams) {
+        std::shared_ptr<PeerStream> ps;
+        {
+            std::unique_lock<std::mutex> lock(slot->mutex);
+            slot->removed = true;
+            ps = std::move(slot->stream);
+        }
+        if (ps != nullptr) {
+            closeStream(ps);
+        }
+    }
+}
@@ -0,0 +1,84 @@
+#pragma once
+
+#include "hermes.grpc.pb.h"
+#include "channel_pool.h"
+#include "invalidate_round.h"
+
+#include <vector>
+#include <string>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <cstdint>
+#include <unordered_map>
+#include <grpcpp/grpcpp.h>
+
+#include "spdlog/include/spdlog/spdlog.h"
+
+// Coordinator side of the streaming replication mode. Keeps one long lived Replicate
+// stream to every peer and multiplexes the INV and VAL messages of all writes on it.
+// ACKs come back on the same stream and are matched to the waiting write by (key, ts).
+// Streams are opened lazily and re-established after an error or an epoch change.
+class ReplicationStreams {
+private:
+    using Stream = grpc::ClientReaderWriter<ReplicationMessage, ReplicationMessage>;
+
+    struct PeerStream {
+        uint32_t peer;
+        grpc::ClientContext ctx;
+        std::unique_ptr<Stream> stream;
+        std::mutex write_mutex; // Writes on a stream must not be concurrent
+        std::atomic<bool> broken {false};
+        std::thread reader;
+    };
+
+    PeerChannelPool &_pool;
+
+    std::shared_ptr<spdlog::logger> _logger;
+
+    // Stream to one peer. Opening and closing it only holds the lock of that peer
+    struct PeerSlot {
+        std::mutex mutex;
+        std::shared_ptr<PeerStream> stream;
+        bool removed = false; // Dropped from _streams by reset()
+    };
+
+    std::unordered_map<uint32_t, std::shared_ptr<PeerSlot>> _streams;
+
+    // Only guards the map itself
+    std::mutex _streams_mutex;
+
+    // Writes waiting for ACKs, keyed by (key, ts)
+    std::unordered_map<std::string, std::shared_ptr<InvalidateRound>> _pending;
+
+    std::mutex _pending_mutex;
+
+    static std::string roundID(const std::string &key, const HermesTimestamp &ts);
+
+    std::shared_ptr<PeerSlot> getSlot(uint32_t peer);
+
+    std::shared_ptr<PeerStream> getStream(uint32_t peer);
+
+    void closeStream(std::shared_ptr<PeerStream> &ps);
+
+    void readLoop(PeerStream *ps);
+
+    bool send(uint32_t peer, const ReplicationMessage &msg);
+
+public:
+    ReplicationStreams(PeerChannelPool &pool, std::shared_ptr<spdlog::logger> logger);
+
+    ~ReplicationStreams();
+
+    // Sends the INV to every server. The returned round collects one ACK per server.
+    // complete() must be called once the caller is done waiting on the round.
+    std::shared_ptr<InvalidateRound> invalidate(const InvalidateRequest &req, const std::vector<uint32_t> &servers);
+
+    void complete(const std::string &key, const HermesTimestamp &ts);
+
+    void validate(const ValidateRequest &req, const std::vector<uint32_t> &servers);
+
+    // Tears down all the streams. Called on an epoch change, streams are reopened on next use.
+    void reset();
+};
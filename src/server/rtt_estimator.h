@@ -0,0 +1,135 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <unordered_map>
+#include <vector>
+
+// Running estimate of the INV->ACK round trip time of every peer, from which the message loss
+// timeout (MLT) of an invalidation round and the replay timeout of a stalled request are derived.
+// Same as the TCP retransmission timeout (RFC 6298): a smoothed RTT and its mean deviation are
+// kept per peer, the timeout is srtt + 4 * rttvar, and it doubles every time a round with that
+// peer times out, until the next sample.
+class RttEstimator {
+public:
+    struct Bounds {
+        std::chrono::nanoseconds mlt_min;
+        std::chrono::nanoseconds mlt_max;
+        std::chrono::nanoseconds replay_min;
+        std::chrono::nanoseconds replay_max;
+    };
+
+private:
+    struct Peer {
+        // 0 till the first sample
+        std::atomic<int64_t> srtt_ns {0};
+        std::atomic<int64_t> rttvar_ns {0};
+        std::atomic<uint32_t> backoff {0};
+    };
+
+    static constexpr uint32_t MAX_BACKOFF = 16;
+
+    Bounds _bounds;
+
+    mutable std::shared_mutex _mutex;
+    std::unordered_map<uint32_t, std::unique_ptr<Peer>> _peers;
+
+    Peer* find(uint32_t peer) const {
+        std::shared_lock<std::shared_mutex> lock(_mutex);
+        auto it = _peers.find(peer);
+        return it == _peers.end() ? nullptr : it->second.get();
+    }
+
+    Peer* findOrInsert(uint32_t peer) {
+        if (Peer *p = find(peer)) {
+            return p;
+        }
+        std::unique_lock<std::shared_mutex> lock(_mutex);
+        auto& p = _peers[peer];
+        if (!p) {
+            p = std::make_unique<Peer>();
+        }
+        return p.get();
+    }
+
+    // Unclamped timeout of a peer. Without samples, the upper bound
+    int64_t rawTimeout(const Peer *p) const {
+        int64_t srtt = p ? p->srtt_ns.load(std::memory_order_relaxed) : 0;
+        if (srtt == 0) {
+            return _bounds.mlt_max.count();
+        }
+        int64_t rto = srtt + 4 * p->rttvar_ns.load(std::memory_order_relaxed);
+        // Can't overflow, with the backoff capped and an RTT of hours
+        return rto << p->backoff.load(std::memory_order_relaxed);
+    }
+
+    std::chrono::nanoseconds clampMlt(int64_t ns) const {
+        return std::chrono::nanoseconds(std::clamp(ns, _bounds.mlt_min.count(), _bounds.mlt_max.count()));
+    }
+
+public:
+    explicit RttEstimator(const Bounds &bounds) : _bounds(bounds) {}
+
+    // Round trip of a message to `peer` that was acked. Concurrent samples of the same peer may
+    // overwrite each other, which only drops a sample
+    void addSample(uint32_t peer, std::chrono::nanoseconds rtt) {
+        Peer *p = findOrInsert(peer);
+        int64_t sample = std::max<int64_t>(rtt.count(), 1);
+        int64_t srtt = p->srtt_ns.load(std::memory_order_relaxed);
+        if (srtt == 0) {
+            p->srtt_ns.store(sample, std::memory_order_relaxed);
+            p->rttvar_ns.store(sample / 2, std::memory_order_relaxed);
+        } else {
+            int64_t rttvar = p->rttvar_ns.load(std::memory_order_relaxed);
+            int64_t err = sample - srtt;
+            p->rttvar_ns.store(rttvar + ((err < 0 ? -err : err) - rttvar) / 4, std::memory_order_relaxed);
+            p->srtt_ns.store(srtt + err / 8, std::memory_order_relaxed);
+        }
+        p->backoff.store(0, std::memory_order_relaxed);
+    }
+
+    // A round with the peer timed out
+    void backoff(uint32_t peer) {
+        Peer *p = findOrInsert(peer);
+        uint32_t backoff = p->backoff.load(std::memory_order_relaxed);
+        if (backoff < MAX_BACKOFF) {
+            p->backoff.store(backoff + 1, std::memory_order_relaxed);
+        }
+    }
+
+    std::chrono::nanoseconds messageLossTimeout(uint32_t peer) const {
+        return clampMlt(rawTimeout(find(peer)));
+    }
+
+    // MLT of a round with all of `peers`, i.e. of the slowest one
+    std::chrono::nanoseconds messageLossTimeout(const std::vector<uint32_t> &peers) const {
+        int64_t timeout = 0;
+        for (uint32_t peer: peers) {
+            timeout = std::max(timeout, rawTimeout(find(peer)));
+        }
+        return clampMlt(timeout);
+    }
+
+    // How long a request waits for the VAL of an overlapping write before replaying it. The
+    // coordinator of the write may be any node and its VAL only goes out after its own
+    // invalidation round, so twice the largest MLT of any peer
+    std::chrono::nanoseconds replayTimeout() const {
+        int64_t timeout = 0;
+        {
+            std::shared_lock<std::shared_mutex> lock(_mutex);
+            if (_peers.empty()) {
+                return _bounds.replay_max;
+            }
+            for (auto& [peer, p]: _peers) {
+                timeout = std::max(timeout, rawTimeout(p.get()));
+            }
+        }
+        timeout = 2 * clampMlt(timeout).count();
+        return std::chrono::nanoseconds(std::clamp(timeout, _bounds.replay_min.count(), _bounds.replay_max.count()));
+    }
+};
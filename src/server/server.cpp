@@ -3,9 +3,15 @@
 #include <string>
 #include <stdexcept>
 #include <chrono>
+#include <future>
+#include <cstring>
 
 #include "server.h"
+#include "spdlog/include/spdlog/async.h"
 #include <grpcpp/alarm.h>
+#include <grpcpp/generic/generic_stub.h>
+#include <google/protobuf/arena.h>
+#include <absl/strings/numbers.h>
 
 template<typename ResponseType>
 struct GrpcAsyncCall {
@@ -13,46 +19,224 @@ struct GrpcAsyncCall {
     grpc::Status status;
     grpc::ClientContext ctx;
     ResponseType response;
+    std::chrono::steady_clock::time_point start;
 
-    GrpcAsyncCall(int i): tag_value(i) {};
+    GrpcAsyncCall(int i): tag_value(i), start(std::chrono::steady_clock::now()) {};
 };
 
-std::unique_ptr<Hermes::Stub> create_stub(const std::string &addr) {
-    auto channel_ptr = grpc::CreateChannel(addr, grpc::InsecureChannelCredentials());
-    return std::make_unique<Hermes::Stub>(channel_ptr);
+namespace {
+
+// Records of a state transfer are packed into chunks of about this size
+constexpr size_t TRANSFER_CHUNK_SIZE = 64 << 10;
+
+// Same for the messages of a Scan
+constexpr size_t SCAN_CHUNK_SIZE = 64 << 10;
+
+// First block of the arena of a write's INV, on the stack. An INV with a small value fits in it
+constexpr size_t INV_ARENA_BLOCK_SIZE = 512;
+
+// INVs and VALs are serialized once and the bytes sent to every peer, through generic calls
+const std::string INVALIDATE_METHOD = "/Hermes/Invalidate";
+const std::string VALIDATE_METHOD = "/Hermes/Validate";
+
+template <typename Message>
+grpc::ByteBuffer serializeOnce(const Message &msg) {
+    grpc::ByteBuffer buffer;
+    bool own_buffer;
+    grpc::SerializationTraits<Message>::Serialize(msg, &buffer, &own_buffer);
+    return buffer;
+}
+
+// Batch sizes of an anti-entropy resync, they bound the size of a single response
+constexpr size_t MERKLE_LEAVES_PER_REQUEST = 256;
+constexpr size_t TRANSFER_KEYS_PER_REQUEST = 4096;
+
+using Merkle = MerkleTree<HermesValue>;
+
+constexpr size_t TRANSFER_HEADER_SIZE = 4 * sizeof(uint32_t) + sizeof(uint8_t);
+
+void putU32(std::string &out, uint32_t value) {
+    char bytes[sizeof(uint32_t)];
+    std::memcpy(bytes, &value, sizeof(value));
+    out.append(bytes, sizeof(bytes));
+}
+
+uint32_t getU32(const char *data) {
+    uint32_t value;
+    std::memcpy(&value, data, sizeof(value));
+    return value;
+}
+
+// Encoding of a record in a Data chunk, see hermes.proto
+void appendTransferRecord(std::string &chunk, const SnapshotRecord &record) {
+    putU32(chunk, record.key.size());
+    putU32(chunk, record.value.size());
+    putU32(chunk, record.logical_time);
+    putU32(chunk, record.node_id);
+    chunk.push_back(static_cast<char>(record.state));
+    chunk.append(record.key.data(), record.key.size());
+    chunk.append(record.value.data(), record.value.size());
+}
+
+// Returns false if the chunk is malformed. Records before the malformed one are still passed on
+bool parseTransferChunk(const std::string &chunk, const std::function<void(const SnapshotRecord&)> &callback) {
+    size_t offset = 0;
+    while (offset < chunk.size()) {
+        if (offset + TRANSFER_HEADER_SIZE > chunk.size()) {
+            return false;
+        }
+        const char *header = chunk.data() + offset;
+        SnapshotRecord record;
+        uint32_t key_len = getU32(header);
+        uint32_t value_len = getU32(header + sizeof(uint32_t));
+        record.logical_time = getU32(header + 2 * sizeof(uint32_t));
+        record.node_id = getU32(header + 3 * sizeof(uint32_t));
+        record.state = static_cast<uint8_t>(header[4 * sizeof(uint32_t)]);
+        offset += TRANSFER_HEADER_SIZE;
+        if (offset + key_len + value_len > chunk.size()) {
+            return false;
+        }
+        record.key = absl::string_view(chunk.data() + offset, key_len);
+        record.value = absl::string_view(chunk.data() + offset + key_len, value_len);
+        callback(record);
+        offset += key_len + value_len;
+    }
+    return true;
+}
+
 }
 
 HermesServiceImpl::HermesServiceImpl(uint32_t id, std::string &log_dir, 
         const std::vector<std::string> &server_list,
         uint32_t port,
-        std::atomic<bool>& terminate_flag)
-        : server_id(id), epoch(0) {
+        std::atomic<bool>& terminate_flag,
+        const ServerOptions &options)
+        : channel_pool(options.channels_per_peer),
+          transfer_limiter(static_cast<uint64_t>(options.transfer_mb_per_s) << 20),
+          rtt(RttEstimator::Bounds {std::chrono::microseconds(options.mlt_min_us), std::chrono::microseconds(options.mlt_max_us),
+              std::chrono::microseconds(options.replay_timeout_min_us), std::chrono::microseconds(options.replay_timeout_max_us)}),
+          server_id(id) {
     // Logger initialization
     std::string log_file_name = log_dir + "/spdlog_server_" + std::to_string(id) + ".log";
 
     // Initialize the logger and set the flush rate
     //spdlog::flush_every(std::chrono::microseconds(100));
-    spdlog::flush_every(std::chrono::milliseconds(1));
-    logger = spdlog::basic_logger_mt("server_logger", log_file_name);
+    if (options.async_logging) {
+        // One background thread drains the queue and writes the file. It is flushed
+        // periodically and on warnings, so request threads never wait on the disk
+        spdlog::init_thread_pool(options.log_queue_size, 1);
+        logger = spdlog::create_async_nb<spdlog::sinks::basic_file_sink_mt>("server_logger", log_file_name);
+        spdlog::flush_every(std::chrono::milliseconds(100));
+        logger->flush_on(spdlog::level::warn);
+    } else {
+        spdlog::flush_every(std::chrono::milliseconds(1));
+        logger = spdlog::basic_logger_mt("server_logger", log_file_name);
+        logger->flush_on(spdlog::level::info);
+    }
 
     // Set logging level
-    logger->set_level(spdlog::level::info);
-    logger->flush_on(spdlog::level::info);
+    logger->set_level(spdlog::level::from_str(options.log_level));
     
     //active_servers = std::move(server_list);
     self_addr = "localhost:" + std::to_string(port);
 
+    // A joining node learns the replica set from the master
+    joining.store(options.join);
+    auto initial = std::make_unique<MembershipView>();
     for (auto server: server_list) {
+        if (options.join) break;
         if (server == self_addr) continue;
         //_stubs.push_back(create_stub(server));
         uint32_t other_id = addrToID(server);
         SPDLOG_LOGGER_INFO(logger, "Adding {} to active list", other_id);
-        _active_servers.push_back(other_id);
-        _stubs[other_id] = create_stub(server);
+        initial->servers.push_back(other_id);
+        channel_pool.addPeer(other_id, server);
         //_stubs.insert(create_stub(server));
     }
+    membership.update([&](const MembershipView &current) {return std::move(initial);});
+    master_addr = options.master_addr;
+
+    if (options.replication_streams) {
+        SPDLOG_LOGGER_INFO(logger, "Using replication streams");
+        replication_streams = std::make_unique<ReplicationStreams>(channel_pool, logger);
+    }
+    else if (options.inv_batch_window_us > 0) {
+        SPDLOG_LOGGER_INFO(logger, "Batching invalidates over {} us, max {} writes per batch",
+            options.inv_batch_window_us, options.inv_batch_max);
+        inv_batcher = std::make_unique<InvalidateBatcher>(channel_pool,
+            std::chrono::microseconds(options.inv_batch_window_us), options.inv_batch_max,
+            std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::microseconds(options.mlt_max_us)), logger);
+    }
+
+    if (options.write_coalescing) {
+        SPDLOG_LOGGER_INFO(logger, "Coalescing concurrent writes of the same key");
+        write_combiner = std::make_unique<WriteCombiner>();
+    }
+
+    if (!options.db_dir.empty()) {
+        snapshot_path = options.db_dir + "/snapshot_" + std::to_string(id) + ".snap";
+        std::string error;
+        auto start = std::chrono::steady_clock::now();
+        snapshot = Snapshot::open(snapshot_path, &error);
+        auto duration = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+        if (snapshot) {
+            SPDLOG_LOGGER_INFO(logger, "Loaded snapshot {} with {} keys in {} us", snapshot_path, snapshot->size(), duration);
+        }
+        else {
+            SPDLOG_LOGGER_INFO(logger, "No snapshot loaded: {}", error);
+        }
+    }
+
+    // Before the WAL replay, which adds its keys through writeNewKey
+    if (options.ordered_index) {
+        auto start = std::chrono::steady_clock::now();
+        ordered_index = std::make_unique<ConcurrentSkipList<HermesValue>>();
+        if (snapshot) {
+            // Keys are views into the mapped snapshot, which stays open
+            for (uint64_t i = 0; i < snapshot->size(); i++) {
+                ordered_index->insert(snapshot->at(i).key, nullptr);
+            }
+        }
+        auto duration = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
+        SPDLOG_LOGGER_INFO(logger, "Built the ordered index with {} keys in {} ms", ordered_index->size(), duration);
+    }
+
+    // Writes update merkle_tree from here on, concurrently with the fold since the hashes add up
+    if (snapshot) {
+        merkle_thread = std::thread(&HermesServiceImpl::foldSnapshotIntoMerkleTree, this);
+    }
+    else {
+        merkle_ready.store(true);
+    }
+
+    // The WAL is replayed on top of the snapshot
+    if (options.wal_mode != WalMode::NONE) {
+        if (options.db_dir.empty()) {
+            throw std::invalid_argument("The WAL needs --db_dir");
+        }
+        std::string wal_path = options.db_dir + "/wal_" + std::to_string(id) + ".log";
+        SPDLOG_LOGGER_INFO(logger, "Using WAL {}", wal_path);
+        wal = std::make_unique<WriteAheadLog>(wal_path, options.wal_mode,
+            [this](absl::string_view key, absl::string_view value, uint32_t logical_time, uint32_t node_id) {
+                recoverWrite(key, value, logical_time, node_id);
+            }, logger);
+    }
+
+    if (options.snapshot_interval_s > 0 && !snapshot_path.empty()) {
+        snapshot_thread = std::thread(&HermesServiceImpl::snapshotLoop, this, options.snapshot_interval_s);
+    }
+
+    multi_write_pool = std::make_unique<Threadpool>(std::max<uint32_t>(options.multi_write_threads, 1));
+    multi_write_pool->start();
+    replication_pool = std::make_unique<Threadpool>(std::max<uint32_t>(options.replication_threads, 1));
+    replication_pool->start();
 
     dead.store(false);
+
+    // A joining node starts watching once it has joined
+    if (!options.join) {
+        startMembershipWatch();
+    }
 }
 
 //HermesServiceImpl::~HermesServiceImpl() {
@@ -64,7 +248,166 @@ HermesServiceImpl::HermesServiceImpl(uint32_t id, std::string &log_dir,
 //    terminate();
 //}
 
-HermesServiceImpl::~HermesServiceImpl() {}
+HermesServiceImpl::~HermesServiceImpl() {
+    {
+        std::unique_lock<std::mutex> lock(snapshot_mutex);
+        stop_snapshots = true;
+    }
+    snapshot_cv.notify_all();
+    if (snapshot_thread.joinable()) {
+        snapshot_thread.join();
+    }
+    if (merkle_thread.joinable()) {
+        merkle_thread.join();
+    }
+    {
+        std::unique_lock<std::mutex> lock(watch_mutex);
+        stop_watch = true;
+        if (watch_ctx) {
+            watch_ctx->TryCancel();
+        }
+    }
+    watch_cv.notify_all();
+    if (watch_thread.joinable()) {
+        watch_thread.join();
+    }
+    // Pool tasks use the logger and the stubs, which are destroyed before the pools
+    multi_write_pool->stop();
+    replication_pool->stop();
+}
+
+void HermesServiceImpl::foldSnapshotIntoMerkleTree() {
+    auto start = std::chrono::steady_clock::now();
+    // Only reads the index, which is sorted by the same hash as the leaves
+    for (uint64_t i = 0; i < snapshot->size(); i++) {
+        const Snapshot::Entry &entry = snapshot->entry(i);
+        merkle_tree.insert(entry.hash, entry.logical_time, entry.node_id);
+    }
+    merkle_ready.store(true);
+    auto duration = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
+    SPDLOG_LOGGER_INFO(logger, "Added {} snapshot keys to the Merkle tree in {} ms", snapshot->size(), duration);
+}
+
+void HermesServiceImpl::indexAdd(HermesValue *hermes_val) {
+    if (ordered_index) {
+        ordered_index->insert(hermes_val->key(), hermes_val);
+    }
+}
+
+void HermesServiceImpl::merkleAdd(HermesValue *hermes_val, Timestamp ts, bool from_snapshot) {
+    uint64_t key_hash = Snapshot::hash(hermes_val->key());
+    if (!from_snapshot) {
+        merkle_tree.insert(key_hash, ts.logical_time, ts.node_id);
+    }
+    merkle_tree.addRecord(key_hash, hermes_val);
+}
+
+void HermesServiceImpl::merkleUpdate(HermesValue *hermes_val, const TimestampChange &change) {
+    merkle_tree.update(Snapshot::hash(hermes_val->key()), change.from.logical_time, change.from.node_id,
+        change.to.logical_time, change.to.node_id);
+}
+
+void HermesServiceImpl::forEachInLeaf(uint32_t leaf, const std::function<void(absl::string_view, Timestamp)> &fn) {
+    // Keys that are only in the snapshot first. One that is accessed meanwhile is also passed on
+    // from the records below, with its newer timestamp
+    if (snapshot) {
+        uint64_t end = leaf + 1 < Merkle::NUM_LEAVES ? snapshot->lowerBound(Merkle::firstHashOf(leaf + 1)) : snapshot->size();
+        for (uint64_t i = snapshot->lowerBound(Merkle::firstHashOf(leaf)); i < end; i++) {
+            SnapshotRecord record = snapshot->at(i);
+            if (key_value_map.find(record.key, key_value_map.hash(record.key)) == nullptr) {
+                Timestamp ts;
+                ts.logical_time = record.logical_time;
+                ts.node_id = record.node_id;
+                fn(record.key, ts);
+            }
+        }
+    }
+    for (HermesValue *hermes_val: merkle_tree.records(leaf)) {
+        fn(hermes_val->key(), hermes_val->getTimestamp());
+    }
+}
+
+void HermesServiceImpl::snapshotLoop(uint32_t interval_s) {
+    std::unique_lock<std::mutex> lock(snapshot_mutex);
+    while (!snapshot_cv.wait_for(lock, std::chrono::seconds(interval_s), [this] {return stop_snapshots;})) {
+        lock.unlock();
+        takeSnapshot();
+        lock.lock();
+    }
+}
+
+bool HermesServiceImpl::takeSnapshot() {
+    auto start = std::chrono::steady_clock::now();
+    // Writes logged from here on go to the new log. The ones in the rotated log were applied
+    // to key_value_map before they were logged, so the snapshot covers them.
+    bool rotated = wal && wal->rotate();
+
+    // Collect the records first so that each shard lock is held only for a pointer copy. The
+    // values are read as their records are written, with optimistic reads that don't block
+    // writers, so they are never all copied at once
+    std::vector<HermesValue*> hermes_vals;
+    hermes_vals.reserve(key_value_map.size());
+    key_value_map.forEach([&](absl::string_view key, HermesValue *hermes_val) {
+        hermes_vals.push_back(hermes_val);
+    });
+
+    std::vector<SnapshotRecord> records;
+    records.reserve(hermes_vals.size() + (snapshot ? snapshot->size() : 0));
+    for (HermesValue *hermes_val: hermes_vals) {
+        records.push_back(SnapshotRecord {hermes_val->key(), absl::string_view(), 0, 0, 0});
+    }
+    // Keys of the loaded snapshot that were never accessed are only in the snapshot
+    if (snapshot) {
+        for (uint64_t i = 0; i < snapshot->size(); i++) {
+            SnapshotRecord record = snapshot->at(i);
+            if (key_value_map.find(record.key, key_value_map.hash(record.key)) == nullptr) {
+                records.push_back(record);
+            }
+        }
+    }
+
+    std::string error;
+    auto fill = [&](size_t i, SnapshotRecord &record, std::string &scratch) {
+        if (i >= hermes_vals.size()) {
+            // Only in the snapshot, already complete
+            return;
+        }
+        Timestamp ts;
+        State st;
+        hermes_vals[i]->read_all(scratch, ts, st);
+        record.value = scratch;
+        record.logical_time = ts.logical_time;
+        record.node_id = ts.node_id;
+        record.state = static_cast<uint8_t>(st);
+    };
+    if (!Snapshot::write(snapshot_path, records, &error, fill)) {
+        SPDLOG_LOGGER_CRITICAL(logger, "Failed to write snapshot: {}", error);
+        return false;
+    }
+    if (rotated) {
+        wal->dropRotated();
+    }
+    auto duration = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
+    SPDLOG_LOGGER_INFO(logger, "Wrote snapshot {} with {} keys in {} ms", snapshot_path, records.size(), duration);
+    return true;
+}
+
+void HermesServiceImpl::recoverWrite(absl::string_view key, absl::string_view value,
+        uint32_t logical_time, uint32_t node_id) {
+    std::string value_str(value);
+    HermesTimestamp ts;
+    ts.set_local_ts(logical_time);
+    ts.set_node_id(node_id);
+    auto [hermes_val, new_key] = writeNewKey(key, key_value_map.hash(key), value_str);
+    // The log has the writes of a key in the order they were accepted, but a follower may have
+    // logged a write that was later overwritten by one with a higher timestamp.
+    // A follower logs an INV when it accepts it, before the VAL, so the write may never have
+    // committed. The key stays INVALID, like a key that wasn't VALID in the snapshot, and the
+    // write is replayed on its first access
+    if (new_key || (!hermes_val->is_lower(ts) && hermes_val->not_equal(ts))) {
+        merkleUpdate(hermes_val, hermes_val->fol_invalidate(value_str, ts));
+    }
+}
 
 inline uint32_t HermesServiceImpl::portToID(uint32_t port) {
     return port;
@@ -90,44 +433,60 @@ uint32_t HermesServiceImpl::addrToID(std::string& addr) {
     }
 }
 
-std::string HermesServiceImpl::get_tid() {
-    std::stringstream ss;
-    ss << std::this_thread::get_id();
-    return ss.str();
+const std::string& HermesServiceImpl::get_tid() {
+    thread_local const std::string tid = [] {
+        std::stringstream ss;
+        ss << std::this_thread::get_id();
+        return ss.str();
+    }();
+    return tid;
 }
 
-std::pair<bool, map_iterator> HermesServiceImpl::isKeyPresent(std::string key) {
-    map_iterator it;
-    map_iterator end_it;
-    {
-        std::shared_lock<std::shared_mutex> lock {hashmap_mutex};
-        it = key_value_map.find(key);
-        end_it = key_value_map.end();
+HermesValue* HermesServiceImpl::getValueFromDB(absl::string_view key, size_t hash) {
+    HermesValue *hermes_val = key_value_map.find(key, hash);
+    SnapshotRecord record;
+    if (hermes_val == nullptr && snapshot && snapshot->find(key, &record)) {
+        Timestamp ts;
+        ts.logical_time = record.logical_time;
+        ts.node_id = record.node_id;
+        auto result = key_value_map.findOrInsert(key, hash, [&] {
+            return HermesValue::create(key, std::string(record.value), ts, static_cast<State>(record.state));
+        });
+        hermes_val = result.first;
+        if (result.second) {
+            indexAdd(hermes_val);
+            merkleAdd(hermes_val, ts, true);
+        }
     }
-    
-    return std::make_pair(it != end_it, it);
-
+    return hermes_val;
 }
 
-map_iterator HermesServiceImpl::getValueFromDB(std::string key) {
-    map_iterator it;
-    map_iterator end_it;
-    {
-        std::shared_lock<std::shared_mutex> lock {hashmap_mutex};
-        it = key_value_map.find(key);
-        end_it = key_value_map.end();
+std::pair<HermesValue*, bool> HermesServiceImpl::writeNewKey(absl::string_view key, size_t hash, const std::string &value) {
+    // A key of the snapshot is not new, its timestamp must be checked
+    if (snapshot) {
+        HermesValue *hermes_val = getValueFromDB(key, hash);
+        if (hermes_val != nullptr) {
+            return std::make_pair(hermes_val, false);
+        }
     }
-    assert(it != end_it);
-    return it;
-}
-
-HermesValue* HermesServiceImpl::writeNewKey(std::string key, std::string value) {
-    std::unique_lock<std::shared_mutex> lock {hashmap_mutex};
-    key_value_map[key] = std::make_unique<HermesValue>(key, value, server_id);
-    return key_value_map[key].get();
+    Timestamp initial_ts;
+    auto result = key_value_map.findOrInsert(key, hash, [&] {
+        auto hermes_val = HermesValue::create(key, value, server_id);
+        initial_ts = hermes_val->getTimestamp();
+        return hermes_val;
+    });
+    if (result.second) {
+        indexAdd(result.first);
+        merkleAdd(result.first, initial_ts, false);
+    }
+    if (result.second && (num_keys.fetch_add(1) + 1) % 100000 == 0) {
+        SPDLOG_LOGGER_INFO(logger, "{} keys, record slabs: {}", num_keys.load(), record_allocator().stats().toString());
+        SPDLOG_LOGGER_INFO(logger, "{} keys, value slabs: {}", num_keys.load(), value_allocator().stats().toString());
+    }
+    return result;
 }
 
-void HermesServiceImpl::performWrite(HermesValue *hermes_val) {
+bool HermesServiceImpl::performWrite(HermesValue *hermes_val) {
     SPDLOG_LOGGER_TRACE (logger, "[{}]::performing write", get_tid());
     uint32_t current_epoch;
     /**
@@ -143,52 +502,117 @@ void HermesServiceImpl::performWrite(HermesValue *hermes_val) {
     //     SPDLOG_LOGGER_CRITICAL(logger, "Compare and Swap failed!!. Value still in VALID state.");
     // }
 
-    std::string key = hermes_val->key;
-    std::string value = hermes_val->value;
-
+    // The INV is built once for every round and peer, on an arena whose first block is on the
+    // stack. The value is copied once, straight into the message
+    alignas(8) char arena_block[INV_ARENA_BLOCK_SIZE];
+    google::protobuf::ArenaOptions arena_options;
+    arena_options.initial_block = arena_block;
+    arena_options.initial_block_size = sizeof(arena_block);
+    google::protobuf::Arena arena(arena_options);
+    InvalidateRequest *inv = google::protobuf::Arena::CreateMessage<InvalidateRequest>(&arena);
+    inv->set_key(hermes_val->key().data(), hermes_val->key().size());
+    hermes_val->read_value(*inv->mutable_value());
+    *inv->mutable_ts() = write_ts.get_grpc_timestamp();
+    const std::string &key = inv->key();
+    const std::string &value = inv->value();
+
+    uint32_t rounds = 0;
+    bool aborted = false;
     while (true) {
-        std::vector<uint32_t> current_active_servers;
-        std::vector<std::unique_ptr<Hermes::Stub>> server_stubs;
-        grpc::CompletionQueue broadcast_queue;
-        {
-            std::shared_lock<std::shared_mutex> server_state_lock {server_state_mutex};
-            current_active_servers.resize(_active_servers.size());
-            std::copy(_active_servers.begin(), _active_servers.end(), current_active_servers.begin());
-            current_epoch = epoch;
-            // current_active_servers = _active_servers.copy();
-        }
-        auto start = std::chrono::system_clock::now();
-        for (auto& server: current_active_servers) {
-            std::string addr = "localhost:" + std::to_string(server);
-            server_stubs.push_back(create_stub(addr));
-        }
-        auto end = std::chrono::system_clock::now();
-        auto duration = std::chrono::duration_cast<std::chrono::microseconds>(end-start).count();
-        SPDLOG_LOGGER_TRACE (logger, "Took {} us to create grpc stubs", duration);
-        broadcast_invalidate(write_ts, value, key, broadcast_queue, current_active_servers, server_stubs, current_epoch);
-
-        //// To test write replay
-        //if (server_id == 50052) {
-        //    terminate();
-        //    return;
-        //}
-
-        // Check if the write was interrupted by a higher priority write
-        if (!hermes_val->is_write()) {
-            // TODO(): This shouldn't be required. Just return
-            SPDLOG_LOGGER_INFO(logger, "[{}]::Received Invalidate RPC in the middle of write RPC. Aborting write.", get_tid());
-            broadcast_queue.Shutdown();
-            break;
+        rounds++;
+        // Replica set of the round, without taking a lock. See Membership
+        const MembershipView *view = membership.current();
+        const std::vector<uint32_t> &current_active_servers = view->servers;
+        current_epoch = view->epoch;
+        std::pair<int, int> res;
+        std::vector<ChannelPtr> peer_channels;
+        auto round_start = std::chrono::steady_clock::now();
+        std::chrono::steady_clock::time_point wait_start;
+        inv->set_epoch_id(current_epoch);
+        if (replication_streams) {
+            auto round = replication_streams->invalidate(*inv, current_active_servers);
+
+            if (!hermes_val->is_write()) {
+                SPDLOG_LOGGER_DEBUG(logger, "[{}]::Received Invalidate RPC in the middle of write RPC. Aborting write.", get_tid());
+                replication_streams->complete(key, inv->ts());
+                aborted = true;
+                break;
+            }
+            wait_start = std::chrono::steady_clock::now();
+            res = round->wait(wait_start + rtt.messageLossTimeout(current_active_servers));
+            replication_streams->complete(key, inv->ts());
+        }
+        else if (inv_batcher) {
+            auto round = inv_batcher->submit(*inv, current_active_servers);
+
+            if (!hermes_val->is_write()) {
+                SPDLOG_LOGGER_DEBUG(logger, "[{}]::Received Invalidate RPC in the middle of write RPC. Aborting write.", get_tid());
+                aborted = true;
+                break;
+            }
+            wait_start = std::chrono::steady_clock::now();
+            res = round->wait(wait_start + rtt.messageLossTimeout(current_active_servers));
         }
+        else {
+            grpc::CompletionQueue broadcast_queue;
+            auto start = std::chrono::steady_clock::now();
+            peer_channels = channel_pool.getChannels(current_active_servers);
+            auto end = std::chrono::steady_clock::now();
+            auto duration = std::chrono::duration_cast<std::chrono::microseconds>(end-start).count();
+            SPDLOG_LOGGER_TRACE (logger, "Took {} us to acquire grpc stubs", duration);
+            uint64_t total_us = stub_acquire_us.fetch_add(duration) + duration;
+            uint64_t count = stub_acquire_count.fetch_add(1) + 1;
+            if (count % 10000 == 0) {
+                SPDLOG_LOGGER_INFO(logger, "Average stub acquisition time over {} rounds: {} us ({} channels per peer)",
+                    count, (double)total_us / count, channel_pool.channelsPerPeer());
+            }
+            broadcast_invalidate(serializeOnce(*inv), key, broadcast_queue, current_active_servers, peer_channels);
+
+            //// To test write replay
+            //if (server_id == 50052) {
+            //    terminate();
+            //    return;
+            //}
+
+            // Check if the write was interrupted by a higher priority write
+            if (!hermes_val->is_write()) {
+                // TODO(): This shouldn't be required. Just return
+                SPDLOG_LOGGER_DEBUG(logger, "[{}]::Received Invalidate RPC in the middle of write RPC. Aborting write.", get_tid());
+                broadcast_queue.Shutdown();
+                aborted = true;
+                break;
+            }
 
-        // Wait till all the acks for the invalidate arrives 
-        auto res = receive_acks(broadcast_queue, key, current_active_servers.size());
+            // Wait till all the acks for the invalidate arrives 
+            wait_start = std::chrono::steady_clock::now();
+            res = receive_acks(broadcast_queue, key, current_active_servers);
+        }
+        if ((replication_streams || inv_batcher) && !current_active_servers.empty()) {
+            // The acks of a batch or stream aren't timed per peer, so the whole round is a
+            // sample of every peer. It includes the batching window, which the MLT has to cover
+            if (res.first == (int)current_active_servers.size()) {
+                auto round_time = std::chrono::steady_clock::now() - round_start;
+                for (uint32_t server: current_active_servers) {
+                    rtt.addSample(server, round_time);
+                }
+            } else {
+                for (uint32_t server: current_active_servers) {
+                    rtt.backoff(server);
+                }
+            }
+        }
+        metrics.ack_wait_ns.record(nanosSince(wait_start));
+        metrics.inv_round_ns.record(nanosSince(round_start));
         int acks = res.first;
         int acceptances = res.second;
     
         //if (acceptances == _stubs.size()) {
         if (acceptances == current_active_servers.size()) {
             SPDLOG_LOGGER_DEBUG(logger, "[{}]::Received all acceptances for key: {}", get_tid(), key);
+            // Commit point of the write on the coordinator
+            if (wal) {
+                wal->waitDurable(wal->append(key, value, write_ts.logical_time, write_ts.node_id));
+            }
             // Value was accepted by all the nodes, we can trasition safely back to valid state
             // and propagate a VAL message to all the nodes. Wait till we get ACKs back (do we need this??)
             // auto thread = std::thread(std::bind(&HermesServiceImpl::broadcast_validate, this, hermes_val->timestamp, key));
@@ -196,7 +620,24 @@ void HermesServiceImpl::performWrite(HermesValue *hermes_val) {
             //     std::unique_lock<std::mutex> server_state_lock {server_state_mutex};
                 
             // }
-            broadcast_validate(hermes_val->timestamp, key, current_active_servers, server_stubs);
+            if (replication_streams) {
+                ValidateRequest req;
+                req.set_key(key);
+                *req.mutable_ts() = hermes_val->getTimestamp().get_grpc_timestamp();
+                replication_streams->validate(req, current_active_servers);
+            }
+            else {
+                if (peer_channels.empty()) {
+                    peer_channels = channel_pool.getChannels(current_active_servers);
+                }
+                // The write is committed, so the VALs don't have to delay the reply. A follower
+                // that misses one replays the write
+                // Records never move, unlike the INV, so the VAL is built from the record's key
+                replication_pool->addTask([this, ts = hermes_val->getTimestamp(), key = hermes_val->key(),
+                        servers = current_active_servers, channels = std::move(peer_channels)] {
+                    broadcast_validate(ts, key, servers, channels);
+                });
+            }
             hermes_val->coord_write_to_valid_transition();
             break;
         }
@@ -205,10 +646,13 @@ void HermesServiceImpl::performWrite(HermesValue *hermes_val) {
             //std::this_thread::sleep_for(std::chrono::seconds(1));
         }
     }
+    metrics.write_retries.record(rounds - 1);
+    return !aborted;
 }
 
 void HermesServiceImpl::performWriteReplay(HermesValue *hermes_val) {
     SPDLOG_LOGGER_TRACE (logger, "[{}]::performing write replay", get_tid());
+    metrics.replays.fetch_add(1, std::memory_order_relaxed);
     hermes_val->fol_replay_to_write_transition();
     performWrite(hermes_val);
 }
@@ -218,107 +662,424 @@ bool HermesServiceImpl::isCoordinator(HermesValue *hermes_val) {
     return hermes_val->getState() == State::WRITE;
 }
 
+void HermesServiceImpl::stallTillValid(HermesValue *hermes_val) {
+    //hermes_val->wait_till_valid();
+    while (true) {
+        if (!hermes_val->wait_till_valid_or_timeout(rtt.replayTimeout())) {
+            SPDLOG_LOGGER_DEBUG (logger, "[{}]::replay timeout expired", get_tid());
+            if (!isCoordinator(hermes_val)) {
+                // replay timeout expired. Start write replay for the invalid key
+                hermes_val->fol_invalid_to_replay_transition();
+                performWriteReplay(hermes_val);
+                break;
+            }
+            else {
+                SPDLOG_LOGGER_DEBUG (logger, "[{}]::current node is the coordinator so cannot start write replay", get_tid());
+            }
+        }
+        else {
+            break;
+        }
+    }
+}
+
+bool HermesServiceImpl::readKey(const std::string &key, std::string *value) {
+    ScopedLatency latency(metrics.read_ns);
+    HermesValue *hermes_val = getValueFromDB(key, key_value_map.hash(key));
+    if (hermes_val == nullptr) {
+        SPDLOG_LOGGER_DEBUG (logger, "[{}]::Read::Key not found!", get_tid());
+        return false;
+    }
+    SPDLOG_LOGGER_DEBUG (logger, "[{}]::Read::Key found!", get_tid());
+    // Fast path, the key is VALID and no write overlapped the copy
+    if (hermes_val->read_if_valid(*value)) {
+        return true;
+    }
+    readAfterStall(hermes_val, value);
+    return true;
+}
+
+void HermesServiceImpl::readAfterStall(HermesValue *hermes_val, std::string *value) {
+    auto stall_start = std::chrono::steady_clock::now();
+    stallTillValid(hermes_val);
+    metrics.read_stall_ns.record(nanosSince(stall_start));
+    // perform the read corresponding to the current request
+    hermes_val->read_value(*value);
+}
+
+void HermesServiceImpl::writeKey(const std::string &key, const std::string &value) {
+    ScopedLatency latency(metrics.write_ns);
+    auto [hermes_val, new_key] = writeNewKey(key, key_value_map.hash(key), value);
+    if (new_key) {
+        SPDLOG_LOGGER_DEBUG (logger, "[{}]::Write::Key not found!", get_tid());
+    }
+    else {
+        SPDLOG_LOGGER_DEBUG (logger, "[{}]::Write::Key found!", get_tid());
+    }
+
+    if (write_combiner) {
+        std::promise<void> committed;
+        auto future = committed.get_future();
+        if (!write_combiner->join(hermes_val, value, [&committed] {committed.set_value();})) {
+            // Another write of the key leads the batch, and writes this value or a later one
+            future.wait();
+            return;
+        }
+    }
+
+    // Stall writes till we are sure that the key is valid. Every writer stalled on the key wakes
+    // up when it becomes VALID, and only the first one to take it out of VALID writes now
+    do {
+        stallTillValid(hermes_val);
+    } while (!writeValid(hermes_val, value));
+}
+
+bool HermesServiceImpl::writeValid(HermesValue *hermes_val, const std::string &value) {
+    TimestampChange change;
+    if (!write_combiner) {
+        if (!hermes_val->coord_valid_to_write_transition(value, server_id, &change)) {
+            return false;
+        }
+        merkleUpdate(hermes_val, change);
+        performWrite(hermes_val);
+        return true;
+    }
+    auto waiters = write_combiner->close(hermes_val, value, [&](const std::string &last_value) {
+        return hermes_val->coord_valid_to_write_transition(last_value, server_id, &change);
+    });
+    if (!waiters) {
+        return false;
+    }
+    merkleUpdate(hermes_val, change);
+    performWrite(hermes_val);
+    metrics.write_batch_size.record(waiters->size() + 1);
+    for (auto& done: *waiters) {
+        done();
+    }
+    return true;
+}
+
+bool HermesServiceImpl::rmwKey(const std::string &key, const RmwUpdate &update) {
+    ScopedLatency latency(metrics.rmw_ns);
+    size_t hash = key_value_map.hash(key);
+    HermesValue *hermes_val = getValueFromDB(key, hash);
+    if (hermes_val == nullptr) {
+        // A missing key reads as empty. It is only created once the update has something to
+        // write, so a failed compare leaves no empty record behind
+        std::string next;
+        if (!update(std::string(), &next)) {
+            return true;
+        }
+        hermes_val = writeNewKey(key, hash, std::string()).first;
+    }
+    for (uint32_t attempt = 0; attempt < MAX_RMW_ATTEMPTS; attempt++) {
+        stallTillValid(hermes_val);
+        bool updated = false;
+        TimestampChange change;
+        bool started = hermes_val->coord_valid_to_rmw_transition([&](const std::string &current, std::string *next) {
+            updated = true;
+            return update(current, next);
+        }, server_id, &change);
+        if (!started) {
+            if (updated) {
+                // Nothing to write, e.g. the compare failed. The key was VALID, so this is a
+                // linearizable read
+                return true;
+            }
+            // Another update of the key started after the stall
+            continue;
+        }
+        merkleUpdate(hermes_val, change);
+        if (performWrite(hermes_val)) {
+            return true;
+        }
+        // An update with a higher timestamp invalidated the key during the round. The value
+        // this update was computed from is overwritten, so retry on the new one
+        SPDLOG_LOGGER_DEBUG(logger, "[{}]::RMW of key {} aborted, retrying", get_tid(), key);
+        metrics.rmw_aborts.fetch_add(1, std::memory_order_relaxed);
+    }
+    return false;
+}
+
 grpc::Status HermesServiceImpl::Read(grpc::ServerContext *ctx, 
         const ReadRequest *req, ReadResponse *resp) {
+    if (joining.load()) {
+        return grpc::Status(grpc::StatusCode::UNAVAILABLE, "server is joining the cluster");
+    }
     if (!dead.load()) {
-        std::string key = req->key();
+        const std::string &key = req->key();
 
-        SPDLOG_LOGGER_INFO(logger, "[{}]::Received Read Request!", get_tid());
+        SPDLOG_LOGGER_DEBUG(logger, "[{}]::Received Read Request!", get_tid());
         SPDLOG_LOGGER_DEBUG(logger, "key: {}", key);
 
-        std::pair<bool, map_iterator> is_present = isKeyPresent(key);
-
-        if (is_present.first) {
-            SPDLOG_LOGGER_DEBUG (logger, "[{}]::Read::Key found!", get_tid());
-            // TODO
-            const auto hermes_val = is_present.second->second.get();
-            //hermes_val->wait_till_valid();
-            while (true) {
-                if (!hermes_val->wait_till_valid_or_timeout(replay_timeout)) {
-                    SPDLOG_LOGGER_DEBUG (logger, "[{}]::Read::replay timeout expired", get_tid());
-                    if (!isCoordinator(hermes_val)) {
-                        // replay timeout expired. Start write replay
-                        hermes_val->fol_invalid_to_replay_transition();
-                        performWriteReplay(hermes_val);
-                        break;
-                    }
-                    else {
-                        SPDLOG_LOGGER_DEBUG (logger, "[{}]::Read::current node is the coordinator so cannot start write replay", get_tid());
-                    }
-                }
-                else {
-                    break;
-                }
-            }
-            // perform the read corresponding to the current request
-            resp->set_value(hermes_val->value);
-            return grpc::Status::OK;
-        }
-        else {
-            SPDLOG_LOGGER_DEBUG (logger, "[{}]::Read::Key not found!", get_tid());
+        if (!readKey(key, resp->mutable_value())) {
             std::string not_found = "Key not found";
             resp->set_value(not_found);
-            return grpc::Status::OK;
         }
+        return grpc::Status::OK;
     }
     return grpc::Status(grpc::StatusCode::UNAVAILABLE, "server is down");
 }
 
 grpc::Status HermesServiceImpl::Write(grpc::ServerContext *ctx, const WriteRequest *req, Empty *resp) {
+    if (joining.load()) {
+        return grpc::Status(grpc::StatusCode::UNAVAILABLE, "server is joining the cluster");
+    }
     if (!dead.load()) {
-        std::string key = req->key();
-        std::string value = req->value();
+        const std::string &key = req->key();
+        const std::string &value = req->value();
 
-        SPDLOG_LOGGER_INFO(logger, "[{}]::Received Write Request!", get_tid());
+        SPDLOG_LOGGER_DEBUG(logger, "[{}]::Received Write Request!", get_tid());
         SPDLOG_LOGGER_DEBUG(logger, "key: {}", key);
         SPDLOG_LOGGER_DEBUG(logger, "value: {}", value);
 
-        HermesValue *hermes_val;
-        std::pair<bool, map_iterator> is_present = isKeyPresent(key);
-        if (is_present.first) {
-            SPDLOG_LOGGER_DEBUG (logger, "[{}]::Write::Key found!", get_tid());
-            hermes_val = is_present.second->second.get();
+        writeKey(key, value);
+        return grpc::Status::OK;
+    }
+    return grpc::Status(grpc::StatusCode::UNAVAILABLE, "server is down");
+}
+
+grpc::Status HermesServiceImpl::MultiRead(grpc::ServerContext *ctx,
+        const MultiReadRequest *req, MultiReadResponse *resp) {
+    if (joining.load()) {
+        return grpc::Status(grpc::StatusCode::UNAVAILABLE, "server is joining the cluster");
+    }
+    if (dead.load()) {
+        return grpc::Status(grpc::StatusCode::UNAVAILABLE, "server is down");
+    }
+    SPDLOG_LOGGER_DEBUG(logger, "[{}]::Received MultiRead Request for {} keys!", get_tid(), req->keys_size());
+    // Keys that are VALID are read without blocking, and a key that is being written only
+    // stalls its own read. The stalled reads run together on the multi write pool, so the
+    // batch waits about as long as the slowest key rather than the sum of the stalls.
+    std::vector<std::pair<HermesValue*, KeyValue*>> stalled;
+    for (auto& key: req->keys()) {
+        KeyValue *kv = resp->add_values();
+        kv->set_key(key);
+        HermesValue *hermes_val = getValueFromDB(key, key_value_map.hash(key));
+        kv->set_found(hermes_val != nullptr);
+        if (hermes_val != nullptr && !hermes_val->read_if_valid(*kv->mutable_value())) {
+            stalled.emplace_back(hermes_val, kv);
         }
-        else {
-            SPDLOG_LOGGER_DEBUG (logger, "[{}]::Write::Key not found!", get_tid());
-            hermes_val = writeNewKey(key, value);
-        }
-
-        // Stall writes till we are sure that the key is valid
-        //hermes_val->wait_till_valid();
-        while(true) {
-            if (!hermes_val->wait_till_valid_or_timeout(replay_timeout)) {
-                SPDLOG_LOGGER_DEBUG (logger, "[{}]::Write::replay timeout expired", get_tid());
-                if (!isCoordinator(hermes_val)) {
-                    // replay timeout expired. Start write replay for the invalid key
-                    hermes_val->fol_invalid_to_replay_transition();
-                    performWriteReplay(hermes_val);
-                    break;
-                }
-                else {
-                    SPDLOG_LOGGER_DEBUG (logger, "[{}]::Write::current node is the coordinator so cannot start write replay", get_tid());
+    }
+    if (stalled.size() == 1) {
+        readAfterStall(stalled[0].first, stalled[0].second->mutable_value());
+    }
+    else if (!stalled.empty()) {
+        std::vector<std::future<void>> done;
+        for (auto& [hermes_val, kv]: stalled) {
+            auto task = std::make_shared<std::packaged_task<void()>>([this, hermes_val = hermes_val, kv = kv] {
+                readAfterStall(hermes_val, kv->mutable_value());
+            });
+            done.push_back(task->get_future());
+            multi_write_pool->addTask([task] {(*task)();});
+        }
+        for (auto& future: done) {
+            future.wait();
+        }
+    }
+    return grpc::Status::OK;
+}
+
+grpc::Status HermesServiceImpl::MultiWrite(grpc::ServerContext *ctx,
+        const MultiWriteRequest *req, MultiWriteResponse *resp) {
+    if (joining.load()) {
+        return grpc::Status(grpc::StatusCode::UNAVAILABLE, "server is joining the cluster");
+    }
+    if (dead.load()) {
+        return grpc::Status(grpc::StatusCode::UNAVAILABLE, "server is down");
+    }
+    SPDLOG_LOGGER_DEBUG(logger, "[{}]::Received MultiWrite Request for {} keys!", get_tid(), req->writes_size());
+
+    // Writes to the same key are applied in request order by the same task, writes to
+    // different keys start their invalidation rounds together on the multi write pool
+    std::vector<std::vector<int>> groups;
+    absl::flat_hash_map<absl::string_view, size_t> group_of_key;
+    for (int i = 0; i < req->writes_size(); i++) {
+        auto [it, inserted] = group_of_key.try_emplace(req->writes(i).key(), groups.size());
+        if (inserted) {
+            groups.emplace_back();
+        }
+        groups[it->second].push_back(i);
+    }
+
+    for (auto& write: req->writes()) {
+        WriteStatus *status = resp->add_statuses();
+        status->set_key(write.key());
+        status->set_ok(false);
+    }
+
+    std::vector<std::future<void>> done;
+    for (auto& group: groups) {
+        auto task = std::make_shared<std::packaged_task<void()>>([this, req, resp, &group] {
+            for (int i: group) {
+                WriteStatus *status = resp->mutable_statuses(i);
+                if (dead.load()) {
+                    status->set_error("server is down");
+                    continue;
                 }
+                writeKey(req->writes(i).key(), req->writes(i).value());
+                status->set_ok(true);
             }
-            else {
-                break;
+        });
+        done.push_back(task->get_future());
+        multi_write_pool->addTask([task] {(*task)();});
+    }
+    for (auto& future: done) {
+        future.wait();
+    }
+    return grpc::Status::OK;
+}
+
+grpc::Status HermesServiceImpl::scanKeys(const ScanRequest &req, const std::function<bool(const ScanResponse&)> &write) {
+    if (!ordered_index) {
+        return grpc::Status(grpc::StatusCode::FAILED_PRECONDITION, "the ordered index is disabled, see --ordered_index");
+    }
+    ScanResponse resp;
+    size_t bytes = 0;
+    uint32_t count = 0;
+    bool ok = true;
+    std::string value;
+    ordered_index->forEachFrom(req.start(), [&](absl::string_view key, HermesValue *hermes_val) {
+        if (req.has_end() && key >= req.end()) {
+            return false;
+        }
+        if (req.limit() > 0 && count == req.limit()) {
+            resp.set_next_start(key.data(), key.size());
+            return false;
+        }
+        size_t hash = key_value_map.hash(key);
+        if (hermes_val == nullptr) {
+            hermes_val = key_value_map.find(key, hash);
+        }
+        SnapshotRecord record;
+        if (hermes_val == nullptr && snapshot && snapshot->find(key, &record) && record.state == VALID) {
+            // Never accessed, so the snapshot has the latest value. Read it in place instead of
+            // loading the key
+            value.assign(record.value.data(), record.value.size());
+        }
+        else {
+            // Reads don't block writers. A key that isn't VALID stalls the scan like a Read
+            if (hermes_val == nullptr) {
+                hermes_val = getValueFromDB(key, hash);
             }
+            if (!hermes_val->read_if_valid(value)) {
+                stallTillValid(hermes_val);
+                hermes_val->read_value(value);
+            }
+        }
+        KeyValue *kv = resp.add_values();
+        kv->set_key(key.data(), key.size());
+        kv->set_found(true);
+        kv->set_value(value);
+        count++;
+        bytes += key.size() + value.size();
+        if (bytes >= SCAN_CHUNK_SIZE) {
+            ok = write(resp);
+            resp.Clear();
+            bytes = 0;
         }
+        return ok;
+    });
+    if (ok && (resp.values_size() > 0 || resp.has_next_start())) {
+        ok = write(resp);
+    }
+    if (!ok) {
+        return grpc::Status(grpc::StatusCode::CANCELLED, "scan cancelled");
+    }
+    return grpc::Status::OK;
+}
 
-        // perform the write corresponding to the current request
-        hermes_val->coord_valid_to_write_transition(value, server_id);
-        performWrite(hermes_val);
+grpc::Status HermesServiceImpl::Scan(grpc::ServerContext *ctx, const ScanRequest *req, grpc::ServerWriter<ScanResponse> *writer) {
+    if (joining.load()) {
+        return grpc::Status(grpc::StatusCode::UNAVAILABLE, "server is joining the cluster");
+    }
+    if (dead.load()) {
+        return grpc::Status(grpc::StatusCode::UNAVAILABLE, "server is down");
+    }
+    SPDLOG_LOGGER_DEBUG(logger, "[{}]::Received Scan Request from {}", get_tid(), req->start());
+    return scanKeys(*req, [writer](const ScanResponse &resp) {return writer->Write(resp);});
+}
 
-        return grpc::Status::OK;
+grpc::Status HermesServiceImpl::CompareAndSwap(grpc::ServerContext *ctx,
+        const CompareAndSwapRequest *req, CompareAndSwapResponse *resp) {
+    if (joining.load()) {
+        return grpc::Status(grpc::StatusCode::UNAVAILABLE, "server is joining the cluster");
     }
-    return grpc::Status(grpc::StatusCode::UNAVAILABLE, "server is down");
+    if (dead.load()) {
+        return grpc::Status(grpc::StatusCode::UNAVAILABLE, "server is down");
+    }
+    SPDLOG_LOGGER_DEBUG(logger, "[{}]::Received CompareAndSwap Request for key {}", get_tid(), req->key());
+    bool ok = rmwKey(req->key(), [&](const std::string &current, std::string *next) {
+        resp->set_value(current);
+        resp->set_swapped(current == req->expected());
+        if (!resp->swapped()) {
+            return false;
+        }
+        *next = req->value();
+        return true;
+    });
+    if (!ok) {
+        return grpc::Status(grpc::StatusCode::ABORTED, "too many concurrent updates of the key");
+    }
+    return grpc::Status::OK;
+}
+
+grpc::Status HermesServiceImpl::FetchAdd(grpc::ServerContext *ctx,
+        const FetchAddRequest *req, FetchAddResponse *resp) {
+    if (joining.load()) {
+        return grpc::Status(grpc::StatusCode::UNAVAILABLE, "server is joining the cluster");
+    }
+    if (dead.load()) {
+        return grpc::Status(grpc::StatusCode::UNAVAILABLE, "server is down");
+    }
+    SPDLOG_LOGGER_DEBUG(logger, "[{}]::Received FetchAdd Request for key {}", get_tid(), req->key());
+    grpc::Status status = grpc::Status::OK;
+    bool ok = rmwKey(req->key(), [&](const std::string &current, std::string *next) {
+        int64_t value = 0;
+        if (!current.empty() && !absl::SimpleAtoi(current, &value)) {
+            status = grpc::Status(grpc::StatusCode::INVALID_ARGUMENT, "value is not an integer");
+            return false;
+        }
+        int64_t sum;
+        if (__builtin_add_overflow(value, req->delta(), &sum)) {
+            status = grpc::Status(grpc::StatusCode::OUT_OF_RANGE, "integer overflow");
+            return false;
+        }
+        resp->set_value(value);
+        *next = std::to_string(sum);
+        return true;
+    });
+    if (!ok) {
+        return grpc::Status(grpc::StatusCode::ABORTED, "too many concurrent updates of the key");
+    }
+    return status;
 }
 
-void HermesServiceImpl::broadcast_invalidate(Timestamp &ts, const std::string &value, std::string &key, 
-        grpc::CompletionQueue &cq, std::vector<uint32_t> &servers,
-        std::vector<std::unique_ptr<Hermes::Stub>> &server_stubs, uint32_t epoch) {   
-    SPDLOG_LOGGER_INFO(logger, "[{}]::Broadcasting INVALIDATE RPCs for key {}", get_tid(), key);
+grpc::Status HermesServiceImpl::Append(grpc::ServerContext *ctx, const AppendRequest *req, Empty *resp) {
+    if (joining.load()) {
+        return grpc::Status(grpc::StatusCode::UNAVAILABLE, "server is joining the cluster");
+    }
+    if (dead.load()) {
+        return grpc::Status(grpc::StatusCode::UNAVAILABLE, "server is down");
+    }
+    SPDLOG_LOGGER_DEBUG(logger, "[{}]::Received Append Request for key {}", get_tid(), req->key());
+    bool ok = rmwKey(req->key(), [&](const std::string &current, std::string *next) {
+        next->reserve(current.size() + req->suffix().size());
+        next->append(current).append(req->suffix());
+        return true;
+    });
+    if (!ok) {
+        return grpc::Status(grpc::StatusCode::ABORTED, "too many concurrent updates of the key");
+    }
+    return grpc::Status::OK;
+}
+
+void HermesServiceImpl::broadcast_invalidate(const grpc::ByteBuffer &inv, const std::string &key,
+        grpc::CompletionQueue &cq, const std::vector<uint32_t> &servers,
+        const std::vector<ChannelPtr> &channels) {
+    SPDLOG_LOGGER_DEBUG(logger, "[{}]::Broadcasting INVALIDATE RPCs for key {}", get_tid(), key);
     //int num_other_servers = _stubs.size();
-    auto deadline = std::chrono::system_clock::now() + std::chrono::seconds(mlt);
+    auto deadline = std::chrono::system_clock::now() + rtt.messageLossTimeout(servers);
 
     grpc::Alarm alarm;
     int alarm_tag = -1;
@@ -327,41 +1088,33 @@ void HermesServiceImpl::broadcast_invalidate(Timestamp &ts, const std::string &v
     //alarm.Set(&cq, deadline, reinterpret_cast<void*>(&alarm_tag));
 
     uint64_t i = 0;
-    HermesTimestamp grpc_ts = ts.get_grpc_timestamp();
-
-    // Get the list of currently active servers in the cluster
-    // std::unordered_set<uint32_t> active_servers = _active_servers.copy();
 
     // Expect acks from all the active servers. If a server goes down, this set is updated in the mayday RPC
     // pending_acks = ThreadSafeUnorderedSet<uint32_t> {active_servers};
 
-    //for (auto& stub: _stubs) {
     for (auto& server: servers) {
         SPDLOG_LOGGER_TRACE(logger, "[{}]::sending invalidate to node_id: {}, for key {} with grpc_tag={}", get_tid(), server, key, i);
-        // Send invalidates
-        InvalidateRequest req;
-        req.set_key(key);
-        req.set_allocated_ts(&grpc_ts);
-        req.set_value(value);
-        req.set_epoch_id(epoch);
+        // Send invalidates. Every call shares the slices of `inv`
         GrpcAsyncCall<InvalidateResponse>* call = new GrpcAsyncCall<InvalidateResponse>(i);
 
-        auto receiver = server_stubs[i]->AsyncInvalidate(&call->ctx, req, &cq);
+        grpc::TemplatedGenericStub<grpc::ByteBuffer, InvalidateResponse> stub(channels[i]);
+        auto receiver = stub.PrepareUnaryCall(&call->ctx, INVALIDATE_METHOD, inv, &cq);
+        receiver->StartCall();
         receiver->Finish(&call->response, &call->status, (void*)call);
-
-        grpc_ts = *(req.release_ts());
         i++;
     }
-    SPDLOG_LOGGER_INFO(logger, "[{}]::Broadcasted Invalidate RPCs", get_tid());
+    SPDLOG_LOGGER_DEBUG(logger, "[{}]::Broadcasted Invalidate RPCs", get_tid());
 }
 
-std::pair<int, int> HermesServiceImpl::receive_acks(grpc::CompletionQueue &cq, std::string key, uint32_t num_servers) {
+std::pair<int, int> HermesServiceImpl::receive_acks(grpc::CompletionQueue &cq, const std::string &key, const std::vector<uint32_t> &servers) {
     int acks_received = 0;
     int acceptances_received = 0;
     int alarm_tag;
     // Don't use the set of servers since it might be modified by a parallel thread and we don't want locks here
     // num_servers = _stubs.size();
     alarm_tag = -1;
+    uint32_t num_servers = servers.size();
+    std::vector<bool> acked(num_servers, false);
     void* next_tag;
     bool ok;
 
@@ -370,9 +1123,18 @@ std::pair<int, int> HermesServiceImpl::receive_acks(grpc::CompletionQueue &cq, s
             GrpcAsyncCall<InvalidateResponse>* grpc_tag = static_cast<GrpcAsyncCall<InvalidateResponse>*>(next_tag);
             if (grpc_tag->tag_value == alarm_tag) {
                 // MLT expired. Return from this function and keep retrying...
-                SPDLOG_LOGGER_INFO(logger, "[{}]::Alarm expired while broadcasting", get_tid());
+                SPDLOG_LOGGER_DEBUG(logger, "[{}]::Alarm expired while broadcasting", get_tid());
+                for (uint32_t i = 0; i < num_servers; i++) {
+                    if (!acked[i]) {
+                        rtt.backoff(servers[i]);
+                    }
+                }
                 break;
             } else {
+                if (grpc_tag->status.ok()) {
+                    acked[grpc_tag->tag_value] = true;
+                    rtt.addSample(servers[grpc_tag->tag_value], std::chrono::steady_clock::now() - grpc_tag->start);
+                }
                 // Get the node_id of the node which sent the ACK and erase that entry from the pending_acks set
                 uint32_t responder = grpc_tag->response.responder();
                 SPDLOG_LOGGER_TRACE(logger, "[{}]::grpc_tag={}::received ACK from {} for key {}", get_tid(), grpc_tag->tag_value, responder, key);
@@ -393,83 +1155,77 @@ std::pair<int, int> HermesServiceImpl::receive_acks(grpc::CompletionQueue &cq, s
         // delete grpc_tag;
     }
     cq.Shutdown();
-    SPDLOG_LOGGER_INFO(logger, "[{}]::Received " + std::to_string(acks_received) + " acks", get_tid());
-    SPDLOG_LOGGER_INFO(logger, "[{}]::Received " + std::to_string(acceptances_received) + " acceptances", get_tid());
+    SPDLOG_LOGGER_DEBUG(logger, "[{}]::Received {} acks", get_tid(), acks_received);
+    SPDLOG_LOGGER_DEBUG(logger, "[{}]::Received {} acceptances", get_tid(), acceptances_received);
     return std::make_pair<>(acks_received, acceptances_received);
 }
 
-void HermesServiceImpl::broadcast_validate(Timestamp ts, std::string key, std::vector<uint32_t> &servers, 
-        std::vector<std::unique_ptr<Hermes::Stub>> &server_stubs) {
+void HermesServiceImpl::broadcast_validate(Timestamp ts, absl::string_view key, const std::vector<uint32_t> &servers,
+        const std::vector<ChannelPtr> &channels) {
     grpc::CompletionQueue cq;
-    SPDLOG_LOGGER_INFO(logger, "[{}]::Broadcasting VALIDATE RPCs", get_tid());
-    //int num_other_servers = _stubs.size();
+    SPDLOG_LOGGER_DEBUG(logger, "[{}]::Broadcasting VALIDATE RPCs", get_tid());
 
-    HermesTimestamp grpc_ts = ts.get_grpc_timestamp();
+    ValidateRequest req;
+    req.set_key(key.data(), key.size());
+    *req.mutable_ts() = ts.get_grpc_timestamp();
+    grpc::ByteBuffer val = serializeOnce(req);
 
-    // Get the list of currently active servers in the cluster
-    // std::unordered_set<uint32_t> active_servers = _active_servers.copy();
-
-    // Expect acks from all the active servers. If a server goes down, this set is updated in the mayday RPC
-    // pending_acks = ThreadSafeUnorderedSet<uint32_t> {active_servers};
-
-    //for (auto& stub: _stubs) {
     uint64_t i = 0;
     for (auto& server: servers) {
-        SPDLOG_LOGGER_TRACE(logger, "[{}]::sending VALIDATE to node_id: {}, for key {}", get_tid(), server, key);
-        // auto& stub = _stubs[server];
-        ValidateRequest req;
-        req.set_key(key);
-        req.set_allocated_ts(&grpc_ts);
+        SPDLOG_LOGGER_TRACE(logger, "[{}]::sending VALIDATE to node_id: {}, for key {}", get_tid(), server, req.key());
         GrpcAsyncCall<Empty>* call = new GrpcAsyncCall<Empty>(i);
 
-        auto receiver = server_stubs[i]->AsyncValidate(&call->ctx, req, &cq);
+        grpc::TemplatedGenericStub<grpc::ByteBuffer, Empty> stub(channels[i]);
+        auto receiver = stub.PrepareUnaryCall(&call->ctx, VALIDATE_METHOD, val, &cq);
+        receiver->StartCall();
         receiver->Finish(&call->response, &call->status, (void*)call);
-
-        grpc_ts = *(req.release_ts());
         i++;
     }
-    SPDLOG_LOGGER_INFO(logger, "[{}]::Broadcasted validate RPCs", get_tid());
+    SPDLOG_LOGGER_DEBUG(logger, "[{}]::Broadcasted validate RPCs", get_tid());
     // Dont wait for responses
     cq.Shutdown();
 }
 
 // Invalidate handling via gRPC
-grpc::Status HermesServiceImpl::Invalidate(grpc::ServerContext *ctx, const InvalidateRequest *req, InvalidateResponse *resp) {
+uint64_t HermesServiceImpl::handle_invalidate(const InvalidateRequest *req, InvalidateResponse *resp) {
+    ScopedLatency latency(metrics.invalidate_ns);
     HermesTimestamp ts = req->ts();
-    SPDLOG_LOGGER_INFO(logger, "[{}]::Received Invalidate RPC from node_id: {} for key {}", get_tid(), Timestamp(ts).node_id, req->key());
+    SPDLOG_LOGGER_DEBUG(logger, "[{}]::Received Invalidate RPC from node_id: {} for key {}", get_tid(), Timestamp(ts).node_id, req->key());
     // Send the node_id so that the receiver knows which node send the ack
     resp->set_responder(server_id);
     
+    uint32_t epoch = membership.current()->epoch;
     if (req->epoch_id() != epoch) {
         // Epoch id doesnt match. Reject request
         SPDLOG_LOGGER_DEBUG(logger, "[{}]::Rejecting invalidate request because received epoch_id {} doesn't match with local epoch id {}", get_tid(), req->epoch_id(), epoch);
         resp->set_accept(false);
-        return grpc::Status::OK;
+        return 0;
     }
-    auto value = req->value();
-    HermesValue* hermes_val {nullptr};
-    bool new_key = false;
-
-    std::pair<bool, map_iterator> is_present = isKeyPresent(req->key());
-    if (is_present.first) {
-        SPDLOG_LOGGER_DEBUG (logger, "[{}]::Invalidate::Key found!", get_tid());
-        hermes_val = is_present.second->second.get();
+    const std::string &value = req->value();
+    // Concurrent invalidates for a new key create a single HermesValue. It starts at timestamp 0,
+    // so whichever of them takes its lock first is accepted and the others are ordered after it
+    auto [hermes_val, new_key] = writeNewKey(req->key(), key_value_map.hash(req->key()), value);
+    if (new_key) {
+        SPDLOG_LOGGER_DEBUG (logger, "[{}]::Invalidate::Key not found!", get_tid());
     }
     else {
-        SPDLOG_LOGGER_DEBUG (logger, "[{}]::Invalidate::Key not found!", get_tid());
-        hermes_val = writeNewKey(req->key(), value);
-        new_key = true;
+        SPDLOG_LOGGER_DEBUG (logger, "[{}]::Invalidate::Key found!", get_tid());
     }
 
     // Reject any key that has lower timestamp
-    if (!new_key && hermes_val->is_lower(ts)) {
+    TimestampChange change;
+    if (!hermes_val->fol_invalidate_if_not_lower(value, ts, &change)) {
         // Timestamp is lower than local timestamp. Reject
         resp->set_accept(false);
-        SPDLOG_LOGGER_DEBUG(logger, "[{}]::Rejecting invalidate request because received timestamp {} is lower than local timestamp {}", get_tid(), Timestamp(ts).toString(), hermes_val->timestamp.toString());
-        return grpc::Status::OK;
+        SPDLOG_LOGGER_DEBUG(logger, "[{}]::Rejecting invalidate request because received timestamp {} is lower than local timestamp {}", get_tid(), Timestamp(ts).toString(), hermes_val->getTimestamp().toString());
+        return 0;
+    }
+    merkleUpdate(hermes_val, change);
+    uint64_t lsn = 0;
+    if (wal) {
+        lsn = wal->append(req->key(), value, ts.local_ts(), ts.node_id());
     }
-    hermes_val->fol_invalidate(value, ts);
-    SPDLOG_LOGGER_INFO(logger, "[{}]::Accepting Invalidate RPC for key {}", get_tid(), req->key());
+    SPDLOG_LOGGER_DEBUG(logger, "[{}]::Accepting Invalidate RPC for key {}", get_tid(), req->key());
     resp->set_accept(true);
 
     // TODO(): Move this code to a different thread
@@ -478,7 +1234,7 @@ grpc::Status HermesServiceImpl::Invalidate(grpc::ServerContext *ctx, const Inval
         // with the correct timestamp. We wait till the state becomes valid since we are 
         // currently in an INVALID state. Once done, we can return the value and the
         // client sees the latest updated value based on the timestamp ordering
-        hermes_val->wait_till_valid_or_timeout(replay_timeout);
+        hermes_val->wait_till_valid_or_timeout(rtt.replayTimeout());
         
         if (!hermes_val->is_valid()) {
             // We did not receive a VAL message from the conflicting write within the timeout
@@ -487,24 +1243,140 @@ grpc::Status HermesServiceImpl::Invalidate(grpc::ServerContext *ctx, const Inval
             hermes_val->fol_invalid_to_replay_transition();
         }
     }
+    return lsn;
+}
+
+void HermesServiceImpl::waitDurable(uint64_t lsn) {
+    if (wal && lsn != 0) {
+        wal->waitDurable(lsn);
+    }
+}
+
+void HermesServiceImpl::whenDurable(uint64_t lsn, std::function<void()> done) {
+    if (wal && lsn != 0) {
+        wal->onDurable(lsn, std::move(done));
+        return;
+    }
+    done();
+}
+
+uint64_t HermesServiceImpl::handle_batch_invalidate(const BatchInvalidateRequest *req, BatchInvalidateResponse *resp) {
+    SPDLOG_LOGGER_DEBUG(logger, "[{}]::Received BatchInvalidate RPC with {} invalidates", get_tid(), req->invalidates_size());
+    // The accepted writes of the batch share one WAL sync
+    uint64_t lsn = 0;
+    for (auto& inv: req->invalidates()) {
+        lsn = std::max(lsn, handle_invalidate(&inv, resp->add_acks()));
+    }
+    return lsn;
+}
+
+ReplicationMessage HermesServiceImpl::handle_replicated_invalidate(const InvalidateRequest &inv, uint64_t *lsn) {
+    InvalidateResponse inv_resp;
+    *lsn = handle_invalidate(&inv, &inv_resp);
+
+    ReplicationMessage reply;
+    auto ack = reply.mutable_ack();
+    ack->set_key(inv.key());
+    *ack->mutable_ts() = inv.ts();
+    ack->set_accept(inv_resp.accept());
+    ack->set_responder(inv_resp.responder());
+    return reply;
+}
+
+grpc::Status HermesServiceImpl::Invalidate(grpc::ServerContext *ctx, const InvalidateRequest *req, InvalidateResponse *resp) {
+    waitDurable(handle_invalidate(req, resp));
+    return grpc::Status::OK;
+}
+
+// Invalidates for several keys from the same coordinator. Each key is accepted or rejected on its own
+grpc::Status HermesServiceImpl::BatchInvalidate(grpc::ServerContext *ctx, const BatchInvalidateRequest *req, BatchInvalidateResponse *resp) {
+    waitDurable(handle_batch_invalidate(req, resp));
     return grpc::Status::OK;
 }
 
 // Called by co-ordinator to validate the current key.
-grpc::Status HermesServiceImpl::Validate(grpc::ServerContext *ctx, const ValidateRequest *req, Empty *resp) {
+void HermesServiceImpl::handle_validate(const ValidateRequest *req) {
+    ScopedLatency latency(metrics.validate_ns);
     auto& ts = req->ts();
-    SPDLOG_LOGGER_INFO(logger, "[{}]::Received validate RPC from node_id: {} for key {}", get_tid(), Timestamp(ts).node_id, req->key());
+    SPDLOG_LOGGER_DEBUG(logger, "[{}]::Received validate RPC from node_id: {} for key {}", get_tid(), Timestamp(ts).node_id, req->key());
     auto& key = req->key();
-    HermesValue* hermes_val = getValueFromDB(req->key())->second.get();
+    HermesValue* hermes_val = getValueFromDB(key, key_value_map.hash(key));
+    if (hermes_val == nullptr) {
+        SPDLOG_LOGGER_CRITICAL(logger, "[{}]::Received validate RPC for unknown key {}", get_tid(), key);
+        return;
+    }
     
-    if (hermes_val->not_equal(ts)) {
+    if (!hermes_val->fol_validate_if_equal(Timestamp(ts))) {
         // Timestamp is not equal to local timestamp, which means a request with higher timestamp must 
         // have been accepted. Ignore
-        SPDLOG_LOGGER_INFO(logger, "[{}]::Rejecting validate RPC from node_id: {} for key {}", get_tid(), Timestamp(ts).node_id, req->key());
-        return grpc::Status::OK;
+        SPDLOG_LOGGER_DEBUG(logger, "[{}]::Rejecting validate RPC from node_id: {} for key {}", get_tid(), Timestamp(ts).node_id, req->key());
+        return;
     }
-    hermes_val->fol_invalid_to_valid_transition();
     SPDLOG_LOGGER_DEBUG(logger, "[{}]::Validated key {} after write", get_tid(), key);
+}
+
+grpc::Status HermesServiceImpl::Validate(grpc::ServerContext *ctx, const ValidateRequest *req, Empty *resp) {
+    handle_validate(req);
+    return grpc::Status::OK;
+}
+
+// Follower side of a replication stream opened by a coordinator. INVs are acked on the same stream
+grpc::Status HermesServiceImpl::Replicate(grpc::ServerContext *ctx,
+        grpc::ServerReaderWriter<ReplicationMessage, ReplicationMessage> *stream) {
+    SPDLOG_LOGGER_INFO(logger, "[{}]::Replication stream opened by {}", get_tid(), ctx->peer());
+    // The acks are sent by a second thread once the writes are durable. Reading goes on in the
+    // meantime, so the INVs of a burst are acked after a single WAL sync
+    std::mutex ack_mutex;
+    std::condition_variable ack_cv;
+    std::vector<ReplicationMessage> acks;
+    uint64_t acks_lsn = 0;
+    bool reads_done = false;
+    std::thread acker([&] {
+        std::unique_lock<std::mutex> lock(ack_mutex);
+        while (true) {
+            ack_cv.wait(lock, [&] {return reads_done || !acks.empty();});
+            if (acks.empty()) {
+                return;
+            }
+            std::vector<ReplicationMessage> batch;
+            batch.swap(acks);
+            uint64_t lsn = acks_lsn;
+            lock.unlock();
+            waitDurable(lsn);
+            for (auto& reply: batch) {
+                if (!stream->Write(reply)) {
+                    // Ends the reads too
+                    ctx->TryCancel();
+                    break;
+                }
+            }
+            lock.lock();
+        }
+    });
+
+    ReplicationMessage msg;
+    while (stream->Read(&msg)) {
+        if (msg.has_inv()) {
+            uint64_t lsn;
+            ReplicationMessage reply = handle_replicated_invalidate(msg.inv(), &lsn);
+            {
+                std::unique_lock<std::mutex> lock(ack_mutex);
+                acks.push_back(std::move(reply));
+                acks_lsn = std::max(acks_lsn, lsn);
+            }
+            ack_cv.notify_one();
+        }
+        else if (msg.has_val()) {
+            handle_validate(&msg.val());
+        }
+    }
+    {
+        std::unique_lock<std::mutex> lock(ack_mutex);
+        reads_done = true;
+    }
+    ack_cv.notify_one();
+    acker.join();
+    SPDLOG_LOGGER_INFO(logger, "[{}]::Replication stream from {} closed", get_tid(), ctx->peer());
     return grpc::Status::OK;
 }
 
@@ -512,21 +1384,429 @@ grpc::Status HermesServiceImpl::Validate(grpc::ServerContext *ctx, const Validat
 grpc::Status HermesServiceImpl::Mayday(grpc::ServerContext *ctx, const MaydayRequest *req, Empty *resp) {
     uint32_t failing_node = req->node_id();
     SPDLOG_LOGGER_CRITICAL(logger, "[{}]::node_id {} failed", get_tid(), failing_node);
-    // _active_servers.erase(failing_node);
     // This server will not receive an ACK, if it was expecting one, from the failing node.
-    // pending_acks.erase(failing_node);
-    {
-        std::unique_lock<std::shared_mutex> server_state_lock {server_state_mutex};
-        SPDLOG_LOGGER_DEBUG(logger, "[{}]::lock acquired to modify membership list", get_tid());
-        for (auto it = _active_servers.begin(); it!= _active_servers.end(); it++) {
-            if (*it == failing_node) {
-                SPDLOG_LOGGER_DEBUG(logger, "[{}]::removing failed node_id {}", get_tid(), *it);
-                _active_servers.erase(it);
-                break;
+    std::vector<uint32_t> servers;
+    for (auto server: membership.current()->servers) {
+        if (server != failing_node) {
+            servers.push_back(server);
+        }
+    }
+    installMembership(req->epoch_id(), std::move(servers), {});
+    return grpc::Status::OK;
+}
+
+bool HermesServiceImpl::installMembership(uint32_t epoch, std::vector<uint32_t> servers,
+        const std::unordered_map<uint32_t, std::string> &addrs) {
+    uint32_t old_epoch = 0;
+    auto view = membership.update([&](const MembershipView &current) -> std::unique_ptr<MembershipView> {
+        // The master's view wins over one derived from a Mayday of the same epoch
+        if (epoch < current.epoch || (epoch == current.epoch && servers == current.servers)) {
+            return nullptr;
+        }
+        old_epoch = current.epoch;
+        // Writes still on the old view may pick a dropped peer, the pool creates a stub for it
+        for (auto& [server, addr]: addrs) {
+            if (!current.contains(server)) {
+                channel_pool.addPeer(server, addr);
+            }
+        }
+        // Drop the channels to the failed nodes and reconnect any broken ones for the new epoch
+        channel_pool.refresh(servers);
+        auto next = std::make_unique<MembershipView>();
+        next->epoch = epoch;
+        next->servers = std::move(servers);
+        return next;
+    });
+    if (!view) {
+        return false;
+    }
+    SPDLOG_LOGGER_INFO(logger, "[{}]::old epoch is {}, new epoch is {} with {} peers", get_tid(), old_epoch, view->epoch, view->servers.size());
+    if (replication_streams) {
+        // Streams are re-established in the new epoch
+        replication_streams->reset();
+    }
+    return true;
+}
+
+void HermesServiceImpl::startMembershipWatch() {
+    if (!master_addr.empty()) {
+        watch_thread = std::thread(&HermesServiceImpl::watchMembership, this);
+    }
+}
+
+void HermesServiceImpl::watchMembership() {
+    auto master = HermesMaster::NewStub(grpc::CreateChannel(master_addr, grpc::InsecureChannelCredentials()));
+    auto backoff = std::chrono::milliseconds(100);
+    while (true) {
+        grpc::ClientContext ctx;
+        {
+            std::unique_lock<std::mutex> lock(watch_mutex);
+            if (stop_watch) {
+                return;
+            }
+            watch_ctx = &ctx;
+        }
+        WatchMembershipRequest req;
+        req.set_node_id(server_id);
+        auto reader = master->WatchMembership(&ctx, req);
+        MembershipUpdate update;
+        while (reader->Read(&update)) {
+            std::vector<uint32_t> servers;
+            std::unordered_map<uint32_t, std::string> addrs;
+            for (auto& replica: update.servers()) {
+                if (replica.node_id() != server_id) {
+                    servers.push_back(replica.node_id());
+                    addrs[replica.node_id()] = replica.addr();
+                }
+            }
+            installMembership(update.epoch_id(), std::move(servers), addrs);
+            backoff = std::chrono::milliseconds(100);
+
+            // Lets a Join waiting on this node go ahead
+            AckMembershipRequest ack;
+            ack.set_node_id(server_id);
+            ack.set_epoch_id(membership.current()->epoch);
+            Empty ack_resp;
+            grpc::ClientContext ack_ctx;
+            ack_ctx.set_deadline(std::chrono::system_clock::now() + std::chrono::seconds(1));
+            master->AckMembership(&ack_ctx, ack, &ack_resp);
+        }
+        grpc::Status status = reader->Finish();
+        std::unique_lock<std::mutex> lock(watch_mutex);
+        watch_ctx = nullptr;
+        if (stop_watch) {
+            return;
+        }
+        SPDLOG_LOGGER_WARN(logger, "Membership watch on the master at {} ended: {}. Retrying in {} ms",
+            master_addr, status.error_message(), backoff.count());
+        watch_cv.wait_for(lock, backoff, [this] {return stop_watch;});
+        backoff = std::min(2 * backoff, std::chrono::milliseconds(5000));
+    }
+}
+
+bool HermesServiceImpl::join(const std::string &master_addr) {
+    SPDLOG_LOGGER_INFO(logger, "Joining the cluster through the master at {}", master_addr);
+    // State loaded from db_dir, before INVs of the new epoch start creating keys
+    bool has_state = snapshot || key_value_map.size() > 0;
+    auto master = HermesMaster::NewStub(grpc::CreateChannel(master_addr, grpc::InsecureChannelCredentials()));
+    JoinRequest req;
+    req.set_node_id(server_id);
+    req.set_addr(self_addr);
+    JoinResponse resp;
+    grpc::ClientContext ctx;
+    grpc::Status status = master->Join(&ctx, req, &resp);
+    if (!status.ok()) {
+        SPDLOG_LOGGER_CRITICAL(logger, "Join failed: {}", status.error_message());
+        return false;
+    }
+
+    // INVs of the new epoch that arrived before this point were rejected, their coordinators retry them
+    std::vector<std::string> donors;
+    std::vector<uint32_t> servers;
+    std::unordered_map<uint32_t, std::string> addrs;
+    for (auto server: resp.servers()) {
+        if (server == self_addr) continue;
+        uint32_t other_id = addrToID(server);
+        SPDLOG_LOGGER_INFO(logger, "Adding {} to active list", other_id);
+        servers.push_back(other_id);
+        addrs[other_id] = server;
+        // The other replicas are fallbacks for the donor picked by the master
+        if (server == resp.donor()) {
+            donors.insert(donors.begin(), server);
+        }
+        else {
+            donors.push_back(server);
+        }
+    }
+    installMembership(resp.epoch_id(), std::move(servers), addrs);
+
+    bool copied = donors.empty();
+    for (auto& donor: donors) {
+        if ((has_state && resyncState(donor)) || pullState(donor)) {
+            copied = true;
+            break;
+        }
+    }
+    if (!copied) {
+        SPDLOG_LOGGER_CRITICAL(logger, "Failed to copy the key space from any replica");
+        return false;
+    }
+    joining.store(false);
+    SPDLOG_LOGGER_INFO(logger, "Joined the cluster in epoch {}", resp.epoch_id());
+    startMembershipWatch();
+    return true;
+}
+
+bool HermesServiceImpl::pullState(const std::string &donor, const std::vector<std::string> &keys) {
+    if (keys.empty()) {
+        SPDLOG_LOGGER_INFO(logger, "Copying the key space from {}", donor);
+    }
+    auto start = std::chrono::steady_clock::now();
+    auto stub = Hermes::NewStub(grpc::CreateChannel(donor, grpc::InsecureChannelCredentials()));
+    TransferRequest req;
+    req.set_node_id(server_id);
+    for (auto& key: keys) {
+        req.add_keys(key);
+    }
+    grpc::ClientContext ctx;
+    auto reader = stub->TransferState(&ctx, req);
+
+    Data data;
+    uint64_t records = 0;
+    uint64_t bytes = 0;
+    uint64_t lsn = 0;
+    bool intact = true;
+    while (intact && reader->Read(&data)) {
+        bytes += data.chunk().size();
+        intact = parseTransferChunk(data.chunk(), [&](const SnapshotRecord &record) {
+            lsn = std::max(lsn, applyTransferRecord(record));
+            records++;
+        });
+    }
+    if (!intact) {
+        ctx.TryCancel();
+    }
+    grpc::Status status = reader->Finish();
+    waitDurable(lsn);
+    if (!intact || !status.ok()) {
+        SPDLOG_LOGGER_CRITICAL(logger, "State transfer from {} failed after {} records: {}", donor, records,
+            intact ? status.error_message() : "malformed chunk");
+        return false;
+    }
+    auto duration = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
+    SPDLOG_LOGGER_INFO(logger, "Copied {} records ({} bytes) from {} in {} ms", records, bytes, donor, duration);
+    return true;
+}
+
+uint64_t HermesServiceImpl::applyTransferRecord(const SnapshotRecord &record) {
+    Timestamp ts;
+    ts.logical_time = record.logical_time;
+    ts.node_id = record.node_id;
+    State st = static_cast<State>(record.state);
+    std::string value(record.value);
+    size_t hash = key_value_map.hash(record.key);
+
+    HermesValue *hermes_val = getValueFromDB(record.key, hash);
+    bool inserted = false;
+    if (hermes_val == nullptr) {
+        Timestamp initial_ts;
+        std::tie(hermes_val, inserted) = key_value_map.findOrInsert(record.key, hash, [&] {
+            auto created = HermesValue::create(record.key, value, ts, st);
+            initial_ts = created->getTimestamp();
+            return created;
+        });
+        if (inserted) {
+            indexAdd(hermes_val);
+            merkleAdd(hermes_val, initial_ts, false);
+        }
+    }
+    // A key written since the joining node entered the epoch is already newer than the copy
+    if (!inserted) {
+        TimestampChange change;
+        if (!hermes_val->fol_install_if_newer(value, ts, st, &change)) {
+            return 0;
+        }
+        merkleUpdate(hermes_val, change);
+    }
+    if (wal) {
+        return wal->append(record.key, value, ts.logical_time, ts.node_id);
+    }
+    return 0;
+}
+
+bool HermesServiceImpl::streamState(const TransferRequest &req, const std::function<bool(const Data&)> &write) {
+    uint32_t node_id = req.node_id();
+    auto start = std::chrono::steady_clock::now();
+    Data data;
+    std::string &chunk = *data.mutable_chunk();
+    uint64_t records = 0;
+    uint64_t bytes = 0;
+    bool ok = true;
+    auto add = [&](const SnapshotRecord &record) {
+        appendTransferRecord(chunk, record);
+        records++;
+        if (chunk.size() >= TRANSFER_CHUNK_SIZE) {
+            transfer_limiter.acquire(chunk.size());
+            bytes += chunk.size();
+            ok = write(data);
+            chunk.clear();
+        }
+    };
+
+    std::string value;
+    // Keys picked by an anti-entropy resync
+    for (int i = 0; i < req.keys_size() && ok; i++) {
+        HermesValue *hermes_val = getValueFromDB(req.keys(i), key_value_map.hash(req.keys(i)));
+        if (hermes_val != nullptr) {
+            Timestamp ts;
+            State st;
+            hermes_val->read_all(value, ts, st);
+            add(SnapshotRecord {hermes_val->key(), value, ts.logical_time, ts.node_id, static_cast<uint8_t>(st)});
+        }
+    }
+
+    // Keys of the loaded snapshot that were never accessed go first. One that is accessed
+    // meanwhile is sent again from key_value_map below, the newer copy wins on the receiver.
+    if (snapshot && req.keys_size() == 0) {
+        for (uint64_t i = 0; i < snapshot->size() && ok; i++) {
+            SnapshotRecord record = snapshot->at(i);
+            if (key_value_map.find(record.key, key_value_map.hash(record.key)) == nullptr) {
+                add(record);
+            }
+        }
+    }
+    // Like takeSnapshot, shard locks are only held to collect the pointers
+    std::vector<HermesValue*> hermes_vals;
+    if (req.keys_size() == 0) {
+        hermes_vals.reserve(key_value_map.size());
+        key_value_map.forEach([&](absl::string_view key, HermesValue *hermes_val) {
+            hermes_vals.push_back(hermes_val);
+        });
+    }
+    for (size_t i = 0; i < hermes_vals.size() && ok; i++) {
+        Timestamp ts;
+        State st;
+        hermes_vals[i]->read_all(value, ts, st);
+        add(SnapshotRecord {hermes_vals[i]->key(), value, ts.logical_time, ts.node_id, static_cast<uint8_t>(st)});
+    }
+    if (ok && !chunk.empty()) {
+        transfer_limiter.acquire(chunk.size());
+        bytes += chunk.size();
+        ok = write(data);
+    }
+
+    auto duration = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
+    if (!ok) {
+        SPDLOG_LOGGER_CRITICAL(logger, "State transfer to node_id {} aborted after {} records", node_id, records);
+        return false;
+    }
+    SPDLOG_LOGGER_INFO(logger, "Streamed {} records ({} bytes) to node_id {} in {} ms", records, bytes, node_id, duration);
+    return true;
+}
+
+bool HermesServiceImpl::resyncState(const std::string &donor) {
+    // The local tree must have the snapshot keys too
+    while (!merkle_ready.load()) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    SPDLOG_LOGGER_INFO(logger, "Comparing Merkle trees with {}", donor);
+    auto start = std::chrono::steady_clock::now();
+    auto stub = Hermes::NewStub(grpc::CreateChannel(donor, grpc::InsecureChannelCredentials()));
+
+    // Walk down the subtrees that differ, one round trip per level
+    std::vector<uint32_t> differing;
+    for (uint32_t level = 0; level <= Merkle::DEPTH; level++) {
+        std::vector<uint32_t> candidates;
+        if (level == 0) {
+            candidates.push_back(0);
+        }
+        for (uint32_t parent: differing) {
+            for (uint32_t child = 0; child < (1u << Merkle::FANOUT_BITS); child++) {
+                candidates.push_back((parent << Merkle::FANOUT_BITS) | child);
+            }
+        }
+        MerkleNodesRequest req;
+        req.set_level(level);
+        for (uint32_t index: candidates) {
+            req.add_indices(index);
+        }
+        MerkleNodesResponse resp;
+        grpc::ClientContext ctx;
+        grpc::Status status = stub->MerkleNodes(&ctx, req, &resp);
+        if (!status.ok() || resp.hashes_size() != static_cast<int>(candidates.size())) {
+            SPDLOG_LOGGER_WARN(logger, "Failed to get Merkle nodes from {}: {}", donor, status.error_message());
+            return false;
+        }
+        differing.clear();
+        for (size_t i = 0; i < candidates.size(); i++) {
+            if (resp.hashes(i) != merkle_tree.node(level, candidates[i])) {
+                differing.push_back(candidates[i]);
+            }
+        }
+        if (differing.empty()) {
+            break;
+        }
+    }
+    // Past this point comparing the keys costs about as much as copying them
+    if (differing.size() > Merkle::NUM_LEAVES / 8) {
+        SPDLOG_LOGGER_INFO(logger, "{} of {} Merkle leaves differ from {}, copying the whole key space",
+            differing.size(), Merkle::NUM_LEAVES, donor);
+        return false;
+    }
+
+    // Keys of the differing leaves that the donor has a newer write of
+    std::vector<std::string> behind;
+    uint64_t compared = 0;
+    for (size_t i = 0; i < differing.size(); i += MERKLE_LEAVES_PER_REQUEST) {
+        MerkleLeavesRequest req;
+        for (size_t j = i; j < std::min(differing.size(), i + MERKLE_LEAVES_PER_REQUEST); j++) {
+            req.add_leaves(differing[j]);
+        }
+        MerkleLeavesResponse resp;
+        grpc::ClientContext ctx;
+        grpc::Status status = stub->MerkleLeaves(&ctx, req, &resp);
+        if (!status.ok()) {
+            SPDLOG_LOGGER_WARN(logger, "Failed to get Merkle leaves from {}: {}", donor, status.error_message());
+            return false;
+        }
+        for (auto& key_ts: resp.keys()) {
+            compared++;
+            HermesValue *hermes_val = getValueFromDB(key_ts.key(), key_value_map.hash(key_ts.key()));
+            if (hermes_val == nullptr || (!hermes_val->is_lower(key_ts.ts()) && hermes_val->not_equal(key_ts.ts()))) {
+                behind.push_back(key_ts.key());
             }
         }
-        SPDLOG_LOGGER_DEBUG(logger, "[{}]::old epoch is {}, new epoch is {}", get_tid(), epoch, req->epoch_id());
-        epoch = req->epoch_id();
+    }
+    for (size_t i = 0; i < behind.size(); i += TRANSFER_KEYS_PER_REQUEST) {
+        std::vector<std::string> keys(behind.begin() + i, behind.begin() + std::min(behind.size(), i + TRANSFER_KEYS_PER_REQUEST));
+        if (!pullState(donor, keys)) {
+            return false;
+        }
+    }
+    auto duration = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
+    SPDLOG_LOGGER_INFO(logger, "Resynced with {}: {} Merkle leaves differed, compared {} keys, copied {} in {} ms",
+        donor, differing.size(), compared, behind.size(), duration);
+    return true;
+}
+
+grpc::Status HermesServiceImpl::MerkleNodes(grpc::ServerContext *ctx, const MerkleNodesRequest *req, MerkleNodesResponse *resp) {
+    if (!merkle_ready.load()) {
+        return grpc::Status(grpc::StatusCode::UNAVAILABLE, "Merkle tree is being built");
+    }
+    if (req->level() < 0 || req->level() > static_cast<int>(Merkle::DEPTH)) {
+        return grpc::Status(grpc::StatusCode::INVALID_ARGUMENT, "invalid Merkle tree level");
+    }
+    for (uint32_t index: req->indices()) {
+        if (index >= Merkle::numNodes(req->level())) {
+            return grpc::Status(grpc::StatusCode::INVALID_ARGUMENT, "invalid Merkle tree node");
+        }
+        resp->add_hashes(merkle_tree.node(req->level(), index));
+    }
+    return grpc::Status::OK;
+}
+
+grpc::Status HermesServiceImpl::MerkleLeaves(grpc::ServerContext *ctx, const MerkleLeavesRequest *req, MerkleLeavesResponse *resp) {
+    for (uint32_t leaf: req->leaves()) {
+        if (leaf >= Merkle::NUM_LEAVES) {
+            return grpc::Status(grpc::StatusCode::INVALID_ARGUMENT, "invalid Merkle leaf");
+        }
+        forEachInLeaf(leaf, [resp](absl::string_view key, Timestamp ts) {
+            KeyTimestamp *key_ts = resp->add_keys();
+            key_ts->set_key(key.data(), key.size());
+            *key_ts->mutable_ts() = ts.get_grpc_timestamp();
+        });
+    }
+    return grpc::Status::OK;
+}
+
+grpc::Status HermesServiceImpl::TransferState(grpc::ServerContext *ctx, const TransferRequest *req,
+        grpc::ServerWriter<Data> *writer) {
+    SPDLOG_LOGGER_INFO(logger, "[{}]::Streaming the key space to node_id {}", get_tid(), req->node_id());
+    if (joining.load()) {
+        return grpc::Status(grpc::StatusCode::FAILED_PRECONDITION, "server is joining the cluster");
+    }
+    if (!streamState(*req, [writer](const Data &data) {return writer->Write(data);})) {
+        return grpc::Status(grpc::StatusCode::UNAVAILABLE, "state transfer aborted");
     }
     return grpc::Status::OK;
 }
@@ -539,15 +1819,18 @@ void HermesServiceImpl::broadcast_mayday(grpc::CompletionQueue &cq) {
     
     // Get the list of currently active servers in the cluster
     // std::unordered_set<uint32_t> active_servers = _active_servers.copy();
-    std::vector<uint32_t> active_servers(_active_servers.size());
-    std::copy(_active_servers.begin(), _active_servers.end(), active_servers.begin());
+    const MembershipView *view = membership.current();
+    const std::vector<uint32_t> &active_servers = view->servers;
 
     //for (auto& stub: _stubs) {
     for (auto& server: active_servers) {
-        auto& stub = _stubs[server];
+        auto stub = channel_pool.get(server);
+        if (stub == nullptr) {
+            continue;
+        }
         MaydayRequest req;
         req.set_node_id(server_id);
-        req.set_epoch_id(epoch+1);
+        req.set_epoch_id(view->epoch + 1);
         GrpcAsyncCall<Empty>* call = new GrpcAsyncCall<Empty>(i);
 
         auto receiver = stub->AsyncMayday(&call->ctx, req, &cq);
@@ -563,7 +1846,7 @@ void HermesServiceImpl::receive_mayday_acks(grpc::CompletionQueue &cq) {
     int num_servers;
     // Don't use the set of servers since it might be modified by a parallel thread and we don't want locks here
     //num_servers = _stubs.size();
-    num_servers = _active_servers.size();
+    num_servers = membership.current()->servers.size();
     void* next_tag;
     bool ok;
 
@@ -580,7 +1863,7 @@ void HermesServiceImpl::receive_mayday_acks(grpc::CompletionQueue &cq) {
         // delete grpc_tag;
     }
     cq.Shutdown();
-    SPDLOG_LOGGER_INFO(logger, "Received " + std::to_string(acks_received) + " acks");
+    SPDLOG_LOGGER_INFO(logger, "[{}]::Received {} mayday acks", get_tid(), acks_received);
 }
 
 grpc::Status HermesServiceImpl::Terminate(grpc::ServerContext *ctx, const TerminateRequest *req, Empty *resp) {
@@ -606,3 +1889,27 @@ void HermesServiceImpl::terminate(bool graceful) {
 grpc::Status HermesServiceImpl::Heartbeat(grpc::ServerContext *ctx, const Empty *req, Empty *resp) {
     return grpc::Status::OK;
 }
+
+void HermesServiceImpl::fillStats(GetStatsResponse *resp) {
+    metrics.fill(resp);
+    addPoolStats("multi_write_pool", multi_write_pool->stats(), resp);
+    addPoolStats("replication_pool", replication_pool->stats(), resp);
+
+    std::pair<const char*, std::chrono::nanoseconds> timeouts[] = {
+        {"message_loss_timeout_us", rtt.messageLossTimeout(membership.current()->servers)},
+        {"replay_timeout_us", rtt.replayTimeout()},
+    };
+    for (auto& [name, timeout]: timeouts) {
+        CounterStats *counter = resp->add_counters();
+        counter->set_name(name);
+        counter->set_value(std::chrono::duration_cast<std::chrono::microseconds>(timeout).count());
+    }
+}
+
+grpc::Status HermesServiceImpl::GetStats(grpc::ServerContext *ctx, const GetStatsRequest *req, GetStatsResponse *resp) {
+    fillStats(resp);
+    if (req->text()) {
+        resp->set_text(statsText(*resp));
+    }
+    return grpc::Status::OK;
+}
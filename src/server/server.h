@@ -1,8 +1,20 @@
 #pragma once
+// Lowest level compiled in. Set with -DHERMES_LOG_LEVEL=... in cmake
+#ifndef SPDLOG_ACTIVE_LEVEL
 #define SPDLOG_ACTIVE_LEVEL SPDLOG_LEVEL_TRACE
+#endif
 
 #include "hermes.grpc.pb.h"
 #include "state.h"
+#include "channel_pool.h"
+#include "invalidate_batcher.h"
+#include "replication_streams.h"
+#include "wal.h"
+#include "snapshot.h"
+#include "metrics.h"
+#include "rtt_estimator.h"
+#include "membership.h"
+#include "write_combiner.h"
 
 #include <vector>
 #include <shared_mutex>
@@ -12,6 +24,7 @@
 #include <cstdint>
 #include <unordered_map>
 #include <atomic>
+#include <functional>
 #include <grpcpp/grpcpp.h>
 #include <absl/flags/flag.h>
 #include <absl/flags/parse.h>
@@ -20,39 +33,209 @@
 #include "spdlog/include/spdlog/sinks/basic_file_sink.h"
 
 #include "../utils/threadsafe_unordered_set.h"
-
-using map_iterator = typename std::unordered_map<std::string, std::unique_ptr<HermesValue>>::iterator;
+#include "../utils/sharded_key_index.h"
+#include "../utils/concurrent_skiplist.h"
+#include "../utils/rate_limiter.h"
+#include "../utils/merkle_tree.h"
+#include "../thread/threadpool.h"
+
+struct ServerOptions {
+    // Number of pooled channels (HTTP/2 connections) kept open to every peer.
+    // 0 disables the pool and creates new channels on every write.
+    uint32_t channels_per_peer = 1;
+
+    // Window over which INVALIDATEs for different keys are gathered into one
+    // BatchInvalidate RPC per peer. 0 sends one Invalidate RPC per key.
+    uint32_t inv_batch_window_us = 0;
+
+    // Maximum number of writes in a single invalidate batch
+    uint32_t inv_batch_max = 64;
+
+    // Send INV/ACK/VAL over persistent bidi streams instead of unary RPCs.
+    // Invalidate batching only applies to the unary path.
+    bool replication_streams = false;
+
+    // Threads running the per-key writes of MultiWrite requests, i.e. the number of
+    // invalidation rounds a single MultiWrite keeps in flight
+    uint32_t multi_write_threads = 16;
+
+    // Threads sending the VALs of committed writes
+    uint32_t replication_threads = 4;
+
+    // Bounds of the message loss timeout of an invalidation round and of the replay timeout,
+    // which are derived from the measured RTT of the peers. Both start at their upper bound
+    // till the first RTT samples come in
+    uint32_t mlt_min_us = 1000;
+    uint32_t mlt_max_us = 1000000;
+    uint32_t replay_timeout_min_us = 2000;
+    uint32_t replay_timeout_max_us = 1000000;
+
+    // Keep the keys in order in a skip list next to the hash index, for the Scan RPC. Keys of a
+    // loaded snapshot are added on startup
+    bool ordered_index = false;
+
+    // Combine the writes that queue on a key already being written by this node into one
+    // follow-up invalidation round with the last value, see WriteCombiner
+    bool write_coalescing = false;
+
+    // Directory of the write-ahead log, and its durability mode. The log is replayed into
+    // the key-value map on startup
+    std::string db_dir;
+    WalMode wal_mode = WalMode::NONE;
+
+    // Interval between snapshots of the key-value map to db_dir, 0 disables them. A snapshot
+    // found in db_dir on startup is loaded either way.
+    uint32_t snapshot_interval_s = 0;
+
+    // Address of the master. Membership changes are streamed from it, see watchMembership().
+    // Empty when running without a master
+    std::string master_addr;
+
+    // Start outside the cluster and join it through the master, see HermesServiceImpl::join.
+    // The server list of the config is ignored.
+    bool join = false;
+
+    // Rate at which this node streams its key space to a joining node, in MB/s. 0 is unlimited
+    uint32_t transfer_mb_per_s = 32;
+
+    // Runtime log level. Per-request messages are logged at debug and trace, and are compiled
+    // out entirely by building with a higher SPDLOG_ACTIVE_LEVEL
+    std::string log_level = "info";
+
+    // Format log messages on the request threads but write them from a background thread.
+    // Messages are queued in a ring buffer of log_queue_size entries, and the oldest ones are
+    // dropped when it is full instead of blocking requests.
+    bool async_logging = false;
+    uint32_t log_queue_size = 8192;
+};
 
 class HermesServiceImpl: public Hermes::Service {
 private:
+    // The async front end reuses the replication logic of the sync service
+    friend class HermesAsyncServiceImpl;
+    friend class ReplicateReactor;
+
     using InvalidateRespReader = typename std::unique_ptr<grpc::ClientAsyncResponseReader<InvalidateResponse>>;
 
     //std::vector<std::unique_ptr<Hermes::Stub>> active_server_stubs;
-    std::unordered_map<uint32_t, std::unique_ptr<Hermes::Stub>> _stubs;
+    PeerChannelPool channel_pool;
 
-    // ThreadSafeUnorderedSet<uint32_t> _active_servers;
-    //std::vector<std::string> active_servers;
-    std::vector<uint32_t> _active_servers;
-    
-    ThreadSafeUnorderedSet<uint32_t> pending_acks;
+    // Time spent acquiring stubs for the invalidation rounds. Logged periodically so
+    // that the pooled and per-write channel modes can be compared.
+    std::atomic<uint64_t> stub_acquire_us {0};
+    std::atomic<uint64_t> stub_acquire_count {0};
 
-    std::string self_addr;
+    // Keys created on this node. The allocator stats are logged every 100000 keys
+    std::atomic<uint64_t> num_keys {0};
 
-    std::shared_mutex server_state_mutex; // Mutex to lock server stubs and server names
+    // Only created when the WAL is enabled
+    std::unique_ptr<WriteAheadLog> wal;
 
-    std::shared_mutex hashmap_mutex;
+    // Snapshot loaded on startup. Keys are copied from it into key_value_map on first access
+    std::unique_ptr<Snapshot> snapshot;
 
-    std::atomic<bool> dead;
+    std::string snapshot_path;
+
+    std::thread snapshot_thread;
+
+    std::mutex snapshot_mutex;
+
+    std::condition_variable snapshot_cv;
+
+    bool stop_snapshots = false;
+
+    void snapshotLoop(uint32_t interval_s);
+
+    // Writes a snapshot of key_value_map (and of the keys of the loaded snapshot that weren't
+    // accessed) without blocking the request handlers
+    bool takeSnapshot();
+
+    // Set till a node started with --join has copied the key space. Client requests are
+    // refused meanwhile, replication requests are served.
+    std::atomic<bool> joining {false};
+
+    // Shared by all the transfers this node is the donor of
+    RateLimiter transfer_limiter;
+
+    // Copies the key space (or only `keys`) from `donor`. Can be repeated, records older than
+    // the local copy are skipped
+    bool pullState(const std::string &donor, const std::vector<std::string> &keys = {});
+
+    // Copies only the keys this node is behind `donor` on, found by comparing Merkle trees.
+    // Returns false if the trees can't be compared or differ in too many leaves
+    bool resyncState(const std::string &donor);
+
+    // Streams the requested keys in chunks of about 64 KiB, at the transfer rate.
+    // Stops and returns false when `write` fails
+    bool streamState(const TransferRequest &req, const std::function<bool(const Data&)> &write);
+
+    // Applies a record received from a donor. Returns its WAL sequence number (0 if none)
+    uint64_t applyTransferRecord(const SnapshotRecord &record);
 
-    const uint32_t mlt = 1; // Message loss timeout in seconds
+    // Hashes of the keys and timestamps of this node, keyed by Snapshot::hash, for anti-entropy.
+    // Updated on every timestamp change of a key
+    MerkleTree<HermesValue> merkle_tree;
 
-    const uint32_t replay_timeout = 1; // Time to wait before calling replay
+    // Set once the keys of the loaded snapshot are in merkle_tree
+    std::atomic<bool> merkle_ready {false};
+
+    std::thread merkle_thread;
+
+    ServerMetrics metrics;
+
+    void foldSnapshotIntoMerkleTree();
+
+    // Adds a record that was just inserted into key_value_map with timestamp `ts`. A key copied
+    // from the snapshot is already accounted for
+    void merkleAdd(HermesValue *hermes_val, Timestamp ts, bool from_snapshot);
+
+    void merkleUpdate(HermesValue *hermes_val, const TimestampChange &change);
+
+    // Calls fn with the key and timestamp of every key of a Merkle leaf
+    void forEachInLeaf(uint32_t leaf, const std::function<void(absl::string_view, Timestamp)> &fn);
+
+    // Runs the writes of MultiWrite requests concurrently
+    std::unique_ptr<Threadpool> multi_write_pool;
+
+    // Sends the VALs of committed writes, off the request threads
+    std::unique_ptr<Threadpool> replication_pool;
+
+    // Only created when invalidate batching is enabled
+    std::unique_ptr<InvalidateBatcher> inv_batcher;
+
+    // Only created with write coalescing enabled
+    std::unique_ptr<WriteCombiner> write_combiner;
+
+    // Only created in the streaming replication mode
+    std::unique_ptr<ReplicationStreams> replication_streams;
+
+    // Replica set and epoch. Read without locks by the invalidation rounds
+    Membership membership;
+
+    // Address of the master, whose WatchMembership stream pushes the membership changes
+    std::string master_addr;
+    std::thread watch_thread;
+    std::mutex watch_mutex;
+    std::condition_variable watch_cv;
+    grpc::ClientContext *watch_ctx = nullptr;
+    bool stop_watch = false;
+    
+    ThreadSafeUnorderedSet<uint32_t> pending_acks;
+
+    std::string self_addr;
+
+    std::atomic<bool> dead;
 
-    uint32_t epoch;
+    // Message loss and replay timeouts, adapted to the RTT of the peers
+    RttEstimator rtt;
 
     uint32_t server_id;
 
-    std::unordered_map<std::string, std::unique_ptr<HermesValue>> key_value_map;
+    ShardedKeyIndex<HermesValue, HermesValue::Deleter> key_value_map;
+
+    // Keys of key_value_map and of the loaded snapshot in order. Only created with the ordered
+    // index enabled. Keys of the snapshot that weren't accessed yet have no value
+    std::unique_ptr<ConcurrentSkipList<HermesValue>> ordered_index;
 
     std::unordered_map<std::string, bool> is_coord_for_key;
 
@@ -61,59 +244,162 @@ private:
 
     void invalidate_value(HermesValue *val, std::string &key);
 
-    void broadcast_invalidate(Timestamp &ts, const std::string &value, std::string &key, 
-        grpc::CompletionQueue &cq, std::vector<uint32_t> &servers, 
-
-    std::vector<std::unique_ptr<Hermes::Stub>> &server_stubs, uint32_t epoch);
+    // Sends the serialized INV to every server, whose acks are collected by receive_acks
+    void broadcast_invalidate(const grpc::ByteBuffer &inv, const std::string &key,
+        grpc::CompletionQueue &cq, const std::vector<uint32_t> &servers,
+        const std::vector<ChannelPtr> &channels);
 
-    void broadcast_validate(Timestamp ts, std::string key, std::vector<uint32_t> &servers, 
-        std::vector<std::unique_ptr<Hermes::Stub>> &server_stubs);
+    void broadcast_validate(Timestamp ts, absl::string_view key, const std::vector<uint32_t> &servers,
+        const std::vector<ChannelPtr> &channels);
 
     void broadcast_mayday(grpc::CompletionQueue &cq);
 
-    std::pair<int, int> receive_acks(grpc::CompletionQueue &cq, std::string key, uint32_t num_servers);
+    std::pair<int, int> receive_acks(grpc::CompletionQueue &cq, const std::string &key, const std::vector<uint32_t> &servers);
 
     void receive_mayday_acks(grpc::CompletionQueue &cq);
 
+    // Publishes the replica set (without this node) of `epoch`, and follows it with the peer
+    // channels and replication streams. addrs has the addresses of the servers that may be new.
+    // Views older than the current one are ignored. Returns whether the view was installed
+    bool installMembership(uint32_t epoch, std::vector<uint32_t> servers,
+        const std::unordered_map<uint32_t, std::string> &addrs);
+
+    void startMembershipWatch();
+
+    // Applies the views streamed by the master, and reconnects when the stream breaks
+    void watchMembership();
+
     inline uint32_t portToID(uint32_t port);
 
     uint32_t addrToID(std::string& addr);
 
+    // Returns the WAL sequence number of the accepted write (0 if none). The ack must only be
+    // sent after waitDurable() on it.
+    uint64_t handle_invalidate(const InvalidateRequest *req, InvalidateResponse *resp);
+
+    void waitDurable(uint64_t lsn);
+
+    // Calls `done` once the record `lsn` is durable, without blocking. `done` must not block
+    void whenDurable(uint64_t lsn, std::function<void()> done);
+
+    // Returns the WAL sequence number of the last accepted write of the batch (0 if none)
+    uint64_t handle_batch_invalidate(const BatchInvalidateRequest *req, BatchInvalidateResponse *resp);
+
+    // INV received on a replication stream. Returns the ack to send once `lsn` is durable
+    ReplicationMessage handle_replicated_invalidate(const InvalidateRequest &inv, uint64_t *lsn);
+
+    // Applies a write recovered from the WAL
+    void recoverWrite(absl::string_view key, absl::string_view value, uint32_t logical_time, uint32_t node_id);
+
     grpc::Status Invalidate(grpc::ServerContext *ctx, const InvalidateRequest *req, InvalidateResponse *resp) override;
 
+    grpc::Status BatchInvalidate(grpc::ServerContext *ctx, const BatchInvalidateRequest *req, BatchInvalidateResponse *resp) override;
+
+    void handle_validate(const ValidateRequest *req);
+
     grpc::Status Validate(grpc::ServerContext *ctx, const ValidateRequest *req, Empty *resp) override;
 
+    grpc::Status Replicate(grpc::ServerContext *ctx, grpc::ServerReaderWriter<ReplicationMessage, ReplicationMessage> *stream) override;
+
     grpc::Status Mayday(grpc::ServerContext *ctx, const MaydayRequest *req, Empty *resp) override;
 
-    std::string get_tid();
 
-    void performWrite(HermesValue *hermes_val);
+    grpc::Status TransferState(grpc::ServerContext *ctx, const TransferRequest *req, grpc::ServerWriter<Data> *writer) override;
+
+    grpc::Status MerkleNodes(grpc::ServerContext *ctx, const MerkleNodesRequest *req, MerkleNodesResponse *resp) override;
+
+    grpc::Status MerkleLeaves(grpc::ServerContext *ctx, const MerkleLeavesRequest *req, MerkleLeavesResponse *resp) override;
+
+    // Formatted once per thread
+    static const std::string& get_tid();
+
+    // Runs the invalidation rounds of the write (or RMW) the key is in WRITE for. Returns false
+    // if it was aborted by an update with a higher timestamp, which a write is ordered before
+    // but an RMW has to be retried after
+    bool performWrite(HermesValue *hermes_val);
 
     void performRead();
 
     void performWriteReplay(HermesValue *hermes_val);
 
-    std::pair<bool, map_iterator> isKeyPresent(std::string key);
-    
-    map_iterator getValueFromDB(std::string key);
+    // Blocks till the key is VALID, replaying the last write if the replay timeout expires
+    void stallTillValid(HermesValue *hermes_val);
 
-    HermesValue* writeNewKey(std::string key, std::string value);
+    // Writes `value` to a key that was found VALID and returns once it is validated. With write
+    // coalescing, the caller leads a batch and writes its last value, then acks the others.
+    // Returns false without writing if the key isn't VALID anymore, i.e. another write started
+    bool writeValid(HermesValue *hermes_val, const std::string &value);
+
+    // Linearizable read of a key. Returns false if the key is not present
+    bool readKey(const std::string &key, std::string *value);
+
+    // Read of a key that wasn't VALID, once it is
+    void readAfterStall(HermesValue *hermes_val, std::string *value);
+
+    // Linearizable write of a key. Returns once the write is validated
+    void writeKey(const std::string &key, const std::string &value);
+
+    // Computes the new value of a key from its current one, or returns false to leave it as is
+    using RmwUpdate = std::function<bool(const std::string &current, std::string *next)>;
+
+    // Linearizable read-modify-write of a key. `update` is called on the VALID value, under the
+    // lock of the key, and again on the new value after every abort. A missing key is passed as
+    // an empty value. Returns false if the update was aborted MAX_RMW_ATTEMPTS times in a row
+    bool rmwKey(const std::string &key, const RmwUpdate &update);
+
+    static constexpr uint32_t MAX_RMW_ATTEMPTS = 64;
+
+    // Adds a key that was just inserted into key_value_map to the ordered index, if enabled
+    void indexAdd(HermesValue *hermes_val);
+
+    // Streams the keys of a Scan. Stops when `write` fails
+    grpc::Status scanKeys(const ScanRequest &req, const std::function<bool(const ScanResponse&)> &write);
+
+    // Returns nullptr if the key is not present. `hash` is ShardedKeyIndex::hash(key)
+    HermesValue* getValueFromDB(absl::string_view key, size_t hash);
+
+    // Inserts the key if it is not present. Returns the value in the DB and whether it was inserted
+    std::pair<HermesValue*, bool> writeNewKey(absl::string_view key, size_t hash, const std::string &value);
 
     bool isCoordinator(HermesValue *hermes_val);
 
 public:
-    HermesServiceImpl(uint32_t id, std::string &log_dir, const std::vector<std::string> &server_list, uint32_t port, std::atomic<bool>& terminate_flag);
+    HermesServiceImpl(uint32_t id, std::string &log_dir, const std::vector<std::string> &server_list, uint32_t port, std::atomic<bool>& terminate_flag,
+        const ServerOptions &options = ServerOptions());
 
     grpc::Status Read(grpc::ServerContext *ctx, const ReadRequest *req, ReadResponse *resp) override;
 
     grpc::Status Write(grpc::ServerContext *ctx, const WriteRequest *req, Empty *resp) override;
 
+    grpc::Status MultiRead(grpc::ServerContext *ctx, const MultiReadRequest *req, MultiReadResponse *resp) override;
+
+    grpc::Status MultiWrite(grpc::ServerContext *ctx, const MultiWriteRequest *req, MultiWriteResponse *resp) override;
+
+    grpc::Status Scan(grpc::ServerContext *ctx, const ScanRequest *req, grpc::ServerWriter<ScanResponse> *writer) override;
+
+    grpc::Status CompareAndSwap(grpc::ServerContext *ctx, const CompareAndSwapRequest *req, CompareAndSwapResponse *resp) override;
+
+    grpc::Status FetchAdd(grpc::ServerContext *ctx, const FetchAddRequest *req, FetchAddResponse *resp) override;
+
+    grpc::Status Append(grpc::ServerContext *ctx, const AppendRequest *req, Empty *resp) override;
+
     grpc::Status Terminate(grpc::ServerContext *ctx, const TerminateRequest *req, Empty *resp) override;
 
     grpc::Status Heartbeat(grpc::ServerContext *ctx, const Empty *req, Empty *resp) override;
 
+    grpc::Status GetStats(grpc::ServerContext *ctx, const GetStatsRequest *req, GetStatsResponse *resp) override;
+
+    // GetStats without the text format
+    void fillStats(GetStatsResponse *resp);
+
     void terminate(bool graceful = true);
 
+    // Joins the cluster: the master adds this node to every replica in a new epoch, from when
+    // on it receives all new writes, and then the key space written before is copied from a
+    // donor. A node that restarted with its state only copies what it missed (resyncState).
+    // Client requests are served once this returns true.
+    bool join(const std::string &master_addr);
+
     virtual ~HermesServiceImpl();
 };
 
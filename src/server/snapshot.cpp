@@ -0,0 +1,200 @@
+#include "snapshot.h"
+#include "../utils/fs.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+
+namespace {
+
+constexpr char MAGIC[8] = {'H', 'R', 'M', 'S', 'N', 'A', 'P', '1'};
+constexpr uint32_t VERSION = 1;
+
+size_t align8(size_t offset) {
+    return (offset + 7) & ~size_t(7);
+}
+
+bool writeAll(int fd, const char *data, size_t size) {
+    while (size > 0) {
+        ssize_t n = ::write(fd, data, size);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        data += n;
+        size -= n;
+    }
+    return true;
+}
+
+}
+
+uint64_t Snapshot::hash(absl::string_view key) {
+    // FNV-1a
+    uint64_t hash = 14695981039346656037ull;
+    for (char c: key) {
+        hash ^= static_cast<uint8_t>(c);
+        hash *= 1099511628211ull;
+    }
+    return hash;
+}
+
+bool Snapshot::write(const std::string &path, std::vector<SnapshotRecord> &records, std::string *error,
+        const FillRecord &fill) {
+    std::vector<uint64_t> hashes(records.size());
+    std::vector<size_t> order(records.size());
+    for (size_t i = 0; i < records.size(); i++) {
+        hashes[i] = hash(records[i].key);
+        order[i] = i;
+    }
+    std::sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+        if (hashes[a] != hashes[b]) {
+            return hashes[a] < hashes[b];
+        }
+        return records[a].key < records[b].key;
+    });
+
+    std::string tmp_path = path + ".tmp";
+    int fd = ::open(tmp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        *error = "open " + tmp_path + ": " + std::strerror(errno);
+        return false;
+    }
+
+    Header header {};
+    std::memcpy(header.magic, MAGIC, sizeof(MAGIC));
+    header.version = VERSION;
+    header.num_keys = records.size();
+
+    // Data section, buffered in chunks
+    std::vector<Entry> index(records.size());
+    std::string buffer(sizeof(Header), '\0');
+    std::string scratch;
+    uint64_t offset = sizeof(Header);
+    bool ok = true;
+    for (size_t i = 0; i < order.size() && ok; i++) {
+        SnapshotRecord &record = records[order[i]];
+        if (fill) {
+            fill(order[i], record, scratch);
+        }
+        Entry &entry = index[i];
+        entry.hash = hashes[order[i]];
+        entry.offset = offset;
+        entry.key_len = record.key.size();
+        entry.value_len = record.value.size();
+        entry.logical_time = record.logical_time;
+        entry.node_id = record.node_id;
+        entry.state = record.state;
+        entry.reserved = 0;
+        buffer.append(record.key.data(), record.key.size());
+        buffer.append(record.value.data(), record.value.size());
+        offset += record.key.size() + record.value.size();
+        if (buffer.size() >= (4 << 20)) {
+            ok = writeAll(fd, buffer.data(), buffer.size());
+            buffer.clear();
+        }
+    }
+    buffer.append(align8(offset) - offset, '\0');
+    header.index_offset = align8(offset);
+    header.file_size = header.index_offset + index.size() * sizeof(Entry);
+    ok = ok && writeAll(fd, buffer.data(), buffer.size())
+            && writeAll(fd, reinterpret_cast<const char*>(index.data()), index.size() * sizeof(Entry))
+            && ::pwrite(fd, &header, sizeof(header), 0) == sizeof(header)
+            && ::fsync(fd) == 0;
+    if (!ok) {
+        *error = "write " + tmp_path + ": " + std::strerror(errno);
+    }
+    ::close(fd);
+    if (ok && std::rename(tmp_path.c_str(), path.c_str()) != 0) {
+        *error = "rename " + tmp_path + ": " + std::strerror(errno);
+        ok = false;
+    }
+    // The rotated WAL is dropped once this returns, so the rename must survive a crash
+    if (ok && !syncParentDir(path)) {
+        *error = "fsync directory of " + path + ": " + std::strerror(errno);
+        return false;
+    }
+    if (!ok) {
+        ::unlink(tmp_path.c_str());
+    }
+    return ok;
+}
+
+std::unique_ptr<Snapshot> Snapshot::open(const std::string &path, std::string *error) {
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        *error = "open " + path + ": " + std::strerror(errno);
+        return nullptr;
+    }
+    struct stat st;
+    if (::fstat(fd, &st) != 0 || static_cast<size_t>(st.st_size) < sizeof(Header)) {
+        *error = path + " is too small";
+        ::close(fd);
+        return nullptr;
+    }
+    void *data = ::mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+    if (data == MAP_FAILED) {
+        *error = "mmap " + path + ": " + std::strerror(errno);
+        return nullptr;
+    }
+    // Lookups jump around the file, don't read ahead
+    ::madvise(data, st.st_size, MADV_RANDOM);
+
+    std::unique_ptr<Snapshot> snapshot(new Snapshot());
+    snapshot->_data = static_cast<const char*>(data);
+    snapshot->_size = st.st_size;
+    snapshot->_header = reinterpret_cast<const Header*>(data);
+    const Header &header = *snapshot->_header;
+    if (std::memcmp(header.magic, MAGIC, sizeof(MAGIC)) != 0 || header.version != VERSION
+            || header.file_size != snapshot->_size
+            || header.index_offset + header.num_keys * sizeof(Entry) != header.file_size) {
+        *error = path + " is not a valid snapshot";
+        return nullptr;
+    }
+    snapshot->_index = reinterpret_cast<const Entry*>(snapshot->_data + header.index_offset);
+    return snapshot;
+}
+
+Snapshot::~Snapshot() {
+    if (_data != nullptr) {
+        ::munmap(const_cast<char*>(_data), _size);
+    }
+}
+
+SnapshotRecord Snapshot::at(uint64_t i) const {
+    const Entry &entry = _index[i];
+    SnapshotRecord record;
+    record.key = absl::string_view(_data + entry.offset, entry.key_len);
+    record.value = absl::string_view(_data + entry.offset + entry.key_len, entry.value_len);
+    record.logical_time = entry.logical_time;
+    record.node_id = entry.node_id;
+    record.state = entry.state;
+    return record;
+}
+
+uint64_t Snapshot::lowerBound(uint64_t hash) const {
+    const Entry *end = _index + _header->num_keys;
+    return std::lower_bound(_index, end, hash, [](const Entry &entry, uint64_t h) {
+        return entry.hash < h;
+    }) - _index;
+}
+
+bool Snapshot::find(absl::string_view key, SnapshotRecord *record) const {
+    uint64_t h = hash(key);
+    const Entry *end = _index + _header->num_keys;
+    for (const Entry *it = _index + lowerBound(h); it != end && it->hash == h; ++it) {
+        if (absl::string_view(_data + it->offset, it->key_len) == key) {
+            *record = at(it - _index);
+            return true;
+        }
+    }
+    return false;
+}
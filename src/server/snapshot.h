@@ -0,0 +1,94 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <cstdint>
+#include <functional>
+#include <absl/strings/string_view.h>
+
+// One key of a snapshot. Views point into the snapshot file (or into the caller's strings when
+// writing one)
+struct SnapshotRecord {
+    absl::string_view key;
+    absl::string_view value;
+    uint32_t logical_time;
+    uint32_t node_id;
+    uint8_t state;
+};
+
+// Flat, memory-mappable snapshot of the key-value map.
+//
+// Layout (little endian, sections 8 byte aligned):
+//   [Header][key and value bytes of every record][Entry index, sorted by (hash, key)]
+// The index has fixed size entries, so a lookup is a binary search over the mapped file and
+// only touches the pages it needs. Opening a snapshot doesn't read the records at all.
+class Snapshot {
+public:
+    struct Header {
+        char magic[8];
+        uint32_t version;
+        uint32_t reserved;
+        uint64_t num_keys;
+        uint64_t index_offset;
+        uint64_t file_size;
+    };
+
+    struct Entry {
+        uint64_t hash;
+        uint64_t offset; // Of the key, the value follows it
+        uint32_t key_len;
+        uint32_t value_len;
+        uint32_t logical_time;
+        uint16_t node_id;
+        uint8_t state;
+        uint8_t reserved;
+    };
+
+    // Hash of the index. Stable across processes, unlike absl::Hash
+    static uint64_t hash(absl::string_view key);
+
+    // Called on record i right before it is written, to fill in its value, timestamp and state.
+    // The value may point into `scratch`, which is reused for the next record
+    using FillRecord = std::function<void(size_t i, SnapshotRecord &record, std::string &scratch)>;
+
+    // Writes `records` to `path` atomically (through a temporary file and a rename).
+    // The records are sorted by the call, only their keys are needed up front if `fill` is set.
+    // Returns false and sets `error` on failure.
+    static bool write(const std::string &path, std::vector<SnapshotRecord> &records, std::string *error,
+        const FillRecord &fill = nullptr);
+
+    // Maps the snapshot at `path`. Returns nullptr if it doesn't exist or is invalid, with the
+    // reason in `error`
+    static std::unique_ptr<Snapshot> open(const std::string &path, std::string *error);
+
+    ~Snapshot();
+
+    bool find(absl::string_view key, SnapshotRecord *record) const;
+
+    uint64_t size() const {
+        return _header->num_keys;
+    }
+
+    // Record at position i of the index
+    SnapshotRecord at(uint64_t i) const;
+
+    // Index entry i, without touching the record's bytes
+    const Entry& entry(uint64_t i) const {
+        return _index[i];
+    }
+
+    // Position of the first entry whose hash is not below `hash`
+    uint64_t lowerBound(uint64_t hash) const;
+
+private:
+    Snapshot() = default;
+
+    const char *_data = nullptr;
+
+    size_t _size = 0;
+
+    const Header *_header = nullptr;
+
+    const Entry *_index = nullptr;
+};
@@ -1,7 +1,15 @@
 #include "hermes.grpc.pb.h"
-#include <condition_variable>
-#include <mutex>
+#include "../utils/parking_lot.h"
+#include "../utils/slab_allocator.h"
 #include <atomic>
+#include <chrono>
+#include <memory>
+#include <new>
+#include <thread>
+#include <cstddef>
+#include <cstring>
+#include <functional>
+#include <absl/strings/string_view.h>
 
 enum State {
     VALID,
@@ -55,124 +63,534 @@ struct Timestamp {
     }
 };
 
+// Timestamp of a key before and after an update, as stored in the record
+struct TimestampChange {
+    Timestamp from;
+    Timestamp to;
+};
+
+// Allocators of the store. Records and values use separate slabs so that a value slot is only
+// ever reused for another value (see ValueBlock)
+inline SlabAllocator& record_allocator() {
+    static SlabAllocator allocator;
+    return allocator;
+}
 
-struct HermesValue {
-    std::string key;
-    std::string value;
-    std::condition_variable stall_cv;
-    std::mutex stall_mutex;
-    Timestamp timestamp;
-    std::atomic<State> st;
+inline SlabAllocator& value_allocator() {
+    static SlabAllocator allocator;
+    return allocator;
+}
 
-    HermesValue(const std::string &key, const std::string &value, uint32_t node_id) {
-        this->key = key;
-        this->value = value;
-        timestamp.node_id = node_id;
-        timestamp.logical_time = 0;
-        st.store(VALID, std::memory_order_release);
+// Out of line bytes of a value. Only written by the owner of the record's lock bit, but readers
+// of VALID keys copy the bytes without taking any lock (see HermesValue::read_if_valid), so a
+// reader may hold on to a block that was freed and reused by then. That is safe because:
+//  - blocks up to SlabAllocator::MaxClassSize are slab slots. Slab memory stays mapped, and a
+//    value slot is only reused for another value of the same size class, so `capacity` (which
+//    is past the free list link) is the same for every block that lives in the slot.
+//  - larger blocks are never freed while the record is alive. A large value that outgrows its
+//    block moves to one twice the size and the old one is retired.
+struct ValueBlock {
+    ValueBlock *retired; // Only for large blocks
+    uint32_t capacity;
+    char bytes[4];
+
+    static constexpr size_t header() {
+        return offsetof(ValueBlock, bytes);
+    }
+
+    inline bool is_large() const {
+        return header() + capacity > SlabAllocator::MaxClassSize;
+    }
+
+    static ValueBlock* create(size_t min_capacity, ValueBlock *retired) {
+        size_t alloc_size = SlabAllocator::roundUp(header() + min_capacity);
+        if (alloc_size > SlabAllocator::MaxClassSize) {
+            alloc_size = 2 * SlabAllocator::MaxClassSize;
+            while (alloc_size < header() + min_capacity) {
+                alloc_size *= 2;
+            }
+        }
+        ValueBlock *block = new (value_allocator().allocate(alloc_size)) ValueBlock;
+        block->retired = retired;
+        block->capacity = alloc_size - header();
+        return block;
+    }
+
+    // Frees the block and the ones it retired
+    static void destroy(ValueBlock *block) {
+        while (block != nullptr) {
+            ValueBlock *retired = block->retired;
+            value_allocator().deallocate(block, header() + block->capacity);
+            block = retired;
+        }
+    }
+};
+
+// Per-key record. Kept small since the store holds one per key:
+//  - the protocol state, the timestamp and a lock bit are packed in a single atomic word,
+//  - waiters block or park in the global ParkingLot instead of a per-key mutex and condvar,
+//  - the key is stored inline after the record, and is the key of the index too,
+//  - small values are stored inline after the key, larger ones in a ValueBlock,
+//  - the record itself is a slot of record_allocator().
+// The record is variable sized, create it with HermesValue::create().
+class HermesValue {
+private:
+    // Layout of the meta word, from the low bits:
+    // [state 3 | lock 1 | version 12 | node_id 16 | logical_ts 32]
+    // The version is bumped by every update of the word, so that a reader that sees the same
+    // word before and after copying the value knows it wasn't written in between.
+    static constexpr uint64_t STATE_MASK = 0x7;
+    static constexpr uint64_t LOCK_BIT = 0x8;
+    static constexpr int VERSION_SHIFT = 4;
+    static constexpr uint64_t VERSION_MASK = 0xFFFULL << VERSION_SHIFT;
+    static constexpr int NODE_SHIFT = 16;
+    static constexpr int TS_SHIFT = 32;
+
+    // Values up to this size get inline storage when the key is created
+    static constexpr size_t MAX_INLINE_VALUE = 32;
+
+    std::atomic<uint64_t> _meta;
+    std::atomic<ValueBlock*> _value; // nullptr while the value is inline
+    std::atomic<uint32_t> _value_size;
+    uint32_t _key_size;
+    uint16_t _inline_capacity;
+    char _data[2]; // Key followed by the inline value
+
+    static size_t record_size(size_t key_size, size_t inline_capacity) {
+        return offsetof(HermesValue, _data) + key_size + inline_capacity;
+    }
+
+    inline char* inline_value() {
+        return _data + _key_size;
+    }
+
+    static inline State state_of(uint64_t meta) {
+        return static_cast<State>(meta & STATE_MASK);
+    }
+
+    static inline uint64_t bump_version(uint64_t meta) {
+        return (meta & ~VERSION_MASK) | ((meta + (1ULL << VERSION_SHIFT)) & VERSION_MASK);
+    }
+
+    static inline uint64_t with_state(uint64_t meta, State st) {
+        return (meta & ~STATE_MASK) | st;
     }
-    
-    // Helper function that waits till the condition variable is notified
-    void wait_till_valid() {
-        std::unique_lock<std::mutex> lock(stall_mutex);
 
-        // Wait till the key is in VALID state
-        stall_cv.wait(lock, [this] {return is_valid();});
+    static inline uint64_t with_timestamp(uint64_t meta, uint32_t logical_time, uint32_t node_id) {
+        return (meta & ((1ULL << NODE_SHIFT) - 1)) | (static_cast<uint64_t>(node_id & 0xFFFF) << NODE_SHIFT)
+            | (static_cast<uint64_t>(logical_time) << TS_SHIFT);
+    }
+
+    static inline Timestamp timestamp_of(uint64_t meta) {
+        Timestamp ts;
+        ts.logical_time = static_cast<uint32_t>(meta >> TS_SHIFT);
+        ts.node_id = static_cast<uint32_t>((meta >> NODE_SHIFT) & 0xFFFF);
+        return ts;
+    }
+
+    HermesValue(absl::string_view key, size_t inline_capacity, uint32_t node_id) {
+        _key_size = key.size();
+        _inline_capacity = inline_capacity;
+        std::memcpy(_data, key.data(), key.size());
+        _meta.store(with_timestamp(VALID, 0, node_id), std::memory_order_relaxed);
+        _value.store(nullptr, std::memory_order_relaxed);
+        _value_size.store(0, std::memory_order_relaxed);
+    }
+
+    ~HermesValue() {
+        ValueBlock::destroy(_value.load(std::memory_order_relaxed));
+    }
+
+    // Applies update() to the meta word and bumps its version. update() returns false to give up
+    template <typename Update>
+    inline bool update_meta(Update &&update) {
+        uint64_t meta = _meta.load(std::memory_order_acquire);
+        while (true) {
+            uint64_t next = meta;
+            if (!update(next)) {
+                return false;
+            }
+            if (_meta.compare_exchange_weak(meta, bump_version(next))) {
+                return true;
+            }
+        }
+    }
+
+    // CAS from `expected` to `next`
+    inline bool transition(State expected, State next) {
+        return update_meta([&](uint64_t &meta) {
+            if (state_of(meta) != expected) {
+                return false;
+            }
+            meta = with_state(meta, next);
+            return true;
+        });
+    }
+
+    // Serializes the writers of the value
+    inline void lock() {
+        while (!update_meta([](uint64_t &meta) {
+                    if (meta & LOCK_BIT) {
+                        return false;
+                    }
+                    meta |= LOCK_BIT;
+                    return true;
+                })) {
+            std::this_thread::yield();
+        }
+    }
+
+    template <typename Update>
+    inline void unlock(Update &&update) {
+        update_meta([&](uint64_t &meta) {
+            update(meta);
+            meta &= ~LOCK_BIT;
+            return true;
+        });
+    }
+
+    // Must hold the lock. Overwrites reuse the current storage when the value fits in it, unless
+    // the value shrank to less than a quarter of a slab slot
+    void store_value(const std::string &value) {
+        size_t size = value.size();
+        ValueBlock *block = _value.load(std::memory_order_relaxed);
+        if (block == nullptr || !block->is_large()) {
+            if (size <= _inline_capacity) {
+                std::memcpy(inline_value(), value.data(), size);
+                _value_size.store(size, std::memory_order_release);
+                if (block != nullptr) {
+                    _value.store(nullptr, std::memory_order_release);
+                    ValueBlock::destroy(block);
+                }
+                return;
+            }
+        }
+        if (block != nullptr && size <= block->capacity && (block->is_large() || 4 * size > block->capacity)) {
+            std::memcpy(block->bytes, value.data(), size);
+            _value_size.store(size, std::memory_order_release);
+            return;
+        }
+        // Large blocks are retired, slab slots freed once the new block is published
+        ValueBlock *retired = (block != nullptr && block->is_large()) ? block : nullptr;
+        ValueBlock *new_block = ValueBlock::create(size, retired);
+        std::memcpy(new_block->bytes, value.data(), size);
+        _value_size.store(size, std::memory_order_release);
+        _value.store(new_block, std::memory_order_release);
+        if (block != nullptr && retired == nullptr) {
+            ValueBlock::destroy(block);
+        }
+    }
+
+    // Copies the bytes without synchronizing with store_value(). The copy may be torn if a
+    // write is in progress, the caller has to validate it.
+    void racy_copy(std::string &out) {
+        ValueBlock *block = _value.load(std::memory_order_acquire);
+        size_t size = _value_size.load(std::memory_order_acquire);
+        if (block == nullptr) {
+            out.assign(inline_value(), std::min<size_t>(size, _inline_capacity));
+        }
+        else {
+            out.assign(block->bytes, std::min<size_t>(size, block->capacity));
+        }
     }
-    
+
+    void notify_valid() {
+        ParkingLot::global().unpark_all(this);
+    }
+
+public:
+    struct Deleter {
+        void operator()(HermesValue *hermes_val) const {
+            size_t size = record_size(hermes_val->_key_size, hermes_val->_inline_capacity);
+            hermes_val->~HermesValue();
+            record_allocator().deallocate(hermes_val, size);
+        }
+    };
+
+    using Ptr = std::unique_ptr<HermesValue, Deleter>;
+
+    static Ptr create(absl::string_view key, const std::string &value, uint32_t node_id) {
+        // Pad the inline value up to the size class, the slot has room for it anyway
+        size_t inline_capacity = 0;
+        if (value.size() <= MAX_INLINE_VALUE) {
+            size_t size = SlabAllocator::roundUp(record_size(key.size(), value.size()));
+            inline_capacity = std::min(size - record_size(key.size(), 0), MAX_INLINE_VALUE);
+        }
+        void *mem = record_allocator().allocate(record_size(key.size(), inline_capacity));
+        Ptr hermes_val(new (mem) HermesValue(key, inline_capacity, node_id));
+        hermes_val->store_value(value);
+        return hermes_val;
+    }
+
+    // Record restored from a snapshot or another replica. Keys that weren't VALID come back
+    // INVALID, so that they get replayed before they are served
+    static Ptr create(absl::string_view key, const std::string &value, Timestamp ts, State st) {
+        Ptr hermes_val = create(key, value, ts.node_id);
+        hermes_val->_meta.store(with_timestamp(st == VALID ? VALID : INVALID, ts.logical_time, ts.node_id),
+            std::memory_order_release);
+        return hermes_val;
+    }
+
+    // Consistent copy of the value with its timestamp and state, without blocking writers
+    void read_all(std::string &value, Timestamp &ts, State &st) {
+        while (true) {
+            uint64_t before = _meta.load(std::memory_order_acquire);
+            if (!(before & LOCK_BIT)) {
+                racy_copy(value);
+                std::atomic_thread_fence(std::memory_order_acquire);
+                if (_meta.load(std::memory_order_relaxed) == before) {
+                    ts = timestamp_of(before);
+                    st = state_of(before);
+                    return;
+                }
+            }
+            std::this_thread::yield();
+        }
+    }
+
+    // Bytes used by the record and its value blocks, rounded up to the size classes
+    size_t footprint() const {
+        size_t bytes = SlabAllocator::roundUp(record_size(_key_size, _inline_capacity));
+        for (ValueBlock *block = _value.load(std::memory_order_relaxed); block != nullptr; block = block->retired) {
+            bytes += ValueBlock::header() + block->capacity;
+        }
+        return bytes;
+    }
+
+    inline absl::string_view key() const {
+        return absl::string_view(_data, _key_size);
+    }
+
+    // Optimistic read of a VALID key without taking any lock. Returns false if the key isn't
+    // VALID or was written during the copy, in which case the caller takes the slow path.
+    bool read_if_valid(std::string &out) {
+        uint64_t before = _meta.load(std::memory_order_acquire);
+        if (state_of(before) != VALID || (before & LOCK_BIT)) {
+            return false;
+        }
+        racy_copy(out);
+        std::atomic_thread_fence(std::memory_order_acquire);
+        return _meta.load(std::memory_order_relaxed) == before;
+    }
+
+    // Copy of the value that is consistent with concurrent writes
+    void read_value(std::string &out) {
+        if (read_if_valid(out)) {
+            return;
+        }
+        lock();
+        racy_copy(out);
+        unlock([](uint64_t &meta) {});
+    }
+
+    std::string get_value() {
+        std::string out;
+        read_value(out);
+        return out;
+    }
+
+    // Helper function that blocks till the key is VALID
+    void wait_till_valid() {
+        ParkingLot::global().wait(this, [this] {return is_valid();});
+    }
+
     std::string state_to_string() {
-        State curr_state = st.load(std::memory_order_acquire);
+        State curr_state = getState();
         if (curr_state == VALID)
             return "VALID";
-        else if (curr_state == WRITE)   
+        else if (curr_state == WRITE)
             return "WRITE";
         else if (curr_state == INVALID)
             return "INVALID";
         return "REPLAY";
     }
 
-    // Helper function that waits till the condition variable is notified with an additional timeout
-    // Timeout is in seconds
-    bool wait_till_valid_or_timeout(uint32_t timeout) {
-        std::unique_lock<std::mutex> lock(stall_mutex);
-        
-        // Wait till the key is in VALID state or timeout occurs
-        // returns the latest value of is_valid(). If the wait completes due to key transitioning to valid 
+    // Same as wait_till_valid() with an additional timeout
+    bool wait_till_valid_or_timeout(std::chrono::nanoseconds timeout) {
+        // returns the latest value of is_valid(). If the wait completes due to key transitioning to valid
         // then the return value will be true else false
-        return stall_cv.wait_for(lock, std::chrono::seconds(timeout), [this] {return is_valid();});
-        //// Return true if no_timeout. This is used to determine whether to stall client request
-        //return status == std::cv_status::no_timeout;
+        return ParkingLot::global().wait_for(this, [this] {return is_valid();}, timeout);
     }
 
-    inline void coord_valid_to_write_transition(const std::string &new_value, uint32_t node_id) {
-        std::unique_lock<std::mutex> lock(stall_mutex);
-        State expected = VALID;
-        st.compare_exchange_strong(expected, WRITE);
-        timestamp.logical_time++;
-        timestamp.node_id = node_id;
-        value = new_value;
-        //return timestamp;
+    // Parks `cont` till the key becomes VALID. Unlike wait_till_valid() this doesn't block the
+    // calling thread. Returns false without parking if the key is already VALID.
+    bool park_till_valid(std::function<void()> cont) {
+        return ParkingLot::global().park(this, [this] {return is_valid();}, std::move(cont));
+    }
+
+    // Writes advance the logical time by 2 and RMWs by 1 (as in Hermes). A write then always
+    // wins over a concurrent RMW that read the same version, which must abort since its update
+    // was computed from an overwritten value
+    static constexpr uint32_t WRITE_TS_STEP = 2;
+    static constexpr uint32_t RMW_TS_STEP = 1;
+
+    // Starts a write on the coordinator. Returns false and changes nothing if the key isn't
+    // VALID, e.g. another write of the key woke up first and started its round
+    inline bool coord_valid_to_write_transition(const std::string &new_value, uint32_t node_id, TimestampChange *change) {
+        lock();
+        // A key only leaves VALID with the lock held, so it stays VALID till the unlock
+        if (state_of(_meta.load(std::memory_order_acquire)) != VALID) {
+            unlock([](uint64_t &meta) {});
+            return false;
+        }
+        store_value(new_value);
+        unlock([&](uint64_t &meta) {
+            change->from = timestamp_of(meta);
+            meta = with_state(meta, WRITE);
+            meta = with_timestamp(meta, timestamp_of(meta).logical_time + WRITE_TS_STEP, node_id);
+            change->to = timestamp_of(meta);
+        });
+        return true;
+    }
+
+    // Starts an RMW on the coordinator. If the key is VALID, update(current, &next) computes the
+    // new value, and the key moves to WRITE with it. Returns false and changes nothing if the key
+    // isn't VALID, or if update() returns false (e.g. a compare that failed). update() runs with
+    // the value locked, so no other update of the key can come in between
+    template <typename Update>
+    inline bool coord_valid_to_rmw_transition(Update &&update, uint32_t node_id, TimestampChange *change) {
+        lock();
+        // A key only leaves VALID with the lock held, so it stays VALID till the unlock
+        if (state_of(_meta.load(std::memory_order_acquire)) != VALID) {
+            unlock([](uint64_t &meta) {});
+            return false;
+        }
+        std::string current, next;
+        racy_copy(current);
+        if (!update(current, &next)) {
+            unlock([](uint64_t &meta) {});
+            return false;
+        }
+        store_value(next);
+        unlock([&](uint64_t &meta) {
+            change->from = timestamp_of(meta);
+            meta = with_state(meta, WRITE);
+            meta = with_timestamp(meta, timestamp_of(meta).logical_time + RMW_TS_STEP, node_id);
+            change->to = timestamp_of(meta);
+        });
+        return true;
     }
 
     bool is_lower(HermesTimestamp ts) {
-        std::unique_lock<std::mutex> lock(stall_mutex);
-        return Timestamp(ts) < timestamp;
+        Timestamp local = getTimestamp();
+        return Timestamp(ts) < local;
     }
 
     bool not_equal(HermesTimestamp ts) {
-        std::unique_lock<std::mutex> lock(stall_mutex);
-        return Timestamp(ts) != timestamp;
+        Timestamp local = getTimestamp();
+        return Timestamp(ts) != local;
     }
-    
+
     inline bool is_valid() {
-        return (st.load(std::memory_order_acquire) == VALID);
+        return getState() == VALID;
     }
 
     inline bool is_write() {
-        return (st.load(std::memory_order_acquire) == WRITE);
+        return getState() == WRITE;
     }
 
     inline void coord_write_to_valid_transition() {
-        State expected = WRITE;
-        st.compare_exchange_strong(expected, VALID);
-        stall_cv.notify_one();
+        transition(WRITE, VALID);
+        notify_valid();
     }
-    
+
     inline void coord_write_to_invalid_transition() {
-        State expected = WRITE;
-        st.compare_exchange_strong(expected, INVALID);
+        transition(WRITE, INVALID);
     }
 
     inline void fol_invalid_to_replay_transition() {
-        State expected = INVALID;
-        st.compare_exchange_strong(expected, REPLAY);
+        transition(INVALID, REPLAY);
     }
 
     inline void fol_replay_to_write_transition() {
-        State expected = REPLAY;
-        st.compare_exchange_strong(expected, WRITE);
+        transition(REPLAY, WRITE);
     }
 
     // We check if the transition is possible before making it
-    void fol_invalidate(std::string value, HermesTimestamp ts) {
-        std::unique_lock<std::mutex> lock(stall_mutex);
-        st.store(INVALID, std::memory_order_release);
-        this->value = value;
-        this->timestamp = Timestamp(ts);
+    TimestampChange fol_invalidate(const std::string &value, HermesTimestamp ts) {
+        TimestampChange change;
+        lock();
+        store_value(value);
+        unlock([&](uint64_t &meta) {
+            change.from = timestamp_of(meta);
+            meta = with_state(meta, INVALID);
+            meta = with_timestamp(meta, ts.local_ts(), ts.node_id());
+            change.to = timestamp_of(meta);
+        });
+        return change;
+    }
+
+    // Invalidates the key with an INV's value unless the INV's timestamp is lower than the local
+    // one. The timestamp is compared under the lock, so a lower INV can't overwrite a higher one
+    // that raced ahead of it. Returns whether the INV was applied
+    bool fol_invalidate_if_not_lower(const std::string &value, HermesTimestamp ts, TimestampChange *change) {
+        lock();
+        Timestamp local = getTimestamp();
+        if (Timestamp(ts) < local) {
+            unlock([](uint64_t &meta) {});
+            return false;
+        }
+        store_value(value);
+        unlock([&](uint64_t &meta) {
+            change->from = timestamp_of(meta);
+            meta = with_state(meta, INVALID);
+            meta = with_timestamp(meta, ts.local_ts(), ts.node_id());
+            change->to = timestamp_of(meta);
+        });
+        return true;
+    }
+
+    // Validates the key if it is still INVALID with the VAL's timestamp. Checked under the lock,
+    // so an INV with a higher timestamp can't be validated by the older VAL
+    bool fol_validate_if_equal(Timestamp ts) {
+        lock();
+        uint64_t meta = _meta.load(std::memory_order_acquire);
+        Timestamp local = timestamp_of(meta);
+        if (local != ts || state_of(meta) != INVALID) {
+            unlock([](uint64_t &meta) {});
+            return false;
+        }
+        unlock([](uint64_t &meta) {
+            meta = with_state(meta, VALID);
+        });
+        notify_valid();
+        return true;
+    }
+
+    // Installs a copy of the key from another replica if it is newer than the local one. The
+    // timestamp is compared under the lock, so an INV that raced ahead of the copy wins.
+    // Returns whether the copy was installed
+    bool fol_install_if_newer(const std::string &value, Timestamp ts, State st, TimestampChange *change) {
+        lock();
+        Timestamp local = getTimestamp();
+        if (!(local < ts)) {
+            unlock([](uint64_t &meta) {});
+            return false;
+        }
+        store_value(value);
+        unlock([&](uint64_t &meta) {
+            change->from = timestamp_of(meta);
+            meta = with_state(meta, st == VALID ? VALID : INVALID);
+            meta = with_timestamp(meta, ts.logical_time, ts.node_id);
+            change->to = timestamp_of(meta);
+        });
+        if (st == VALID) {
+            notify_valid();
+        }
+        return true;
     }
 
-    // We check if the transition is possible before making it 
+    // We check if the transition is possible before making it
     inline void fol_invalid_to_valid_transition() {
-        State expected = INVALID;
-        st.compare_exchange_strong(expected, VALID);
-        stall_cv.notify_one();
+        transition(INVALID, VALID);
+        notify_valid();
     }
 
     inline Timestamp getTimestamp() {
-        return timestamp;
+        return timestamp_of(_meta.load(std::memory_order_acquire));
     }
 
     inline State getState() {
-        return st.load();
+        return state_of(_meta.load(std::memory_order_acquire));
     }
 };
@@ -0,0 +1,354 @@
+#include "wal.h"
+#include "../utils/fs.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstring>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <stdexcept>
+#include <vector>
+
+namespace {
+
+// How often the ASYNC mode writes and fsyncs the buffer
+constexpr auto ASYNC_FLUSH_INTERVAL = std::chrono::milliseconds(10);
+
+constexpr size_t HEADER_SIZE = 2 * sizeof(uint32_t);
+
+// FNV-1a
+uint32_t checksum(const char *data, size_t size) {
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < size; i++) {
+        hash ^= static_cast<uint8_t>(data[i]);
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+void putU32(std::string &out, uint32_t value) {
+    char bytes[sizeof(uint32_t)];
+    std::memcpy(bytes, &value, sizeof(value));
+    out.append(bytes, sizeof(bytes));
+}
+
+uint32_t getU32(const char *data) {
+    uint32_t value;
+    std::memcpy(&value, data, sizeof(value));
+    return value;
+}
+
+}
+
+bool parseWalMode(const std::string &name, WalMode *mode) {
+    if (name == "none") {
+        *mode = WalMode::NONE;
+    }
+    else if (name == "async") {
+        *mode = WalMode::ASYNC;
+    }
+    else if (name == "group") {
+        *mode = WalMode::GROUP;
+    }
+    else {
+        return false;
+    }
+    return true;
+}
+
+WriteAheadLog::WriteAheadLog(const std::string &path, WalMode mode, const ReplayCallback &replay_callback,
+        std::shared_ptr<spdlog::logger> logger)
+        : _path(path), _mode(mode), _logger(logger), _appended_lsn(0), _durable_lsn(0), _num_syncs(0), _stop(false) {
+    _fd = ::open(path.c_str(), O_RDWR | O_CREAT, 0644);
+    if (_fd < 0) {
+        throw std::runtime_error("Failed to open WAL " + path + ": " + std::strerror(errno));
+    }
+    // The log may have just been created, and its fsyncs don't cover its directory entry
+    if (!syncParentDir(path)) {
+        ::close(_fd);
+        throw std::runtime_error("Failed to sync the directory of WAL " + path + ": " + std::strerror(errno));
+    }
+    // Records of a rotated log that wasn't covered by a snapshot yet come first
+    int rotated_fd = ::open((path + ".old").c_str(), O_RDONLY);
+    if (rotated_fd >= 0) {
+        replay(rotated_fd, path + ".old", replay_callback);
+        ::close(rotated_fd);
+    }
+    off_t end = replay(_fd, _path, replay_callback);
+    // Drop a torn record left by a crash, new records are appended after the last intact one
+    if (::ftruncate(_fd, end) != 0 || ::lseek(_fd, end, SEEK_SET) != end) {
+        ::close(_fd);
+        throw std::runtime_error("Failed to truncate WAL " + path + ": " + std::strerror(errno));
+    }
+    _flusher = std::thread(&WriteAheadLog::flushLoop, this);
+}
+
+WriteAheadLog::~WriteAheadLog() {
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+        _stop = true;
+    }
+    _flush_cv.notify_one();
+    _flusher.join();
+    ::close(_fd);
+}
+
+off_t WriteAheadLog::replay(int fd, const std::string &path, const ReplayCallback &callback) {
+    std::string log;
+    std::vector<char> chunk(1 << 20);
+    ssize_t n;
+    while ((n = ::read(fd, chunk.data(), chunk.size())) > 0) {
+        log.append(chunk.data(), n);
+    }
+
+    size_t offset = 0;
+    uint64_t records = 0;
+    while (offset + HEADER_SIZE <= log.size()) {
+        const char *header = log.data() + offset;
+        uint32_t payload_len = getU32(header);
+        if (payload_len < 3 * sizeof(uint32_t) || offset + HEADER_SIZE + payload_len > log.size()) {
+            break;
+        }
+        const char *payload = header + HEADER_SIZE;
+        if (checksum(payload, payload_len) != getU32(header + sizeof(uint32_t))) {
+            break;
+        }
+        uint32_t logical_time = getU32(payload);
+        uint32_t node_id = getU32(payload + sizeof(uint32_t));
+        uint32_t key_len = getU32(payload + 2 * sizeof(uint32_t));
+        size_t fixed = 3 * sizeof(uint32_t);
+        if (fixed + key_len > payload_len) {
+            break;
+        }
+        absl::string_view key(payload + fixed, key_len);
+        absl::string_view value(payload + fixed + key_len, payload_len - fixed - key_len);
+        callback(key, value, logical_time, node_id);
+        offset += HEADER_SIZE + payload_len;
+        records++;
+    }
+    if (offset != log.size()) {
+        SPDLOG_LOGGER_WARN(_logger, "Dropping {} bytes of torn or corrupt records at the end of WAL {}",
+            log.size() - offset, path);
+    }
+    SPDLOG_LOGGER_INFO(_logger, "Replayed {} records from WAL {}", records, path);
+    return offset;
+}
+
+uint64_t WriteAheadLog::append(absl::string_view key, absl::string_view value, uint32_t logical_time, uint32_t node_id) {
+    std::string payload;
+    payload.reserve(3 * sizeof(uint32_t) + key.size() + value.size());
+    putU32(payload, logical_time);
+    putU32(payload, node_id);
+    putU32(payload, key.size());
+    payload.append(key.data(), key.size());
+    payload.append(value.data(), value.size());
+
+    uint64_t lsn;
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+        putU32(_buffer, payload.size());
+        putU32(_buffer, checksum(payload.data(), payload.size()));
+        _buffer.append(payload);
+        lsn = ++_appended_lsn;
+    }
+    if (_mode == WalMode::GROUP) {
+        _flush_cv.notify_one();
+    }
+    return lsn;
+}
+
+void WriteAheadLog::waitDurable(uint64_t lsn) {
+    if (_mode != WalMode::GROUP) {
+        return;
+    }
+    std::unique_lock<std::mutex> lock(_mutex);
+    _durable_cv.wait(lock, [this, lsn] {return _durable_lsn >= lsn || _stop;});
+}
+
+void WriteAheadLog::onDurable(uint64_t lsn, std::function<void()> done) {
+    if (_mode == WalMode::GROUP) {
+        std::unique_lock<std::mutex> lock(_mutex);
+        if (_durable_lsn < lsn) {
+            _durable_callbacks.emplace(lsn, std::move(done));
+            return;
+        }
+    }
+    done();
+}
+
+bool WriteAheadLog::writeAndSync(const std::string &batch) {
+    size_t written = 0;
+    while (written < batch.size()) {
+        ssize_t n = ::write(_fd, batch.data() + written, batch.size() - written);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            SPDLOG_LOGGER_CRITICAL(_logger, "Failed to write WAL {}: {}", _path, std::strerror(errno));
+            return false;
+        }
+        written += n;
+    }
+    if (::fdatasync(_fd) != 0) {
+        SPDLOG_LOGGER_CRITICAL(_logger, "Failed to fsync WAL {}: {}", _path, std::strerror(errno));
+        return false;
+    }
+    return true;
+}
+
+// Takes the buffer and makes it durable. Must hold _file_mutex
+void WriteAheadLog::flush(std::unique_lock<std::mutex> &lock) {
+    std::string batch;
+    batch.swap(_buffer);
+    uint64_t lsn = _appended_lsn;
+    lock.unlock();
+
+    // Appends that arrive from here on go to the next fsync
+    if (!writeAndSync(batch)) {
+        // The records of the batch can't be acked as durable. Retrying isn't safe either: after
+        // a failed fsync the kernel may have dropped the dirty pages, and a later fsync succeeds
+        // without them. Crash instead, the other replicas replay this node's writes
+        SPDLOG_LOGGER_CRITICAL(_logger, "Aborting, records up to {} of WAL {} may not be durable", lsn, _path);
+        _logger->flush();
+        std::abort();
+    }
+
+    lock.lock();
+    _durable_lsn = lsn;
+    _num_syncs++;
+    _durable_cv.notify_all();
+
+    if (_durable_callbacks.empty()) {
+        return;
+    }
+    std::vector<std::function<void()>> callbacks;
+    auto end = _durable_callbacks.upper_bound(lsn);
+    for (auto it = _durable_callbacks.begin(); it != end; it++) {
+        callbacks.push_back(std::move(it->second));
+    }
+    _durable_callbacks.erase(_durable_callbacks.begin(), end);
+    lock.unlock();
+    for (auto& done: callbacks) {
+        done();
+    }
+    lock.lock();
+}
+
+void WriteAheadLog::flushLoop() {
+    while (true) {
+        std::unique_lock<std::mutex> file_lock(_file_mutex, std::defer_lock);
+        std::unique_lock<std::mutex> lock(_mutex);
+        if (_mode == WalMode::GROUP) {
+            _flush_cv.wait(lock, [this] {return _stop || !_buffer.empty();});
+        }
+        else {
+            _flush_cv.wait_for(lock, ASYNC_FLUSH_INTERVAL, [this] {return _stop;});
+        }
+        if (_buffer.empty()) {
+            if (_stop) {
+                break;
+            }
+            continue;
+        }
+        // A rotation may be in progress, it flushes the buffer itself
+        lock.unlock();
+        file_lock.lock();
+        lock.lock();
+        if (!_buffer.empty()) {
+            flush(lock);
+        }
+    }
+}
+
+bool WriteAheadLog::rotate() {
+    std::unique_lock<std::mutex> file_lock(_file_mutex);
+    std::string rotated_path = _path + ".old";
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+        flush(lock);
+    }
+    if (::access(rotated_path.c_str(), F_OK) == 0) {
+        // The snapshot after the last rotation failed, so the rotated log isn't covered yet. The
+        // next snapshot covers it and the current log, so the current log is moved to its end
+        SPDLOG_LOGGER_WARN(_logger, "{} is still there, appending WAL {} to it", rotated_path, _path);
+        return appendToRotated(rotated_path);
+    }
+    int fd = ::open((_path + ".new").c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        SPDLOG_LOGGER_CRITICAL(_logger, "Failed to create WAL {}.new: {}", _path, std::strerror(errno));
+        return false;
+    }
+    if (std::rename(_path.c_str(), rotated_path.c_str()) != 0) {
+        SPDLOG_LOGGER_CRITICAL(_logger, "Failed to rotate WAL {}: {}", _path, std::strerror(errno));
+        ::close(fd);
+        return false;
+    }
+    if (std::rename((_path + ".new").c_str(), _path.c_str()) != 0) {
+        SPDLOG_LOGGER_CRITICAL(_logger, "Failed to rotate WAL {}: {}", _path, std::strerror(errno));
+        ::close(fd);
+        // Appends still go to the current file, put it back in place
+        if (std::rename(rotated_path.c_str(), _path.c_str()) != 0) {
+            SPDLOG_LOGGER_CRITICAL(_logger, "Failed to restore WAL {} from {}: {}", _path, rotated_path, std::strerror(errno));
+        }
+        return false;
+    }
+    ::close(_fd);
+    _fd = fd;
+    // Otherwise a crash could bring back the old names, and lose the records appended to the new log
+    if (!syncParentDir(_path)) {
+        SPDLOG_LOGGER_CRITICAL(_logger, "Failed to sync the directory of WAL {}: {}", _path, std::strerror(errno));
+        return false;
+    }
+    return true;
+}
+
+// Copies the current log to the end of the rotated one and empties it. Must hold _file_mutex.
+// A crash in between leaves the records in both, which is fine since replaying a record twice
+// doesn't change anything
+bool WriteAheadLog::appendToRotated(const std::string &rotated_path) {
+    int rotated_fd = ::open(rotated_path.c_str(), O_WRONLY | O_APPEND);
+    if (rotated_fd < 0) {
+        SPDLOG_LOGGER_CRITICAL(_logger, "Failed to open {}: {}", rotated_path, std::strerror(errno));
+        return false;
+    }
+    std::vector<char> chunk(1 << 20);
+    off_t offset = 0;
+    bool ok = true;
+    while (ok) {
+        ssize_t n = ::pread(_fd, chunk.data(), chunk.size(), offset);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            ok = (n == 0);
+            break;
+        }
+        for (ssize_t written = 0; ok && written < n;) {
+            ssize_t w = ::write(rotated_fd, chunk.data() + written, n - written);
+            if (w < 0 && errno != EINTR) {
+                ok = false;
+            }
+            else if (w > 0) {
+                written += w;
+            }
+        }
+        offset += n;
+    }
+    ok = ok && ::fdatasync(rotated_fd) == 0;
+    ::close(rotated_fd);
+    if (!ok) {
+        SPDLOG_LOGGER_CRITICAL(_logger, "Failed to append WAL {} to {}: {}", _path, rotated_path, std::strerror(errno));
+        return false;
+    }
+    if (::ftruncate(_fd, 0) != 0 || ::lseek(_fd, 0, SEEK_SET) != 0 || ::fdatasync(_fd) != 0) {
+        SPDLOG_LOGGER_CRITICAL(_logger, "Failed to truncate WAL {}: {}", _path, std::strerror(errno));
+        return false;
+    }
+    return true;
+}
+
+void WriteAheadLog::dropRotated() {
+    ::unlink((_path + ".old").c_str());
+}
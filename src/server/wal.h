@@ -0,0 +1,123 @@
+#pragma once
+
+#include <sys/types.h>
+#include <string>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <map>
+#include <vector>
+#include <cstdint>
+#include <absl/strings/string_view.h>
+
+#include "spdlog/include/spdlog/spdlog.h"
+
+enum class WalMode {
+    NONE,   // No log, writes are lost on restart
+    ASYNC,  // Appends return immediately, the log is written and fsynced in the background
+    GROUP   // Appends wait till the record is fsynced. Concurrent appends share one fsync
+};
+
+// Parses "none", "async" or "group". Returns false for anything else
+bool parseWalMode(const std::string &name, WalMode *mode);
+
+// Append-only write-ahead log of accepted writes.
+// Records are appended to an in-memory buffer and a single flusher thread writes the buffer
+// and fsyncs it. Appends that arrive while an fsync is in progress pile up in the buffer and
+// are made durable together by the next one, which is what groups the commits.
+//
+// Record layout (little endian):
+//   [payload_len u32][checksum u32][logical_time u32][node_id u32][key_len u32][key][value]
+// The checksum covers everything after itself, so a torn record at the end of the log is
+// detected and dropped on recovery. The log is truncated by rotating it when a snapshot is taken.
+// A failed write or fsync aborts the process, so a record is never acked as durable when it isn't.
+class WriteAheadLog {
+public:
+    using ReplayCallback = std::function<void(absl::string_view key, absl::string_view value,
+        uint32_t logical_time, uint32_t node_id)>;
+
+    // Opens (or creates) the log at `path`, calling `replay` for each intact record first.
+    // Throws std::runtime_error if the file can't be opened.
+    WriteAheadLog(const std::string &path, WalMode mode, const ReplayCallback &replay,
+        std::shared_ptr<spdlog::logger> logger);
+
+    ~WriteAheadLog();
+
+    // Appends a record and returns its sequence number. Use waitDurable() to wait for it
+    uint64_t append(absl::string_view key, absl::string_view value, uint32_t logical_time, uint32_t node_id);
+
+    // In GROUP mode blocks till the record `lsn` (and the ones before it) is on disk.
+    // Returns immediately in ASYNC mode.
+    void waitDurable(uint64_t lsn);
+
+    // Same as waitDurable() without blocking: calls `done` once the record `lsn` is on disk, on
+    // the flusher thread, or right away if it already is or in ASYNC mode. `done` must not block
+    void onDurable(uint64_t lsn, std::function<void()> done);
+
+    // Starts a new log. The records appended so far stay in <path>.old, which is replayed
+    // before the log on recovery till dropRotated() deletes it, once a snapshot covers them.
+    // If the previous rotated log wasn't dropped, the records are appended to it instead.
+    // Returns false (and keeps the current log) on failure.
+    bool rotate();
+
+    void dropRotated();
+
+    WalMode mode() const {
+        return _mode;
+    }
+
+    uint64_t numSyncs() const {
+        return _num_syncs;
+    }
+
+private:
+    std::string _path;
+
+    WalMode _mode;
+
+    int _fd;
+
+    std::shared_ptr<spdlog::logger> _logger;
+
+    // Records not handed to the flusher yet
+    std::string _buffer;
+
+    // Sequence number of the last record appended and of the last one on disk
+    uint64_t _appended_lsn;
+
+    uint64_t _durable_lsn;
+
+    std::atomic<uint64_t> _num_syncs;
+
+    std::mutex _mutex;
+
+    // Held while the file is written, synced or rotated. Taken before _mutex
+    std::mutex _file_mutex;
+
+    // Wakes the flusher
+    std::condition_variable _flush_cv;
+
+    // Wakes the appenders waiting in waitDurable()
+    std::condition_variable _durable_cv;
+
+    // Callbacks of onDurable() by the record they wait for
+    std::multimap<uint64_t, std::function<void()>> _durable_callbacks;
+
+    bool _stop;
+
+    std::thread _flusher;
+
+    // Replays the log and returns the offset of the end of the last intact record
+    off_t replay(int fd, const std::string &path, const ReplayCallback &callback);
+
+    bool writeAndSync(const std::string &batch);
+
+    bool appendToRotated(const std::string &rotated_path);
+
+    void flush(std::unique_lock<std::mutex> &lock);
+
+    void flushLoop();
+};
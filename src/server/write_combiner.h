@@ -0,0 +1,83 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <functional>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <utility>
+#include <vector>
+#include <absl/container/flat_hash_map.h>
+#include <absl/hash/hash.h>
+
+class HermesValue;
+
+// Coordinator side combining of the writes of a hot key. The first write of a key leads a batch
+// and waits for the key to become VALID. Writes of the key that arrive meanwhile join the batch
+// instead of queueing for rounds of their own, and each overwrites the value of the batch. Once
+// the key is VALID the leader closes the batch and writes the last value in a single round,
+// after which the writes that joined are acked. Writes arriving after the close start the next
+// batch, whose leader waits for that round.
+//
+// Still linearizable: every write of a batch is in flight from before the close till after the
+// round commits, so they can all take effect at the commit, in the order they joined. All but
+// the last one are overwritten before any read can observe them.
+class WriteCombiner {
+private:
+    struct Batch {
+        // Value of the last write that joined, if any did
+        std::optional<std::string> value;
+        // One per write that joined
+        std::vector<std::function<void()>> waiters;
+    };
+
+    static constexpr size_t NUM_SHARDS = 64;
+
+    struct alignas(64) Shard {
+        std::mutex mutex;
+        // Records never move, so they identify the key without copying it
+        absl::flat_hash_map<const HermesValue*, Batch> batches;
+    };
+
+    std::array<Shard, NUM_SHARDS> _shards;
+
+    Shard& shardFor(const HermesValue *key) {
+        return _shards[absl::Hash<const HermesValue*>{}(key) % NUM_SHARDS];
+    }
+
+public:
+    // Returns true if the caller leads a new batch of `key`, and has to close() it once the key
+    // is VALID. Otherwise the write joined the open batch, and on_done is called by its leader
+    // when the write is committed
+    bool join(const HermesValue *key, const std::string &value, std::function<void()> on_done) {
+        Shard &shard = shardFor(key);
+        std::unique_lock<std::mutex> lock(shard.mutex);
+        auto [it, inserted] = shard.batches.try_emplace(key);
+        if (inserted) {
+            return true;
+        }
+        it->second.value = value;
+        it->second.waiters.push_back(std::move(on_done));
+        return false;
+    }
+
+    // Leader only. Closes the batch of `key` if start(value) succeeds, where value is the value
+    // to write, i.e. that of the last write that joined, or the leader's own. start runs under
+    // the lock of the batch, so that the leader of the next batch doesn't find the key VALID
+    // before the round started. If start fails, e.g. the key isn't VALID anymore, the batch
+    // stays open and nullopt is returned. Otherwise returns the callbacks to run once the round
+    // committed
+    template <typename Start>
+    std::optional<std::vector<std::function<void()>>> close(const HermesValue *key, const std::string &own_value, Start &&start) {
+        Shard &shard = shardFor(key);
+        std::unique_lock<std::mutex> lock(shard.mutex);
+        auto it = shard.batches.find(key);
+        if (!start(it->second.value ? *it->second.value : own_value)) {
+            return std::nullopt;
+        }
+        Batch batch = std::move(it->second);
+        shard.batches.erase(it);
+        return std::move(batch.waiters);
+    }
+};
@@ -1,36 +1,371 @@
+#pragma once
+
 #include <vector>
 #include <queue>
 #include <mutex>
 #include <condition_variable>
 #include <thread>
+#include <functional>
+#include <atomic>
+#include <memory>
+#include <cstdint>
+
+// Unit of work run by the Threadpool. The pool takes ownership of a task once it is
+// added and deletes it after it has run.
+class Task {
+public:
+    virtual ~Task() = default;
+    virtual void run() = 0;
+};
+
+// Task wrapping a callable
+class FunctionTask : public Task {
+private:
+    std::function<void()> _fn;
+
+public:
+    explicit FunctionTask(std::function<void()> fn) : _fn(std::move(fn)) {}
+
+    void run() override {
+        _fn();
+    }
+};
+
+// Bounded lock-free multi-producer multi-consumer queue (D. Vyukov). Every cell carries a
+// sequence number telling producers and consumers whose turn it is.
+class TaskRing {
+private:
+    struct Cell {
+        std::atomic<uint64_t> seq;
+        Task *task;
+    };
+
+    std::unique_ptr<Cell[]> _cells;
+    uint64_t _mask;
+    alignas(64) std::atomic<uint64_t> _enqueue_pos {0};
+    alignas(64) std::atomic<uint64_t> _dequeue_pos {0};
+
+public:
+    // capacity must be a power of two
+    explicit TaskRing(uint64_t capacity) : _cells(new Cell[capacity]), _mask(capacity - 1) {
+        for (uint64_t i = 0; i < capacity; i++) {
+            _cells[i].seq.store(i, std::memory_order_relaxed);
+        }
+    }
 
-class Task;
+    // Returns false if the ring is full
+    bool push(Task *task) {
+        uint64_t pos = _enqueue_pos.load(std::memory_order_relaxed);
+        while (true) {
+            Cell &cell = _cells[pos & _mask];
+            int64_t diff = static_cast<int64_t>(cell.seq.load(std::memory_order_acquire) - pos);
+            if (diff == 0) {
+                if (_enqueue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    cell.task = task;
+                    cell.seq.store(pos + 1, std::memory_order_release);
+                    return true;
+                }
+            } else if (diff < 0) {
+                return false;
+            } else {
+                pos = _enqueue_pos.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    // Returns nullptr if the ring is empty
+    Task* pop() {
+        uint64_t pos = _dequeue_pos.load(std::memory_order_relaxed);
+        while (true) {
+            Cell &cell = _cells[pos & _mask];
+            int64_t diff = static_cast<int64_t>(cell.seq.load(std::memory_order_acquire) - (pos + 1));
+            if (diff == 0) {
+                if (_dequeue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    Task *task = cell.task;
+                    cell.seq.store(pos + _mask + 1, std::memory_order_release);
+                    return task;
+                }
+            } else if (diff < 0) {
+                return nullptr;
+            } else {
+                pos = _dequeue_pos.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    uint64_t size() const {
+        uint64_t dequeued = _dequeue_pos.load(std::memory_order_relaxed);
+        uint64_t enqueued = _enqueue_pos.load(std::memory_order_relaxed);
+        return enqueued > dequeued ? enqueued - dequeued : 0;
+    }
+};
+
+// Fixed size Chase-Lev deque (Lê et al., "Correct and Efficient Work-Stealing for Weak Memory
+// Models"). The owning worker pushes and pops at the bottom, other workers steal from the top.
+class WorkStealingDeque {
+private:
+    std::unique_ptr<std::atomic<Task*>[]> _tasks;
+    int64_t _mask;
+    alignas(64) std::atomic<int64_t> _top {0};
+    alignas(64) std::atomic<int64_t> _bottom {0};
+
+public:
+    // capacity must be a power of two
+    explicit WorkStealingDeque(int64_t capacity) : _tasks(new std::atomic<Task*>[capacity]), _mask(capacity - 1) {}
+
+    // Owner only. Returns false if the deque is full
+    bool push(Task *task) {
+        int64_t b = _bottom.load(std::memory_order_relaxed);
+        int64_t t = _top.load(std::memory_order_acquire);
+        if (b - t > _mask) {
+            return false;
+        }
+        _tasks[b & _mask].store(task, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        _bottom.store(b + 1, std::memory_order_relaxed);
+        return true;
+    }
+
+    // Owner only. Newest task first
+    Task* pop() {
+        int64_t b = _bottom.load(std::memory_order_relaxed) - 1;
+        _bottom.store(b, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        int64_t t = _top.load(std::memory_order_relaxed);
+        if (t > b) {
+            _bottom.store(b + 1, std::memory_order_relaxed);
+            return nullptr;
+        }
+        Task *task = _tasks[b & _mask].load(std::memory_order_relaxed);
+        if (t == b) {
+            // Last task, race the thieves for it
+            if (!_top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed)) {
+                task = nullptr;
+            }
+            _bottom.store(b + 1, std::memory_order_relaxed);
+        }
+        return task;
+    }
+
+    // Any thread. Oldest task first. Returns nullptr if the deque is empty or another thread
+    // won the race for the task
+    Task* steal() {
+        int64_t t = _top.load(std::memory_order_acquire);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        int64_t b = _bottom.load(std::memory_order_acquire);
+        if (t >= b) {
+            return nullptr;
+        }
+        Task *task = _tasks[t & _mask].load(std::memory_order_relaxed);
+        if (!_top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed)) {
+            return nullptr;
+        }
+        return task;
+    }
 
+    int64_t size() const {
+        int64_t b = _bottom.load(std::memory_order_relaxed);
+        int64_t t = _top.load(std::memory_order_relaxed);
+        return b > t ? b - t : 0;
+    }
+};
+
+// Work-stealing thread pool.
+// Tasks added from outside the pool (e.g. by gRPC handlers) go to a shared lock-free ring.
+// Tasks added by a worker go to the bottom of its own deque, and it runs them newest first.
+// An idle worker takes from its deque, then the ring, then steals the oldest task of another
+// worker, so a worker blocked in a long task (e.g. an invalidation round) doesn't hold up the
+// tasks it spawned. Adding a task only takes a lock to wake up a sleeping worker, or in the
+// rare case the ring is full.
 class Threadpool {
+public:
+    struct Stats {
+        // Tasks waiting to run
+        uint64_t queued = 0;
+        // Tasks run so far, and how many of them were stolen from another worker
+        uint64_t executed = 0;
+        uint64_t steals = 0;
+        // Workers sleeping for lack of tasks
+        uint32_t idle = 0;
+        uint32_t threads = 0;
+    };
+
 private:
-    int _num_threads;
+    static constexpr uint64_t RING_CAPACITY = 4096;
+    static constexpr int64_t DEQUE_CAPACITY = 1024;
+
+    struct alignas(64) Worker {
+        WorkStealingDeque deque {DEQUE_CAPACITY};
+        std::atomic<uint64_t> executed {0};
+        std::atomic<uint64_t> steals {0};
+    };
+
+    int _num_threads = 0;
     std::vector<std::thread> _threads;
-    std::queue<Task*> _tasks; // queue of tasks not assigned to any thread
+    std::vector<std::unique_ptr<Worker>> _workers;
+    TaskRing _ring {RING_CAPACITY};
+
+    // Overflow of the ring
+    std::queue<Task*> _tasks;
+    std::atomic<uint64_t> _num_overflow {0};
+
     std::mutex _mutex;
     std::condition_variable _cv;
-    bool _stop_requested;
+    std::atomic<uint32_t> _idle {0};
+    std::atomic<bool> _stop_requested {false};
+
+    // Worker of this pool running on the current thread, if any
+    static inline thread_local Threadpool *_current_pool = nullptr;
+    static inline thread_local uint32_t _current_worker = 0;
+
+    void wakeOne() {
+        // Pairs with the fence in processingLoop(): either the worker sees the new task when it
+        // checks again before sleeping, or we see it idle and notify it
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (_idle.load(std::memory_order_relaxed) > 0) {
+            std::unique_lock<std::mutex> lock(_mutex);
+            _cv.notify_one();
+        }
+    }
+
+    Task* popOverflow() {
+        if (_num_overflow.load(std::memory_order_relaxed) == 0) {
+            return nullptr;
+        }
+        std::unique_lock<std::mutex> lock(_mutex);
+        if (_tasks.empty()) {
+            return nullptr;
+        }
+        Task *task = _tasks.front();
+        _tasks.pop();
+        _num_overflow--;
+        return task;
+    }
+
+    Task* findTask(uint32_t index) {
+        Worker &self = *_workers[index];
+        if (Task *task = self.deque.pop()) {
+            return task;
+        }
+        if (Task *task = _ring.pop()) {
+            return task;
+        }
+        if (Task *task = popOverflow()) {
+            return task;
+        }
+        for (size_t i = 1; i < _workers.size(); i++) {
+            if (Task *task = _workers[(index + i) % _workers.size()]->deque.steal()) {
+                self.steals.fetch_add(1, std::memory_order_relaxed);
+                return task;
+            }
+        }
+        return nullptr;
+    }
+
+    bool hasTasks() {
+        if (_ring.size() > 0 || _num_overflow.load() > 0) {
+            return true;
+        }
+        for (auto& worker: _workers) {
+            if (worker->deque.size() > 0) {
+                return true;
+            }
+        }
+        return false;
+    }
 
 public:
     Threadpool() = default;
 
     Threadpool(int num_threads) :
-        _num_threads(num_threads),
-        _stop_requested(false)
+        _num_threads(num_threads)
         {}
 
-    ~Threadpool() {}
+    ~Threadpool() {
+        stop();
+    }
+
+    void addTask(Task *task) {
+        if (_current_pool == this && _workers[_current_worker]->deque.push(task)) {
+            wakeOne();
+            return;
+        }
+        if (!_ring.push(task)) {
+            std::unique_lock<std::mutex> lock(_mutex);
+            _tasks.push(task);
+            _num_overflow++;
+        }
+        wakeOne();
+    }
+
+    void addTask(std::function<void()> fn) {
+        addTask(new FunctionTask(std::move(fn)));
+    }
+
+    void processingLoop(uint32_t index) {
+        _current_pool = this;
+        _current_worker = index;
+        Worker &self = *_workers[index];
+        while (true) {
+            Task *task = findTask(index);
+            if (task == nullptr) {
+                std::unique_lock<std::mutex> lock(_mutex);
+                _idle.fetch_add(1, std::memory_order_relaxed);
+                std::atomic_thread_fence(std::memory_order_seq_cst);
+                // Check again under the lock, a task added before we went idle didn't notify us
+                while (!hasTasks() && !_stop_requested.load()) {
+                    _cv.wait(lock);
+                }
+                _idle.fetch_sub(1, std::memory_order_relaxed);
+                // Drain the queues before stopping
+                if (_stop_requested.load() && !hasTasks()) {
+                    return;
+                }
+                continue;
+            }
+            task->run();
+            delete task;
+            self.executed.fetch_add(1, std::memory_order_relaxed);
+        }
+    }
 
-    void addTask(Task *task) {}
-    void processingLoop() {}
-    void start() {}
-    void stop() {}
+    void start() {
+        for (int i = 0; i < _num_threads; i++) {
+            _workers.push_back(std::make_unique<Worker>());
+        }
+        for (int i = 0; i < _num_threads; i++) {
+            _threads.emplace_back(&Threadpool::processingLoop, this, i);
+        }
+    }
+
+    void stop() {
+        {
+            std::unique_lock<std::mutex> lock(_mutex);
+            _stop_requested = true;
+        }
+        _cv.notify_all();
+        for (auto& thread: _threads) {
+            if (thread.joinable()) {
+                thread.join();
+            }
+        }
+        _threads.clear();
+    }
 
     bool isStopRequested(){
         return _stop_requested;
     }
-};
\ No newline at end of file
+
+    Stats stats() const {
+        Stats stats;
+        stats.queued = _ring.size() + _num_overflow.load(std::memory_order_relaxed);
+        for (auto& worker: _workers) {
+            stats.queued += worker->deque.size();
+            stats.executed += worker->executed.load(std::memory_order_relaxed);
+            stats.steals += worker->steals.load(std::memory_order_relaxed);
+        }
+        stats.idle = _idle.load(std::memory_order_relaxed);
+        stats.threads = _num_threads;
+        return stats;
+    }
+};
@@ -0,0 +1,152 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <new>
+#include <absl/strings/string_view.h>
+
+// Insert-only concurrent skip list from string keys to pointers, in key order.
+// Inserts are lock-free: a node is linked with a CAS on every level, level 0 first, which is
+// where it becomes visible. Lookups and iteration take no lock and never wait for an insert.
+// Keys are never removed, so nodes are only freed with the list and readers need no
+// reclamation scheme. The list stores views of the keys, which must outlive it.
+template <typename T>
+class ConcurrentSkipList {
+private:
+    // With a branching factor of 4, enough for about 4^16 keys
+    static constexpr int MAX_HEIGHT = 16;
+
+    struct Node {
+        absl::string_view key;
+        std::atomic<T*> value;
+        int height;
+        // `height` entries
+        std::atomic<Node*> next[1];
+
+        static Node* create(absl::string_view key, T *value, int height) {
+            void *mem = ::operator new(sizeof(Node) + (height - 1) * sizeof(std::atomic<Node*>));
+            Node *node = new (mem) Node;
+            node->key = key;
+            node->value.store(value, std::memory_order_relaxed);
+            node->height = height;
+            for (int i = 0; i < height; i++) {
+                new (&node->next[i]) std::atomic<Node*>(nullptr);
+            }
+            return node;
+        }
+
+        static void destroy(Node *node) {
+            node->~Node();
+            ::operator delete(node);
+        }
+    };
+
+    Node *_head;
+    std::atomic<size_t> _size {0};
+
+    static int randomHeight() {
+        thread_local uint64_t state = reinterpret_cast<uintptr_t>(&state) | 1;
+        // xorshift64
+        state ^= state << 13;
+        state ^= state >> 7;
+        state ^= state << 17;
+        int height = 1;
+        uint64_t bits = state;
+        while (height < MAX_HEIGHT && (bits & 3) == 0) {
+            height++;
+            bits >>= 2;
+        }
+        return height;
+    }
+
+    // Fills the last nodes before `key` and the first ones at or after it on every level.
+    // Returns the node of `key` if it is present
+    Node* find(absl::string_view key, Node **preds, Node **succs) const {
+        Node *x = _head;
+        for (int level = MAX_HEIGHT - 1; level >= 0; level--) {
+            Node *next = x->next[level].load(std::memory_order_acquire);
+            while (next != nullptr && next->key < key) {
+                x = next;
+                next = x->next[level].load(std::memory_order_acquire);
+            }
+            preds[level] = x;
+            succs[level] = next;
+        }
+        return (succs[0] != nullptr && succs[0]->key == key) ? succs[0] : nullptr;
+    }
+
+public:
+    ConcurrentSkipList() : _head(Node::create(absl::string_view(), nullptr, MAX_HEIGHT)) {}
+
+    ConcurrentSkipList(const ConcurrentSkipList&) = delete;
+    ConcurrentSkipList& operator=(const ConcurrentSkipList&) = delete;
+
+    ~ConcurrentSkipList() {
+        // Every node is on level 0
+        Node *x = _head;
+        while (x != nullptr) {
+            Node *next = x->next[0].load(std::memory_order_relaxed);
+            Node::destroy(x);
+            x = next;
+        }
+    }
+
+    // Adds `key`. If it is already present without a value, sets its value instead. A key can
+    // be added without a value (nullptr) and get it later, e.g. a key that isn't loaded yet
+    void insert(absl::string_view key, T *value) {
+        Node *preds[MAX_HEIGHT];
+        Node *succs[MAX_HEIGHT];
+        Node *node = nullptr;
+        while (true) {
+            if (Node *found = find(key, preds, succs)) {
+                if (node != nullptr) {
+                    // Lost the race for the key to another insert
+                    Node::destroy(node);
+                }
+                T *expected = nullptr;
+                if (value != nullptr) {
+                    found->value.compare_exchange_strong(expected, value, std::memory_order_release, std::memory_order_relaxed);
+                }
+                return;
+            }
+            if (node == nullptr) {
+                node = Node::create(key, value, randomHeight());
+            }
+            node->next[0].store(succs[0], std::memory_order_relaxed);
+            if (preds[0]->next[0].compare_exchange_strong(succs[0], node, std::memory_order_release, std::memory_order_relaxed)) {
+                break;
+            }
+        }
+        _size.fetch_add(1, std::memory_order_relaxed);
+        // The node is in the list from here on, the upper levels only speed up searches
+        for (int level = 1; level < node->height; level++) {
+            while (true) {
+                node->next[level].store(succs[level], std::memory_order_relaxed);
+                if (preds[level]->next[level].compare_exchange_strong(succs[level], node, std::memory_order_release, std::memory_order_relaxed)) {
+                    break;
+                }
+                // Levels above `level` aren't linked yet, so the search can't stop at the node there
+                find(key, preds, succs);
+            }
+        }
+    }
+
+    // Calls fn(key, value) for the keys from `start` on, in order, till it returns false.
+    // Keys inserted during the iteration may or may not be seen
+    template <typename Fn>
+    void forEachFrom(absl::string_view start, Fn &&fn) const {
+        Node *preds[MAX_HEIGHT];
+        Node *succs[MAX_HEIGHT];
+        find(start, preds, succs);
+        for (Node *x = succs[0]; x != nullptr; x = x->next[0].load(std::memory_order_acquire)) {
+            if (!fn(x->key, x->value.load(std::memory_order_acquire))) {
+                return;
+            }
+        }
+    }
+
+    size_t size() const {
+        return _size.load(std::memory_order_relaxed);
+    }
+};
@@ -0,0 +1,19 @@
+#pragma once
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <string>
+
+// Fsyncs the directory that holds `path`, so that a file created, renamed or deleted in it is
+// still there (or gone) after a crash. The file's own fsync doesn't cover its directory entry
+inline bool syncParentDir(const std::string &path) {
+    size_t slash = path.rfind('/');
+    std::string dir = slash == std::string::npos ? "." : (slash == 0 ? "/" : path.substr(0, slash));
+    int fd = ::open(dir.c_str(), O_RDONLY | O_DIRECTORY);
+    if (fd < 0) {
+        return false;
+    }
+    bool ok = ::fsync(fd) == 0;
+    ::close(fd);
+    return ok;
+}
@@ -0,0 +1,117 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <thread>
+#include <vector>
+
+// Lock-free log-linear histogram of non-negative integers, like HdrHistogram. Values below
+// 2^SUB_BITS get a bucket each; above that every power of two is split into 2^SUB_BITS
+// buckets, so a bucket is at most 1/2^SUB_BITS (6.25%) wider than its lower bound.
+//
+// record() is a relaxed increment of two counters. Threads are spread over STRIPES copies of
+// the counters so that concurrent requests don't bounce the same cache line; the stripes are
+// only summed when the histogram is read.
+class Histogram {
+public:
+    static constexpr uint32_t SUB_BITS = 4;
+    static constexpr uint32_t SUB_BUCKETS = 1u << SUB_BITS;
+    static constexpr uint32_t NUM_BUCKETS = (64 - SUB_BITS + 1) * SUB_BUCKETS;
+    static constexpr uint32_t STRIPES = 8;
+
+    struct Snapshot {
+        uint64_t count = 0;
+        uint64_t sum = 0;
+        uint64_t max = 0;
+        std::vector<uint64_t> buckets;
+
+        double mean() const {
+            return count == 0 ? 0 : static_cast<double>(sum) / count;
+        }
+
+        // Upper bound of the bucket holding the q-th quantile, capped at the largest value
+        uint64_t percentile(double q) const {
+            if (count == 0) {
+                return 0;
+            }
+            uint64_t rank = std::max<uint64_t>(1, static_cast<uint64_t>(q * count + 0.5));
+            uint64_t seen = 0;
+            for (uint32_t i = 0; i < buckets.size(); i++) {
+                seen += buckets[i];
+                if (seen >= rank) {
+                    return std::min(max, upperBound(i));
+                }
+            }
+            return max;
+        }
+    };
+
+private:
+    struct alignas(64) Stripe {
+        std::array<std::atomic<uint64_t>, NUM_BUCKETS> buckets {};
+        std::atomic<uint64_t> sum {0};
+        std::atomic<uint64_t> max {0};
+    };
+
+    std::unique_ptr<Stripe[]> _stripes;
+
+    static uint32_t stripeOfThread() {
+        thread_local const uint32_t stripe = std::hash<std::thread::id>()(std::this_thread::get_id()) % STRIPES;
+        return stripe;
+    }
+
+public:
+    Histogram() : _stripes(new Stripe[STRIPES]) {}
+
+    static uint32_t bucketOf(uint64_t value) {
+        if (value < SUB_BUCKETS) {
+            return value;
+        }
+        uint32_t exponent = 63 - __builtin_clzll(value);
+        uint32_t sub = (value >> (exponent - SUB_BITS)) & (SUB_BUCKETS - 1);
+        return (exponent - SUB_BITS + 1) * SUB_BUCKETS + sub;
+    }
+
+    static uint64_t lowerBound(uint32_t bucket) {
+        if (bucket < SUB_BUCKETS) {
+            return bucket;
+        }
+        uint32_t exponent = bucket / SUB_BUCKETS + SUB_BITS - 1;
+        uint64_t sub = bucket % SUB_BUCKETS;
+        return (static_cast<uint64_t>(SUB_BUCKETS) | sub) << (exponent - SUB_BITS);
+    }
+
+    static uint64_t upperBound(uint32_t bucket) {
+        return bucket + 1 < NUM_BUCKETS ? lowerBound(bucket + 1) - 1 : UINT64_MAX;
+    }
+
+    void record(uint64_t value) {
+        Stripe &stripe = _stripes[stripeOfThread()];
+        stripe.buckets[bucketOf(value)].fetch_add(1, std::memory_order_relaxed);
+        stripe.sum.fetch_add(value, std::memory_order_relaxed);
+        uint64_t max = stripe.max.load(std::memory_order_relaxed);
+        while (value > max && !stripe.max.compare_exchange_weak(max, value, std::memory_order_relaxed)) {}
+    }
+
+    // Not atomic with respect to concurrent records, which may be split between the count
+    // and the sum of a snapshot
+    Snapshot snapshot() const {
+        Snapshot snapshot;
+        snapshot.buckets.assign(NUM_BUCKETS, 0);
+        for (uint32_t s = 0; s < STRIPES; s++) {
+            const Stripe &stripe = _stripes[s];
+            for (uint32_t i = 0; i < NUM_BUCKETS; i++) {
+                uint64_t n = stripe.buckets[i].load(std::memory_order_relaxed);
+                snapshot.buckets[i] += n;
+                snapshot.count += n;
+            }
+            snapshot.sum += stripe.sum.load(std::memory_order_relaxed);
+            snapshot.max = std::max(snapshot.max, stripe.max.load(std::memory_order_relaxed));
+        }
+        return snapshot;
+    }
+};
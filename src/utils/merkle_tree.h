@@ -0,0 +1,106 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+// Hash tree over the keys of a replica, to find the keys two replicas disagree on without
+// comparing all of them.
+//
+// Keys are split into 2^LEAF_BITS leaves by the top bits of a stable 64 bit key hash (the caller's,
+// so that a leaf can match a range of a hash-sorted index). A leaf's hash is the sum of
+// entryHash(key, timestamp) over its keys, and an inner node's hash is the sum of its leaves.
+// Since the hashes add up, a write only adds (new entry - old entry) to one leaf, in any order
+// with other writes, and inner nodes are summed when they are asked for. The tree has a fan-out
+// of 2^FANOUT_BITS, so that two replicas can walk it down in a few round trips.
+//
+// Each leaf also keeps the records that hash into it, to enumerate a leaf without a full scan.
+// Records are never removed, like the keys of the store.
+template <typename T>
+class MerkleTree {
+public:
+    static constexpr uint32_t LEAF_BITS = 16;
+    static constexpr uint32_t FANOUT_BITS = 4;
+    // Levels below the root. The leaves are at level DEPTH
+    static constexpr uint32_t DEPTH = LEAF_BITS / FANOUT_BITS;
+    static constexpr uint32_t NUM_LEAVES = 1u << LEAF_BITS;
+
+private:
+    struct Leaf {
+        std::atomic<uint64_t> hash {0};
+        std::mutex mutex;
+        std::vector<T*> records;
+    };
+
+    std::unique_ptr<Leaf[]> _leaves;
+
+    // splitmix64 finalizer
+    static uint64_t mix(uint64_t x) {
+        x ^= x >> 30;
+        x *= 0xbf58476d1ce4e5b9ULL;
+        x ^= x >> 27;
+        x *= 0x94d049bb133111ebULL;
+        x ^= x >> 31;
+        return x;
+    }
+
+    static uint64_t entryHash(uint64_t key_hash, uint32_t logical_time, uint32_t node_id) {
+        return mix(key_hash ^ mix((static_cast<uint64_t>(logical_time) << 32) | node_id));
+    }
+
+public:
+    MerkleTree() : _leaves(new Leaf[NUM_LEAVES]) {}
+
+    static uint32_t leafOf(uint64_t key_hash) {
+        return static_cast<uint32_t>(key_hash >> (64 - LEAF_BITS));
+    }
+
+    // Smallest key hash of a leaf. The leaf spans up to the first hash of the next one
+    static uint64_t firstHashOf(uint32_t leaf) {
+        return static_cast<uint64_t>(leaf) << (64 - LEAF_BITS);
+    }
+
+    static uint32_t numNodes(uint32_t level) {
+        return 1u << (level * FANOUT_BITS);
+    }
+
+    // Accounts for a key that isn't in the tree yet
+    void insert(uint64_t key_hash, uint32_t logical_time, uint32_t node_id) {
+        _leaves[leafOf(key_hash)].hash.fetch_add(entryHash(key_hash, logical_time, node_id), std::memory_order_relaxed);
+    }
+
+    // Accounts for a timestamp change of a key. Must be called once for every change, with the
+    // exact timestamps it replaced and set
+    void update(uint64_t key_hash, uint32_t from_logical_time, uint32_t from_node_id,
+            uint32_t to_logical_time, uint32_t to_node_id) {
+        if (from_logical_time == to_logical_time && from_node_id == to_node_id) {
+            return;
+        }
+        uint64_t delta = entryHash(key_hash, to_logical_time, to_node_id)
+            - entryHash(key_hash, from_logical_time, from_node_id);
+        _leaves[leafOf(key_hash)].hash.fetch_add(delta, std::memory_order_relaxed);
+    }
+
+    void addRecord(uint64_t key_hash, T *record) {
+        Leaf &leaf = _leaves[leafOf(key_hash)];
+        std::unique_lock<std::mutex> lock(leaf.mutex);
+        leaf.records.push_back(record);
+    }
+
+    std::vector<T*> records(uint32_t leaf) {
+        std::unique_lock<std::mutex> lock(_leaves[leaf].mutex);
+        return _leaves[leaf].records;
+    }
+
+    // Hash of node `index` of `level`. Level 0 is the root, level DEPTH the leaves
+    uint64_t node(uint32_t level, uint32_t index) const {
+        uint32_t shift = (DEPTH - level) * FANOUT_BITS;
+        uint64_t hash = 0;
+        for (uint32_t leaf = index << shift; leaf < (index + 1) << shift; leaf++) {
+            hash += _leaves[leaf].hash.load(std::memory_order_relaxed);
+        }
+        return hash;
+    }
+};
@@ -0,0 +1,120 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+// Global hashed table of wait queues, keyed by the address of the object being waited on.
+// Lets objects that are waited on rarely (e.g. the per-key records) block threads and park
+// continuations without embedding a mutex and condition variable each. Objects that hash to
+// the same bucket share its condition variable, so wakeups are broadcast and waiters recheck
+// their predicate.
+//
+// Waiters check the predicate under the bucket lock. A notifier must make the predicate true
+// before calling unpark_all(), then it takes the bucket lock, so wakeups are never lost.
+class ParkingLot {
+private:
+    static constexpr size_t NumBuckets = 256;
+
+    struct Parked {
+        const void *addr;
+        std::function<void()> cont;
+    };
+
+    struct alignas(64) Bucket {
+        std::mutex mutex;
+        std::condition_variable cv;
+        std::vector<Parked> parked;
+        // Blocked threads plus parked continuations. Lets unpark_all() skip the lock when no
+        // one waits in the bucket, which is the common case
+        std::atomic<uint32_t> waiters {0};
+    };
+
+    std::array<Bucket, NumBuckets> _buckets;
+
+    Bucket& bucketFor(const void *addr) {
+        uintptr_t a = reinterpret_cast<uintptr_t>(addr);
+        // Records are at least 8 byte aligned, mix the high bits in
+        return _buckets[((a >> 4) ^ (a >> 12)) % NumBuckets];
+    }
+
+public:
+    static ParkingLot& global() {
+        static ParkingLot lot;
+        return lot;
+    }
+
+    template <typename Pred>
+    void wait(const void *addr, Pred &&ready) {
+        Bucket &bucket = bucketFor(addr);
+        std::unique_lock<std::mutex> lock(bucket.mutex);
+        bucket.waiters.fetch_add(1);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        bucket.cv.wait(lock, ready);
+        bucket.waiters.fetch_sub(1);
+    }
+
+    // Returns the final value of ready()
+    template <typename Pred, typename Rep, typename Period>
+    bool wait_for(const void *addr, Pred &&ready, std::chrono::duration<Rep, Period> timeout) {
+        Bucket &bucket = bucketFor(addr);
+        std::unique_lock<std::mutex> lock(bucket.mutex);
+        bucket.waiters.fetch_add(1);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        bool result = bucket.cv.wait_for(lock, timeout, ready);
+        bucket.waiters.fetch_sub(1);
+        return result;
+    }
+
+    // Parks `cont` on addr till the next unpark_all(addr). Doesn't block the calling thread.
+    // Returns false without parking if ready() is already true.
+    template <typename Pred>
+    bool park(const void *addr, Pred &&ready, std::function<void()> cont) {
+        Bucket &bucket = bucketFor(addr);
+        std::unique_lock<std::mutex> lock(bucket.mutex);
+        bucket.waiters.fetch_add(1);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (ready()) {
+            bucket.waiters.fetch_sub(1);
+            return false;
+        }
+        bucket.parked.push_back(Parked {addr, std::move(cont)});
+        return true;
+    }
+
+    // Wakes the threads blocked on addr and runs the continuations parked on it, outside the lock
+    void unpark_all(const void *addr) {
+        Bucket &bucket = bucketFor(addr);
+        // Pairs with the fence after a waiter registers: either it sees the notifier's update
+        // to the predicate or the notifier sees it waiting
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (bucket.waiters.load() == 0) {
+            return;
+        }
+        std::vector<std::function<void()>> to_resume;
+        {
+            std::unique_lock<std::mutex> lock(bucket.mutex);
+            std::vector<Parked> remaining;
+            for (auto& parked: bucket.parked) {
+                if (parked.addr == addr) {
+                    to_resume.push_back(std::move(parked.cont));
+                }
+                else {
+                    remaining.push_back(std::move(parked));
+                }
+            }
+            bucket.parked.swap(remaining);
+            bucket.waiters.fetch_sub(to_resume.size());
+        }
+        bucket.cv.notify_all();
+        for (auto& cont: to_resume) {
+            cont();
+        }
+    }
+};
@@ -0,0 +1,44 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+#include <thread>
+
+// Token bucket. acquire(n) blocks till n tokens (e.g. bytes) are available. The bucket holds at
+// most one second worth of tokens, so an idle period doesn't allow a long burst afterwards.
+// A rate of 0 means unlimited.
+class RateLimiter {
+private:
+    double _rate;
+    double _tokens;
+    std::chrono::steady_clock::time_point _last;
+    std::mutex _mutex;
+
+public:
+    explicit RateLimiter(uint64_t tokens_per_sec) :
+        _rate(tokens_per_sec),
+        _tokens(tokens_per_sec),
+        _last(std::chrono::steady_clock::now())
+        {}
+
+    void acquire(uint64_t tokens) {
+        if (_rate == 0) {
+            return;
+        }
+        std::chrono::duration<double> wait;
+        {
+            std::unique_lock<std::mutex> lock(_mutex);
+            auto now = std::chrono::steady_clock::now();
+            _tokens = std::min(_rate, _tokens + std::chrono::duration<double>(now - _last).count() * _rate);
+            _last = now;
+            // Go into debt and sleep it off, so that requests larger than the bucket still pass
+            _tokens -= tokens;
+            wait = std::chrono::duration<double>(_tokens < 0 ? -_tokens / _rate : 0);
+        }
+        if (wait.count() > 0) {
+            std::this_thread::sleep_for(wait);
+        }
+    }
+};
@@ -0,0 +1,107 @@
+#pragma once
+
+#include <array>
+#include <memory>
+#include <string>
+#include <mutex>
+#include <shared_mutex>
+#include <utility>
+#include <absl/container/flat_hash_map.h>
+#include <absl/hash/hash.h>
+#include <absl/strings/string_view.h>
+
+// Concurrent index from string keys to heap allocated values.
+// The key space is split into NumShards shards, each with its own lock, so that lookups and
+// inserts of unrelated keys don't contend on a single mutex. Callers hash the key once with
+// hash() and pass the hash to every call made for the same request.
+// Values are owned by the index and never move, so the returned raw pointers stay valid for
+// the lifetime of the index. A value owns its key, exposed as `absl::string_view key() const`,
+// and the shard tables key on views of it so that each key is stored once.
+template <typename T, typename Deleter = std::default_delete<T>, size_t NumShards = 64>
+class ShardedKeyIndex {
+private:
+    using ValuePtr = std::unique_ptr<T, Deleter>;
+
+    struct alignas(64) Shard {
+        mutable std::shared_mutex mutex;
+        absl::flat_hash_map<absl::string_view, ValuePtr> map;
+    };
+
+    std::array<Shard, NumShards> _shards;
+
+    Shard& shardFor(size_t hash) {
+        // The low bits of the hash are used by the shard's own table, pick the shard with the high bits
+        return _shards[(hash >> 32) % NumShards];
+    }
+
+    const Shard& shardFor(size_t hash) const {
+        return _shards[(hash >> 32) % NumShards];
+    }
+
+public:
+    ShardedKeyIndex() = default;
+
+    ~ShardedKeyIndex() = default;
+
+    // Same hash as the one used by the shard tables, so that it can be passed to find(key, hash)
+    static size_t hash(absl::string_view key) {
+        return absl::Hash<absl::string_view>{}(key);
+    }
+
+    // Returns nullptr if the key is not present
+    T* find(absl::string_view key, size_t hash) const {
+        const Shard &shard = shardFor(hash);
+        std::shared_lock<std::shared_mutex> lock(shard.mutex);
+        auto it = shard.map.find(key, hash);
+        if (it == shard.map.end()) {
+            return nullptr;
+        }
+        return it->second.get();
+    }
+
+    // Atomically inserts the value created by make_value() if the key is not present.
+    // Returns the value in the index and whether it was inserted by this call. make_value() is
+    // only called if the key is absent, so concurrent first inserts create a single value.
+    template <typename MakeValue>
+    std::pair<T*, bool> findOrInsert(absl::string_view key, size_t hash, MakeValue &&make_value) {
+        Shard &shard = shardFor(hash);
+        {
+            std::shared_lock<std::shared_mutex> lock(shard.mutex);
+            auto it = shard.map.find(key, hash);
+            if (it != shard.map.end()) {
+                return std::make_pair(it->second.get(), false);
+            }
+        }
+        std::unique_lock<std::shared_mutex> lock(shard.mutex);
+        // Check again, another thread might have inserted the key after we dropped the shared lock
+        auto it = shard.map.find(key, hash);
+        if (it != shard.map.end()) {
+            return std::make_pair(it->second.get(), false);
+        }
+        ValuePtr value = make_value();
+        T* raw = value.get();
+        shard.map.emplace(raw->key(), std::move(value));
+        return std::make_pair(raw, true);
+    }
+
+    size_t size() const {
+        size_t total = 0;
+        for (auto& shard: _shards) {
+            std::shared_lock<std::shared_mutex> lock(shard.mutex);
+            total += shard.map.size();
+        }
+        return total;
+    }
+
+    // Iterate with a callback. Holds one shard lock at a time, so the iteration is not a
+    // consistent snapshot of the whole index.
+    template <typename Callback>
+    void forEach(Callback &&callback) const {
+        for (auto& shard: _shards) {
+            std::shared_lock<std::shared_mutex> lock(shard.mutex);
+            for (const auto& [key, value] : shard.map) {
+                callback(key, value.get());
+            }
+        }
+    }
+};
@@ -0,0 +1,176 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <sstream>
+#include <string>
+#include <vector>
+
+// Size-class slab allocator for the bytes owned by the store (records and values).
+// Sizes are rounded up to a size class: 8, 16, 24, 32, 48, 64, 96, ... up to MaxClassSize, i.e.
+// powers of two with a half step in between, so no more than a third of a slot is wasted.
+// Each class carves fixed size slabs into slots and keeps freed slots in a free list, so an
+// overwrite with a value of a similar size reuses memory instead of going back to malloc, and
+// long runs don't fragment the heap.
+// Slabs are never returned to the OS. Memory handed out once stays mapped for the lifetime of
+// the process, which is what makes the optimistic (validated) reads of values safe even if the
+// slot was freed and reused in the meantime.
+// Sizes above MaxClassSize go to operator new and must not be read optimistically.
+class SlabAllocator {
+public:
+    static constexpr size_t MaxClassSize = 64 * 1024;
+    static constexpr size_t SlabSize = 256 * 1024;
+
+    struct ClassStats {
+        size_t slot_size;
+        size_t slabs;
+        size_t slots_used;
+        size_t bytes_requested;
+    };
+
+    struct Stats {
+        size_t bytes_live;      // Bytes requested by the live allocations
+        size_t bytes_wasted;    // Rounding to the size classes plus free slots in the slabs
+        size_t bytes_reserved;  // Slabs plus large allocations
+        size_t large_allocations;
+        std::vector<ClassStats> classes; // Classes with at least one slab
+
+        std::string toString() const {
+            std::ostringstream stream;
+            stream << "live=" << bytes_live << "B wasted=" << bytes_wasted << "B reserved="
+                   << bytes_reserved << "B large=" << large_allocations << " slabs_per_class=[";
+            for (size_t i = 0; i < classes.size(); i++) {
+                stream << (i ? " " : "") << classes[i].slot_size << ":" << classes[i].slabs;
+            }
+            stream << "]";
+            return stream.str();
+        }
+    };
+
+private:
+    struct FreeSlot {
+        FreeSlot *next;
+    };
+
+    struct alignas(64) SizeClass {
+        std::mutex mutex;
+        size_t slot_size = 0;
+        FreeSlot *free_list = nullptr;
+        char *bump = nullptr;   // Uncarved part of the newest slab
+        char *bump_end = nullptr;
+        std::vector<std::unique_ptr<char[]>> slabs;
+        size_t slots_used = 0;
+        std::atomic<size_t> bytes_requested {0};
+    };
+
+    static constexpr size_t NumClasses = 26;
+
+    std::array<SizeClass, NumClasses> _classes;
+    std::atomic<size_t> _large_bytes {0};
+    std::atomic<size_t> _large_allocations {0};
+
+    static size_t classSize(size_t index) {
+        // 8, 16, 24, 32, 48, 64, 96, 128, ...
+        if (index < 3) {
+            return 8 * (index + 1);
+        }
+        size_t power = size_t(32) << ((index - 3) / 2);
+        return (index - 3) % 2 == 0 ? power : power + power / 2;
+    }
+
+    static size_t classIndex(size_t size) {
+        if (size <= 24) {
+            return size <= 8 ? 0 : (size + 7) / 8 - 1;
+        }
+        size_t index = 3;
+        while (classSize(index) < size) {
+            index++;
+        }
+        return index;
+    }
+
+public:
+    SlabAllocator() {
+        for (size_t i = 0; i < NumClasses; i++) {
+            _classes[i].slot_size = classSize(i);
+        }
+    }
+
+    // Usable size of an allocation of `size` bytes
+    static size_t roundUp(size_t size) {
+        return size > MaxClassSize ? size : classSize(classIndex(size));
+    }
+
+    void* allocate(size_t size) {
+        if (size > MaxClassSize) {
+            _large_bytes.fetch_add(size, std::memory_order_relaxed);
+            _large_allocations.fetch_add(1, std::memory_order_relaxed);
+            return ::operator new(size);
+        }
+        SizeClass &size_class = _classes[classIndex(size)];
+        size_class.bytes_requested.fetch_add(size, std::memory_order_relaxed);
+        std::unique_lock<std::mutex> lock(size_class.mutex);
+        size_class.slots_used++;
+        if (size_class.free_list != nullptr) {
+            FreeSlot *slot = size_class.free_list;
+            size_class.free_list = slot->next;
+            return slot;
+        }
+        if (size_class.bump == size_class.bump_end) {
+            size_t slab_size = std::max(SlabSize, 8 * size_class.slot_size);
+            size_class.slabs.emplace_back(new char[slab_size]);
+            size_class.bump = size_class.slabs.back().get();
+            size_class.bump_end = size_class.bump + slab_size / size_class.slot_size * size_class.slot_size;
+        }
+        void *slot = size_class.bump;
+        size_class.bump += size_class.slot_size;
+        return slot;
+    }
+
+    // `size` is the size passed to allocate()
+    void deallocate(void *ptr, size_t size) {
+        if (size > MaxClassSize) {
+            _large_bytes.fetch_sub(size, std::memory_order_relaxed);
+            _large_allocations.fetch_sub(1, std::memory_order_relaxed);
+            ::operator delete(ptr);
+            return;
+        }
+        SizeClass &size_class = _classes[classIndex(size)];
+        size_class.bytes_requested.fetch_sub(size, std::memory_order_relaxed);
+        std::unique_lock<std::mutex> lock(size_class.mutex);
+        size_class.slots_used--;
+        FreeSlot *slot = static_cast<FreeSlot*>(ptr);
+        slot->next = size_class.free_list;
+        size_class.free_list = slot;
+    }
+
+    Stats stats() {
+        Stats stats {};
+        for (auto& size_class: _classes) {
+            std::unique_lock<std::mutex> lock(size_class.mutex);
+            if (size_class.slabs.empty()) {
+                continue;
+            }
+            size_t reserved = 0;
+            for (size_t i = 0; i < size_class.slabs.size(); i++) {
+                reserved += std::max(SlabSize, 8 * size_class.slot_size);
+            }
+            size_t requested = size_class.bytes_requested.load(std::memory_order_relaxed);
+            stats.bytes_live += requested;
+            stats.bytes_reserved += reserved;
+            stats.bytes_wasted += reserved - requested;
+            stats.classes.push_back(ClassStats {size_class.slot_size, size_class.slabs.size(),
+                    size_class.slots_used, requested});
+        }
+        size_t large = _large_bytes.load(std::memory_order_relaxed);
+        stats.bytes_live += large;
+        stats.bytes_reserved += large;
+        stats.large_allocations = _large_allocations.load(std::memory_order_relaxed);
+        return stats;
+    }
+};
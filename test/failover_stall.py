@@ -0,0 +1,113 @@
+# Failover stall benchmark. Clients write a set of keys through the first server while readers
+# on the other servers read them. The first server is then killed, which leaves the keys of its
+# in-flight writes INVALID on the followers, and readers of those keys stall till the replay
+# timeout expires and a follower replays the write. Prints the read latency before and after
+# the kill, and the stall times recorded by the servers.
+#
+# Start the servers first, e.g.
+#   python3 test_launcher.py --only-service
+# To compare against fixed 1 second timeouts:
+#   python3 test_launcher.py --only-service --server-args="--mlt_min_us=1000000 --replay_timeout_min_us=1000000"
+
+import argparse
+import random
+import sys
+import threading
+import time
+
+import grpc
+
+sys.path.append('../src/client/')
+from hermes_pb2 import ReadRequest, WriteRequest, TerminateRequest, GetStatsRequest
+from hermes_pb2_grpc import HermesStub
+from test_utils import parseConfigFile, gen_random_value
+
+
+def writer(server, keys, stop_event):
+    stub = HermesStub(grpc.insecure_channel(server))
+    while not stop_event.is_set():
+        try:
+            stub.Write(WriteRequest(key=random.choice(keys), value=gen_random_value()), timeout=5)
+        except grpc.RpcError:
+            # The coordinator was killed
+            return
+
+def reader(server, keys, stop_event, samples, lock):
+    stub = HermesStub(grpc.insecure_channel(server))
+    while not stop_event.is_set():
+        start = time.monotonic()
+        try:
+            stub.Read(ReadRequest(key=random.choice(keys)), timeout=10)
+        except grpc.RpcError:
+            continue
+        with lock:
+            samples.append((start, time.monotonic() - start))
+
+def percentile(values, q):
+    if not values:
+        return 0
+    values = sorted(values)
+    return values[min(len(values) - 1, int(q * len(values)))]
+
+def summary(latencies):
+    ms = [l * 1e3 for l in latencies]
+    return (f"{len(ms):>8} reads  p50 {percentile(ms, 0.5):8.2f} ms  p99 {percentile(ms, 0.99):8.2f} ms"
+            f"  max {max(ms, default=0):8.2f} ms")
+
+if __name__ == "__main__":
+    parser = argparse.ArgumentParser()
+    parser.add_argument('--config-file', type=str, default='../test_config.txt', help='server configuration file')
+    parser.add_argument('--num-keys', type=int, default=100, help='number of keys written and read')
+    parser.add_argument('--num-writers', type=int, default=16, help='clients writing through the killed server')
+    parser.add_argument('--num-readers', type=int, default=8, help='clients reading from each other server')
+    parser.add_argument('--warmup', type=float, default=5, help='seconds of load before the kill')
+    parser.add_argument('--after', type=float, default=5, help='seconds of load after the kill')
+    args = parser.parse_args()
+
+    server_list = parseConfigFile(args.config_file)
+    assert len(server_list) >= 2
+    victim, survivors = server_list[0], server_list[1:]
+    keys = [f"F{i}" for i in range(args.num_keys)]
+
+    stub = HermesStub(grpc.insecure_channel(victim))
+    for key in keys:
+        stub.Write(WriteRequest(key=key, value=gen_random_value()), timeout=5)
+
+    stop_event = threading.Event()
+    lock = threading.Lock()
+    samples = []
+    threads = [threading.Thread(target=writer, args=(victim, keys, stop_event)) for _ in range(args.num_writers)]
+    for server in survivors:
+        for _ in range(args.num_readers):
+            threads.append(threading.Thread(target=reader, args=(server, keys, stop_event, samples, lock)))
+    for t in threads:
+        t.start()
+
+    time.sleep(args.warmup)
+    kill_time = time.monotonic()
+    try:
+        stub.Terminate(TerminateRequest(graceful=False), timeout=5)
+    except grpc.RpcError:
+        pass
+    time.sleep(args.after)
+    stop_event.set()
+    for t in threads:
+        t.join()
+
+    # Reads that were in flight at the kill count as after it
+    before = [l for start, l in samples if start + l < kill_time]
+    after = [l for start, l in samples if start + l >= kill_time]
+    print(f"before kill: {summary(before)}")
+    print(f"after kill:  {summary(after)}")
+
+    for server in survivors:
+        try:
+            stats = HermesStub(grpc.insecure_channel(server)).GetStats(GetStatsRequest(), timeout=5)
+        except grpc.RpcError as e:
+            print(f"{server}: {e.code()}")
+            continue
+        counters = {c.name: c.value for c in stats.counters}
+        for h in stats.histograms:
+            if h.name == 'read_stall_seconds':
+                print(f"{server}: {h.count} stalled reads, p99 {h.p99 * 1e3:.2f} ms, max {h.max * 1e3:.2f} ms, "
+                      f"{counters.get('replays_total', 0)} replays, replay timeout {counters.get('replay_timeout_us', 0)} us")
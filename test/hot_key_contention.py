@@ -0,0 +1,88 @@
+# Hot-key contention benchmark. Measures the throughput of reads to unrelated keys, first on
+# an idle cluster and then while many clients hammer a single hot key with writes. With the
+# async server (--async_server) the unrelated-key throughput should stay flat, since requests
+# stalled on the hot key are parked instead of holding the gRPC server threads. With
+# --write_coalescing the hot-key writes queued on a coordinator share its invalidation rounds,
+# so the hot-key write throughput should grow with the number of hot writers.
+#
+# Start the servers first, e.g.
+#   python3 test_launcher.py --only-service --server-args="--async_server"
+#   python3 test_launcher.py --only-service --server-args="--write_coalescing"
+
+import argparse
+import logging
+import random
+import sys
+import threading
+import time
+
+sys.path.append('../src/client/')
+from client import HermesClient
+from test_utils import parseConfigFile, gen_random_value
+
+
+def hot_writer(server_list, hot_key, stop_event, counter, lock):
+    client = HermesClient(list(server_list), id=-1, logger=logging.getLogger('hot'))
+    while not stop_event.is_set():
+        try:
+            client.put(hot_key, gen_random_value(), num_retries=1, retry_timeout=5)
+        except Exception:
+            continue
+        with lock:
+            counter[0] += 1
+
+def unrelated_reader(server_list, keys, stop_event, counter, lock):
+    client = HermesClient(list(server_list), id=-1, logger=logging.getLogger('unrelated'))
+    while not stop_event.is_set():
+        try:
+            client.get(random.choice(keys), num_retries=1, retry_timeout=5)
+        except Exception:
+            continue
+        with lock:
+            counter[0] += 1
+
+def run_phase(server_list, keys, hot_key, num_readers, num_hot_writers, duration):
+    stop_event = threading.Event()
+    lock = threading.Lock()
+    reads = [0]
+    hot_writes = [0]
+    threads = []
+    for _ in range(num_hot_writers):
+        threads.append(threading.Thread(target=hot_writer, args=(server_list, hot_key, stop_event, hot_writes, lock)))
+    for _ in range(num_readers):
+        threads.append(threading.Thread(target=unrelated_reader, args=(server_list, keys, stop_event, reads, lock)))
+    for t in threads:
+        t.start()
+    time.sleep(duration)
+    stop_event.set()
+    for t in threads:
+        t.join()
+    return reads[0] / duration, hot_writes[0] / duration
+
+if __name__ == "__main__":
+    parser = argparse.ArgumentParser()
+    parser.add_argument('--config-file', type=str, default='../test_config.txt', help='server configuration file')
+    parser.add_argument('--num-keys', type=int, default=1000, help='number of unrelated keys')
+    parser.add_argument('--num-readers', type=int, default=8, help='clients reading unrelated keys')
+    parser.add_argument('--num-hot-writers', type=int, default=64, help='clients writing the hot key')
+    parser.add_argument('--duration', type=int, default=20, help='duration of each phase in seconds')
+    args = parser.parse_args()
+
+    server_list = parseConfigFile(args.config_file)
+    keys = [f"K{i}" for i in range(args.num_keys)]
+    hot_key = "HOT_KEY"
+
+    print("Populating unrelated keys..........")
+    client = HermesClient(list(server_list), id=-1, logger=logging.getLogger('populate'))
+    for key in keys:
+        client.put(key, gen_random_value())
+    client.put(hot_key, gen_random_value())
+
+    baseline, _ = run_phase(server_list, keys, hot_key, args.num_readers, 0, args.duration)
+    print(f"Unrelated-key read throughput (no contention): {baseline:.1f} ops/s")
+
+    contended, hot = run_phase(server_list, keys, hot_key, args.num_readers, args.num_hot_writers, args.duration)
+    print(f"Unrelated-key read throughput (hot-key storm): {contended:.1f} ops/s")
+    print(f"Hot-key write throughput: {hot:.1f} ops/s")
+    if baseline > 0:
+        print(f"Unrelated-key throughput retained: {100.0 * contended / baseline:.1f}%")
@@ -0,0 +1,88 @@
+# Adds a server to a running cluster with --join while clients keep writing, and checks that it
+# ends up with every key, including the ones written during the state transfer. A low
+# --transfer_mb_per_s in --server-args makes the transfer overlap more writes.
+#
+# Start the servers and the master first, e.g.
+#   python3 test_launcher.py --only-service
+
+import argparse
+import logging
+import os
+import subprocess
+import sys
+import threading
+import time
+
+import grpc
+
+sys.path.append('../src/client/')
+from client import HermesClient
+from hermes_pb2 import ReadRequest
+from hermes_pb2_grpc import HermesStub
+from test_utils import parseConfigFile, gen_random_value
+
+
+def wait_till_joined(addr, timeout_s):
+    stub = HermesStub(grpc.insecure_channel(addr))
+    deadline = time.time() + timeout_s
+    while time.time() < deadline:
+        try:
+            stub.Read(ReadRequest(key="JK0"), timeout=1)
+            return True
+        except grpc.RpcError:
+            # UNAVAILABLE till the key space is copied
+            time.sleep(0.2)
+    return False
+
+if __name__ == "__main__":
+    parser = argparse.ArgumentParser()
+    parser.add_argument('--config-file', type=str, default='../test_config.txt', help='server configuration file')
+    parser.add_argument('--build-dir', type=str, default='../build/src', help='directory of the server binary')
+    parser.add_argument('--log-dir', type=str, default='out', help='path to log dir')
+    parser.add_argument('--master-port', type=str, default='60060', help='master port')
+    parser.add_argument('--port', type=int, default=50070, help='port of the joining server')
+    parser.add_argument('--num-keys', type=int, default=5000, help='keys written before the join')
+    args = parser.parse_args()
+
+    server_list = parseConfigFile(args.config_file)
+    client = HermesClient(list(server_list), id=-1, logger=logging.getLogger('join'))
+
+    kvs = {f"JK{i}": gen_random_value(100) for i in range(args.num_keys)}
+    for key, value in kvs.items():
+        client.put(key, value)
+
+    # Keep writing while the new server copies the key space
+    stop = threading.Event()
+    def writer():
+        i = 0
+        while not stop.is_set():
+            key = f"JK{i % args.num_keys}"
+            kvs[key] = gen_random_value(100)
+            client.put(key, kvs[key])
+            i += 1
+    writer_thread = threading.Thread(target=writer)
+    writer_thread.start()
+
+    os.makedirs(args.log_dir, exist_ok=True)
+    cmd = (f"{args.build_dir}/server --id={args.port} --port={args.port} --log_dir={args.log_dir} "
+           f"--config_file={args.config_file} --master_port={args.master_port} --join")
+    print(cmd)
+    with open(args.log_dir + f'/server_{args.port}.log', 'w') as f:
+        process = subprocess.Popen(cmd, shell=True, stdout=f, stderr=f, preexec_fn=os.setsid)
+
+    new_server = f'localhost:{args.port}'
+    joined = wait_till_joined(new_server, timeout_s=120)
+    stop.set()
+    writer_thread.join()
+    assert joined, f"{new_server} did not finish joining"
+
+    replica = HermesClient([new_server], id=-1, logger=logging.getLogger('join'))
+    for key, value in kvs.items():
+        assert replica.get(key) == value, f"{new_server}: {key} = {replica.get(key)}, expected {value}"
+
+    # The new server takes part in writes
+    client.put("JK_AFTER", "after")
+    assert replica.get("JK_AFTER") == "after"
+    replica.put("JK_FROM_NEW", "new")
+    assert client.get("JK_FROM_NEW") == "new"
+    print("Join test passed")
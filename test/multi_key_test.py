@@ -0,0 +1,42 @@
+# Checks MultiWrite / MultiRead against the single key RPCs.
+#
+# Start the servers first, e.g.
+#   python3 test_launcher.py --only-service
+
+import argparse
+import logging
+import sys
+
+sys.path.append('../src/client/')
+from client import HermesClient
+from test_utils import parseConfigFile, gen_random_value
+
+
+if __name__ == "__main__":
+    parser = argparse.ArgumentParser()
+    parser.add_argument('--config-file', type=str, default='../test_config.txt', help='server configuration file')
+    parser.add_argument('--batch-size', type=int, default=100, help='keys per batch')
+    args = parser.parse_args()
+
+    server_list = parseConfigFile(args.config_file)
+    client = HermesClient(list(server_list), id=-1, logger=logging.getLogger('multi'))
+
+    kvs = {f"MK{i}": gen_random_value() for i in range(args.batch_size)}
+    failed = client.multi_put(kvs)
+    assert not failed, f"MultiWrite failed for {failed}"
+
+    # Every replica must return the batch, both batched and one key at a time
+    for server in server_list:
+        replica = HermesClient([server], id=-1, logger=logging.getLogger('multi'))
+        values = replica.multi_get(list(kvs.keys()) + ["MK_MISSING"])
+        assert "MK_MISSING" not in values
+        for key, value in kvs.items():
+            assert values[key] == value, f"{server}: MultiRead {key} = {values.get(key)}, expected {value}"
+            assert replica.get(key) == value, f"{server}: Read {key} differs from MultiWrite"
+
+    # Repeated keys in a batch are applied in order
+    failed = client.multi_put({"MK0": "first"})
+    failed += client.multi_put({"MK0": "second"})
+    assert not failed
+    assert client.multi_get(["MK0"])["MK0"] == "second"
+    print("MultiRead / MultiWrite test passed")
@@ -0,0 +1,96 @@
+# Checks CompareAndSwap, FetchAdd and Append. Clients on every server update the same keys
+# concurrently, so the RMWs conflict across coordinators, and no update may be lost or applied
+# twice.
+#
+# Start the servers first, e.g.
+#   python3 test_launcher.py --only-service
+
+import argparse
+import logging
+import sys
+import threading
+
+sys.path.append('../src/client/')
+from client import HermesClient
+from test_utils import parseConfigFile
+
+
+def adder(server, key, num_ops, seen, lock):
+    client = HermesClient([server], id=-1, logger=logging.getLogger('rmw'))
+    for _ in range(num_ops):
+        previous = client.fetch_add(key, 1)
+        with lock:
+            seen.append(previous)
+
+def appender(server, key, tag, num_ops):
+    client = HermesClient([server], id=-1, logger=logging.getLogger('rmw'))
+    for i in range(num_ops):
+        client.append(key, f"{tag}.{i};")
+
+def cas_incrementer(server, key, num_ops, retries):
+    client = HermesClient([server], id=-1, logger=logging.getLogger('rmw'))
+    for _ in range(num_ops):
+        current = client.get(key)
+        while True:
+            swapped, current = client.compare_and_swap(key, current, str(int(current) + 1))
+            if swapped:
+                break
+            retries[0] += 1
+
+def run(threads):
+    for t in threads:
+        t.start()
+    for t in threads:
+        t.join()
+
+if __name__ == "__main__":
+    parser = argparse.ArgumentParser()
+    parser.add_argument('--config-file', type=str, default='../test_config.txt', help='server configuration file')
+    parser.add_argument('--clients-per-server', type=int, default=4, help='concurrent clients on each server')
+    parser.add_argument('--num-ops', type=int, default=200, help='updates per client')
+    args = parser.parse_args()
+
+    server_list = parseConfigFile(args.config_file)
+    clients = [server for server in server_list for _ in range(args.clients_per_server)]
+    total = len(clients) * args.num_ops
+
+    # Every FetchAdd returns a distinct previous value, and none is lost
+    lock = threading.Lock()
+    seen = []
+    run([threading.Thread(target=adder, args=(server, "RMW_COUNTER", args.num_ops, seen, lock)) for server in clients])
+    assert sorted(seen) == list(range(total)), "FetchAdd lost or repeated an update"
+    for server in server_list:
+        value = HermesClient([server], id=-1, logger=logging.getLogger('rmw')).get("RMW_COUNTER")
+        assert value == str(total), f"{server}: counter is {value}, expected {total}"
+
+    # Appends of each client are all there, in the order it made them
+    run([threading.Thread(target=appender, args=(server, "RMW_LIST", c, args.num_ops)) for c, server in enumerate(clients)])
+    items = HermesClient(server_list, id=-1, logger=logging.getLogger('rmw')).get("RMW_LIST").split(";")[:-1]
+    assert len(items) == total, f"{len(items)} appended items, expected {total}"
+    for c in range(len(clients)):
+        assert [int(i.split(".")[1]) for i in items if i.split(".")[0] == str(c)] == list(range(args.num_ops))
+
+    # A failed CAS of a missing key doesn't create it
+    client = HermesClient(server_list, id=-1, logger=logging.getLogger('rmw'))
+    swapped, _ = client.compare_and_swap("RMW_MISSING", "x", "y")
+    assert not swapped, "CAS of a missing key matched a non-empty value"
+    assert "RMW_MISSING" not in client.multi_get(["RMW_MISSING"]), "failed CAS created the key"
+
+    # A CAS loop is a counter too
+    retries = [0]
+    swapped, _ = HermesClient(server_list, id=-1, logger=logging.getLogger('rmw')).compare_and_swap("RMW_CAS", "", "0")
+    assert swapped, "CAS of a missing key didn't see it empty"
+    run([threading.Thread(target=cas_incrementer, args=(server, "RMW_CAS", args.num_ops, retries)) for server in clients])
+    value = HermesClient(server_list, id=-1, logger=logging.getLogger('rmw')).get("RMW_CAS")
+    assert value == str(total), f"CAS counter is {value}, expected {total}"
+
+    # FetchAdd of a value that isn't a number fails and leaves it as is
+    client = HermesClient(server_list, id=-1, logger=logging.getLogger('rmw'))
+    client.put("RMW_TEXT", "abc")
+    try:
+        client.fetch_add("RMW_TEXT", 1)
+        assert False, "FetchAdd of a string succeeded"
+    except Exception as e:
+        assert e.code().name == "INVALID_ARGUMENT"
+    assert client.get("RMW_TEXT") == "abc"
+    print(f"RMW test passed ({retries[0]} failed compares)")
@@ -0,0 +1,72 @@
+# Checks the Scan RPC against the keys written: bounds, pagination and ordering, on every
+# replica, while writers keep updating the scanned keys.
+#
+# Start the servers first, e.g.
+#   python3 test_launcher.py --only-service --server-args="--ordered_index"
+
+import argparse
+import logging
+import random
+import sys
+import threading
+
+sys.path.append('../src/client/')
+from client import HermesClient
+from test_utils import parseConfigFile
+
+
+def writer(server_list, keys, stop_event):
+    client = HermesClient(list(server_list), id=-1, logger=logging.getLogger('scan'))
+    while not stop_event.is_set():
+        key = random.choice(keys)
+        client.put(key, f"{key}:{random.randint(1, 1000000)}")
+
+def scan_all(client, start, end, page_size):
+    items = []
+    while start is not None:
+        page, start = client.scan(start, end, limit=page_size)
+        assert len(page) <= page_size
+        items.extend(page)
+    return items
+
+if __name__ == "__main__":
+    parser = argparse.ArgumentParser()
+    parser.add_argument('--config-file', type=str, default='../test_config.txt', help='server configuration file')
+    parser.add_argument('--num-keys', type=int, default=2000, help='number of keys written')
+    parser.add_argument('--page-size', type=int, default=97, help='keys per Scan page')
+    parser.add_argument('--num-writers', type=int, default=4, help='clients updating the keys during the scans')
+    args = parser.parse_args()
+
+    server_list = parseConfigFile(args.config_file)
+    client = HermesClient(list(server_list), id=-1, logger=logging.getLogger('scan'))
+
+    keys = sorted(f"SCAN{i:06d}" for i in range(args.num_keys))
+    for key in keys:
+        client.put(key, f"{key}:0")
+
+    stop_event = threading.Event()
+    writers = [threading.Thread(target=writer, args=(server_list, keys, stop_event)) for _ in range(args.num_writers)]
+    for t in writers:
+        t.start()
+
+    lo, hi = keys[len(keys) // 4], keys[3 * len(keys) // 4]
+    try:
+        for server in server_list:
+            replica = HermesClient([server], id=-1, logger=logging.getLogger('scan'))
+            # Other tests may have written keys outside the SCAN prefix, so bound the range
+            items = scan_all(replica, "SCAN", "SCAO", args.page_size)
+            assert [k for k, _ in items] == keys, f"{server}: scan returned {len(items)} keys, expected {len(keys)}"
+            # Values are always of a committed write of the key
+            for key, value in items:
+                assert value.startswith(key + ":"), f"{server}: {key} = {value}"
+
+            items = scan_all(replica, lo, hi, args.page_size)
+            assert [k for k, _ in items] == [k for k in keys if lo <= k < hi], f"{server}: wrong keys in [{lo}, {hi})"
+
+            page, next_start = replica.scan(lo, limit=10)
+            assert [k for k, _ in page] == keys[len(keys) // 4:][:10] and next_start == keys[len(keys) // 4 + 10]
+    finally:
+        stop_event.set()
+        for t in writers:
+            t.join()
+    print("Scan test passed")
@@ -0,0 +1,44 @@
+# Prints the latency histograms of every server in the config, from the GetStats RPC.
+# With --text, prints the Prometheus text exposition of each server instead.
+#
+# Start the servers first, e.g.
+#   python3 test_launcher.py --only-service
+
+import argparse
+import sys
+
+import grpc
+
+sys.path.append('../src/client/')
+from hermes_pb2 import GetStatsRequest
+from hermes_pb2_grpc import HermesStub
+from test_utils import parseConfigFile
+
+
+def fmt(name, value):
+    # Latencies in us, counts as is
+    return f"{value * 1e6:.1f}" if name.endswith('_seconds') else f"{value:.0f}"
+
+if __name__ == "__main__":
+    parser = argparse.ArgumentParser()
+    parser.add_argument('--config-file', type=str, default='../test_config.txt', help='server configuration file')
+    parser.add_argument('--text', action='store_true', help='print the Prometheus text format')
+    args = parser.parse_args()
+
+    for server in parseConfigFile(args.config_file):
+        stub = HermesStub(grpc.insecure_channel(server))
+        try:
+            stats = stub.GetStats(GetStatsRequest(text=args.text), timeout=5)
+        except grpc.RpcError as e:
+            print(f"{server}: {e.code()}")
+            continue
+        print(f"== {server}")
+        if args.text:
+            print(stats.text, end='')
+            continue
+        print(f"{'histogram (us)':<20}{'count':>10}{'mean':>10}{'p50':>10}{'p90':>10}{'p99':>10}{'p99.9':>10}{'max':>10}")
+        for h in stats.histograms:
+            row = [fmt(h.name, v) for v in (h.mean, h.p50, h.p90, h.p99, h.p999, h.max)]
+            print(f"{h.name:<20}{h.count:>10}" + ''.join(f"{v:>10}" for v in row))
+        for c in stats.counters:
+            print(f"{c.name:<30}{c.value:>10}")
@@ -15,6 +15,7 @@ from datetime import datetime
 build_dir = ''
 db_dir = ''
 log_dir = ''
+server_args = ''
 
 load_measurement_processes = []
 master_processes = {}
@@ -61,6 +62,8 @@ def getServerCmd(log_dir, config_file, port, master_port, db_dir):
     cmd += ' ' + f'--config_file={config_file}'
     cmd += ' ' + f'--master_port={master_port}'
     cmd += ' ' + f'--db_dir={db_dir}'
+    if server_args:
+        cmd += ' ' + server_args
     
     return cmd
 
@@ -358,6 +361,7 @@ if __name__ == "__main__":
     parser.add_argument('--num-keys', type=int, default=1000, help='number of gets to put and get in sanity test')
     parser.add_argument('--write-percentage', type=int, default=0, help='write percentage for performance tests')
     parser.add_argument('--protocol', type=str, default='hermes', help="replication protocol - hermes or cr")
+    parser.add_argument('--server-args', type=str, default='', help='extra flags passed to every server, e.g. "--inv_batch_window_us=200"')
 
     parser.add_argument('--only-clients', action='store_true')
     parser.add_argument('--only-service', action='store_true')
@@ -367,6 +371,7 @@ if __name__ == "__main__":
     args = parser.parse_args()
     
     top_dir = args.top_dir
+    server_args = args.server_args
 
     if (args.protocol == 'hermes'):
         build_dir = top_dir + '/build/src'